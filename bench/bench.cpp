@@ -0,0 +1,388 @@
+// Benchmarks compile latency and run time of jitCalc programs: the files in the corpus
+// directory, and generated programs with thousands of functions or top-level expressions.
+// Each benchmark runs in a child process so that its peak RSS is its own, the child sends
+// the median of its repetitions back as JSON. Results can be compared to a baseline written
+// by an earlier run.
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <optional>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "engine.h"
+#include "emit.h"
+#include "output.h"
+#include "parse.h"
+
+using namespace llvm;
+
+cl::opt<std::string> corpusDir("corpus", cl::desc("Directory of .jc programs to benchmark"), cl::init(JITCALC_BENCH_CORPUS));
+cl::opt<std::string> filter("filter", cl::desc("Only run benchmarks whose name contains this"), cl::init(""));
+cl::opt<unsigned>    repetitions("reps", cl::desc("Compilations of each program, the median is reported"), cl::init(5));
+cl::opt<unsigned>    runsPerRep("runs", cl::desc("Executions of each compiled program for the steady state time"), cl::init(10));
+cl::opt<std::string> outFile("o", cl::desc("Write the results as JSON to a file"), cl::init(""));
+cl::opt<std::string> baselineFile("baseline", cl::desc("Compare with the results of an earlier run"), cl::init(""));
+cl::opt<double>      threshold("threshold", cl::desc("Percentage by which a metric may exceed the baseline"), cl::init(10.0));
+
+using Clock = std::chrono::steady_clock;
+
+struct Benchmark {
+    std::string name;
+    std::string source;
+};
+
+// in the order they are reported
+static const char *metricNames[] = {
+    "first_result_ms", // parse, emit, optimise, codegen and one execution
+    "optimise_ms",
+    "codegen_ms",
+    "execute_ms",      // median over the executions after the first
+    "peak_rss_kib",
+};
+enum Metric { FirstResult, Optimise, Codegen, Execute, PeakRss, NumMetrics };
+
+using Metrics = std::array<double, NumMetrics>;
+
+
+static double msSince(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+
+static double median(std::vector<double> values) {
+    assert(!values.empty());
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+
+// a chain of small functions, each calling the one before
+static std::string manyFunctions(size_t n) {
+    std::string source = "fn f0(x)\n  return x\n\n";
+    for (size_t i = 1; i < n; i++) {
+        source += "fn f" + std::to_string(i) + "(x)\n";
+        source += "  return f" + std::to_string(i - 1) + "(x) + " + std::to_string(i % 7) + "\n\n";
+    }
+    source += "f" + std::to_string(n - 1) + "(1)\n";
+    return source;
+}
+
+
+// a script of independent top-level expressions
+static std::string giantScript(size_t n) {
+    std::string source;
+    for (size_t i = 1; i <= n; i++) {
+        auto x = std::to_string(i);
+        source += x + " * " + x + " + " + x + " / 3 - (" + x + " - 1) * 2\n";
+    }
+    return source;
+}
+
+
+static std::vector<Benchmark> loadBenchmarks() {
+    std::vector<Benchmark> benchmarks;
+
+    std::error_code errorCode;
+    for (sys::fs::directory_iterator it(corpusDir, errorCode), end; it != end && !errorCode; it.increment(errorCode)) {
+        if (sys::path::extension(it->path()) != ".jc") {
+            continue;
+        }
+        auto buffer = MemoryBuffer::getFile(it->path());
+        if (!buffer) {
+            errs() << "Cannot read " << it->path() << ": " << buffer.getError().message() << "\n";
+            continue;
+        }
+        benchmarks.push_back(Benchmark{sys::path::stem(it->path()).str(), (*buffer)->getBuffer().str()});
+    }
+    if (errorCode) {
+        errs() << "Cannot read " << corpusDir << ": " << errorCode.message() << "\n";
+    }
+    std::sort(benchmarks.begin(), benchmarks.end(), [](auto &a, auto &b) { return a.name < b.name; });
+
+    benchmarks.push_back(Benchmark{"many_functions", manyFunctions(2000)});
+    benchmarks.push_back(Benchmark{"giant_script", giantScript(20000)});
+
+    benchmarks.erase(std::remove_if(benchmarks.begin(), benchmarks.end(), [](auto &bench) {
+        return bench.name.find(filter) == std::string::npos;
+    }), benchmarks.end());
+    return benchmarks;
+}
+
+
+// compiles and runs a program like file mode, the results go to stdout
+static Expected<Metrics> measure(const Benchmark &bench) {
+    auto engine = Engine::create(EngineOptions());
+    if (!engine) {
+        return engine.takeError();
+    }
+    auto &jit     = (*engine)->getJIT();
+    auto &context = (*engine)->getContext();
+
+    std::vector<double> samples[NumMetrics];
+    for (unsigned rep = 0; rep < repetitions; rep++) {
+        auto dyLib = (*engine)->createDyLib("bench" + std::to_string(rep));
+        if (!dyLib) {
+            return dyLib.takeError();
+        }
+
+        auto start = Clock::now();
+        auto buffer = MemoryBuffer::getMemBuffer(bench.source, bench.name, false);
+        Sparse<ast::Node>::Key programKey;
+        auto *prog = parse(programKey, *buffer);
+        if (prog == nullptr) {
+            return createStringError(inconvertibleErrorCode(), "%s has syntax errors", bench.name.c_str());
+        }
+
+        void (*funcPtr)();
+        {
+            auto lock = context.getLock();
+            Emit emit(*context.getContext(), "jitCalc_bench", "main", EmitOptions(), bench.name + ".jc");
+            emit.emitProgram(programKey, *prog);
+            emit.mod().finaliseDebug();
+            if (auto err = emit.takeError()) {
+                return std::move(err);
+            }
+            emit.mod().verifyModule();
+
+            auto optimiseStart = Clock::now();
+            emit.mod().optimiseModule((*engine)->getOptimiser());
+            samples[Optimise].push_back(msSince(optimiseStart));
+
+            auto codegenStart = Clock::now();
+            if (auto err = jit.addIRModule(*dyLib, orc::ThreadSafeModule(emit.mod().moveModule(), context))) {
+                return std::move(err);
+            }
+            auto symbol = jit.lookup(*dyLib, "main");
+            if (!symbol) {
+                return symbol.takeError();
+            }
+            funcPtr = symbol->toPtr<void(*)()>();
+            samples[Codegen].push_back(msSince(codegenStart));
+        }
+
+        // division by zero throws out of the program, the corpus shouldn't divide by zero
+        // but a benchmark which does still measures the work up to it
+        auto run = [funcPtr] {
+            try {
+                funcPtr();
+            } catch (int) {
+            }
+            runtime::flushOutput();
+        };
+
+        run();
+        samples[FirstResult].push_back(msSince(start));
+
+        std::vector<double> executions;
+        for (unsigned i = 0; i < runsPerRep; i++) {
+            auto executeStart = Clock::now();
+            run();
+            executions.push_back(msSince(executeStart));
+        }
+        if (!executions.empty()) {
+            samples[Execute].push_back(median(executions));
+        }
+
+        if (auto err = jit.getExecutionSession().removeJITDylib(*dyLib)) {
+            return std::move(err);
+        }
+    }
+
+    Metrics metrics{};
+    for (size_t i = 0; i < NumMetrics; i++) {
+        metrics[i] = samples[i].empty() ? 0 : median(samples[i]);
+    }
+    return metrics;
+}
+
+
+static json::Object toJSON(const Metrics &metrics) {
+    json::Object object;
+    for (size_t i = 0; i < NumMetrics; i++) {
+        object[metricNames[i]] = metrics[i];
+    }
+    return object;
+}
+
+
+static std::optional<Metrics> fromJSON(const json::Object &object) {
+    Metrics metrics{};
+    for (size_t i = 0; i < NumMetrics; i++) {
+        auto value = object.getNumber(metricNames[i]);
+        if (!value) {
+            return std::nullopt;
+        }
+        metrics[i] = *value;
+    }
+    return metrics;
+}
+
+
+// runs a benchmark in a child process with stdout discarded, the metrics come back
+// through a pipe
+static Expected<Metrics> runChild(const Benchmark &bench) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return errorCodeToError(std::error_code(errno, std::generic_category()));
+    }
+
+    outs().flush();
+    errs().flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        return errorCodeToError(std::error_code(errno, std::generic_category()));
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+
+        raw_fd_ostream result(fds[1], true);
+        auto metrics = measure(bench);
+        if (!metrics) {
+            errs() << bench.name << ": " << toString(metrics.takeError()) << "\n";
+            errs().flush();
+            _exit(1);
+        }
+        result << json::Value(toJSON(*metrics));
+        result.flush();
+        _exit(0);
+    }
+
+    close(fds[1]);
+    std::string output;
+    char chunk[4096];
+    for (ssize_t n; (n = read(fds[0], chunk, sizeof(chunk))) != 0;) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            break;
+        }
+        output.append(chunk, n);
+    }
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) < 0 && errno == EINTR) {
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return createStringError(inconvertibleErrorCode(), "%s failed", bench.name.c_str());
+    }
+
+    auto value = json::parse(output);
+    if (!value) {
+        return value.takeError();
+    }
+    auto metrics = value->getAsObject() ? fromJSON(*value->getAsObject()) : std::nullopt;
+    if (!metrics) {
+        return createStringError(inconvertibleErrorCode(), "%s sent malformed results", bench.name.c_str());
+    }
+    (*metrics)[PeakRss] = usage.ru_maxrss; // KiB on linux
+    return *metrics;
+}
+
+
+// prints the metrics which exceed the baseline by more than the threshold, returns how many
+static size_t compareBaseline(const json::Object &results, const json::Object &baseline) {
+    size_t regressions = 0;
+    for (auto &[name, value] : results) {
+        auto *baseObject = baseline.getObject(name);
+        if (baseObject == nullptr) {
+            outs() << name << ": not in the baseline\n";
+            continue;
+        }
+        auto current = fromJSON(*value.getAsObject());
+        auto base    = fromJSON(*baseObject);
+        if (!base) {
+            outs() << name << ": malformed in the baseline\n";
+            continue;
+        }
+
+        for (size_t i = 0; i < NumMetrics; i++) {
+            double change = (*base)[i] > 0 ? ((*current)[i] / (*base)[i] - 1) * 100 : 0;
+            if (change > threshold) {
+                outs() << format("REGRESSION %s %s: %.3f -> %.3f (+%.1f%%)\n",
+                    StringRef(name).str().c_str(), metricNames[i], (*base)[i], (*current)[i], change);
+                regressions++;
+            }
+        }
+    }
+    return regressions;
+}
+
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv, "jitCalc benchmarks\n");
+
+    auto benchmarks = loadBenchmarks();
+    if (benchmarks.empty()) {
+        errs() << "No benchmarks to run\n";
+        return 1;
+    }
+
+    outs() << formatv("{0,-20} {1,16} {2,12} {3,12} {4,12} {5,12}\n",
+        "benchmark", "first result ms", "optimise ms", "codegen ms", "execute ms", "peak RSS KiB");
+
+    json::Object results;
+    bool failed = false;
+    for (auto &bench : benchmarks) {
+        auto metrics = runChild(bench);
+        if (!metrics) {
+            errs() << toString(metrics.takeError()) << "\n";
+            failed = true;
+            continue;
+        }
+        auto &m = *metrics;
+        outs() << format("%-20s %16.3f %12.3f %12.3f %12.3f %12.0f\n",
+            bench.name.c_str(), m[FirstResult], m[Optimise], m[Codegen], m[Execute], m[PeakRss]);
+        results[bench.name] = toJSON(m);
+    }
+
+    if (!outFile.empty()) {
+        std::error_code errorCode;
+        raw_fd_ostream file(outFile, errorCode, sys::fs::OF_Text);
+        if (errorCode) {
+            errs() << "Cannot write " << outFile << ": " << errorCode.message() << "\n";
+            return 1;
+        }
+        file << formatv("{0:2}", json::Value(json::Object(results))) << "\n";
+    }
+
+    if (!baselineFile.empty()) {
+        auto buffer = MemoryBuffer::getFile(baselineFile);
+        if (!buffer) {
+            errs() << "Cannot read " << baselineFile << ": " << buffer.getError().message() << "\n";
+            return 1;
+        }
+        auto baseline = json::parse((*buffer)->getBuffer());
+        if (!baseline || baseline->getAsObject() == nullptr) {
+            errs() << baselineFile << " isn't a results file\n";
+            consumeError(baseline.takeError());
+            return 1;
+        }
+        if (compareBaseline(results, *baseline->getAsObject()) > 0) {
+            return 2;
+        }
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,353 @@
+// Microbenchmarks of the containers and the lexer on the compiler's hot paths: Sparse<ast::Node>
+// under churn, SymbolTable lookups at different scope depths and sizes, and Lexer2::nextToken on
+// a few mixes of tokens. Each benchmark runs for at least -min-time and reports the time and the
+// heap allocations of one operation, counted by replacing the global operator new.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "ast.h"
+#include "lexer.h"
+#include "sparse.h"
+#include "symbols.h"
+
+using namespace llvm;
+
+cl::opt<std::string> filter("filter", cl::desc("Only run benchmarks whose name contains this"), cl::init(""));
+cl::opt<double>      minTime("min-time", cl::desc("Seconds each benchmark runs for at least"), cl::init(0.5));
+
+using Clock = std::chrono::steady_clock;
+
+
+// the benchmarks are single threaded, so the counts don't need to be atomic
+static size_t allocationCount = 0;
+
+void *operator new(size_t size) {
+    allocationCount++;
+    if (void *ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { std::free(ptr); }
+
+
+// keeps the compiler from removing a computation whose result isn't used
+template <typename T>
+static void doNotOptimise(T &&value) {
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+
+// passed to a benchmark, which performs 'iterations' operations and may exclude
+// its setup from the measurement with pause and resume
+class State {
+public:
+    explicit State(size_t iterations) : iterations(iterations) {}
+
+    void pause() {
+        pausedAt            = Clock::now();
+        allocationsAtPause  = allocationCount;
+    }
+
+    void resume() {
+        excluded            += Clock::now() - pausedAt;
+        excludedAllocations += allocationCount - allocationsAtPause;
+    }
+
+    const size_t iterations;
+
+private:
+    friend struct Measurement;
+
+    Clock::time_point pausedAt;
+    Clock::duration   excluded{};
+    size_t            allocationsAtPause  = 0;
+    size_t            excludedAllocations = 0;
+};
+
+
+struct Benchmark {
+    std::string name;
+    std::function<void(State &)> run;
+};
+
+
+struct Measurement {
+    size_t iterations;
+    double seconds;
+    size_t allocations;
+
+    static Measurement of(const Benchmark &bench, size_t iterations) {
+        State state(iterations);
+        size_t allocationsBefore = allocationCount;
+        auto start = Clock::now();
+        bench.run(state);
+        auto elapsed = Clock::now() - start - state.excluded;
+        return Measurement{
+            iterations,
+            std::chrono::duration<double>(elapsed).count(),
+            allocationCount - allocationsBefore - state.excludedAllocations,
+        };
+    }
+};
+
+
+// grows the iterations until a run takes at least minTime, like google benchmark
+static Measurement measure(const Benchmark &bench) {
+    size_t iterations = 1;
+    for (;;) {
+        auto measurement = Measurement::of(bench, iterations);
+        if (measurement.seconds >= minTime || iterations >= (size_t(1) << 40)) {
+            return measurement;
+        }
+        double multiplier = measurement.seconds > 0 ? minTime * 1.4 / measurement.seconds : 10;
+        multiplier = std::min(std::max(multiplier, 2.0), 10.0);
+        iterations = size_t(iterations * multiplier);
+    }
+}
+
+
+// xorshift, the same sequence on every run
+class Random {
+public:
+    size_t next(size_t bound) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state % bound;
+    }
+
+private:
+    uint64_t state = 0x9e3779b97f4a7c15;
+};
+
+
+static ast::Node integerNode(int value) {
+    return ast::Integer(TextPos(1, 1, 0), value);
+}
+
+
+// inserts into an empty container until it holds n nodes, then clears it
+static void sparseFill(State &state, size_t n) {
+    Sparse<ast::Node> sparse;
+    auto node = integerNode(1);
+    for (size_t i = 0; i < state.iterations; i++) {
+        if (sparse.size() == n) {
+            sparse.clear();
+        }
+        doNotOptimise(sparse.insert(node));
+    }
+}
+
+
+// removes a random node from n and inserts one into the freed slot
+static void sparseChurn(State &state, size_t n) {
+    state.pause();
+    Sparse<ast::Node> sparse;
+    std::vector<Sparse<ast::Node>::Key> keys;
+    auto node = integerNode(1);
+    for (size_t i = 0; i < n; i++) {
+        keys.push_back(sparse.insert(node));
+    }
+    state.resume();
+
+    Random random;
+    for (size_t i = 0; i < state.iterations; i++) {
+        auto &key = keys[random.next(n)];
+        sparse.remove(key);
+        key = sparse.insert(node);
+    }
+    doNotOptimise(sparse.size());
+}
+
+
+// reads n nodes in a random order, as emit does following child keys
+static void sparseAt(State &state, size_t n) {
+    state.pause();
+    Sparse<ast::Node> sparse;
+    std::vector<Sparse<ast::Node>::Key> keys;
+    for (size_t i = 0; i < n; i++) {
+        keys.push_back(sparse.insert(integerNode(int(i))));
+    }
+    Random random;
+    std::vector<Sparse<ast::Node>::Key> order;
+    for (size_t i = 0; i < n; i++) {
+        order.push_back(keys[random.next(n)]);
+    }
+    state.resume();
+
+    int sum = 0;
+    for (size_t i = 0; i < state.iterations; i++) {
+        sum += std::get<ast::Integer>(sparse.at(order[i % n])).integer;
+    }
+    doNotOptimise(sum);
+}
+
+
+// clears a container of n nodes, one operation per node
+static void sparseClear(State &state, size_t n) {
+    Sparse<ast::Node> sparse;
+    auto node = integerNode(1);
+    for (size_t i = 0; i < state.iterations; i += n) {
+        state.pause();
+        for (size_t j = 0; j < n; j++) {
+            sparse.insert(node);
+        }
+        state.resume();
+        sparse.clear();
+    }
+}
+
+
+static std::string symbolName(size_t depth, size_t i) {
+    return "sym" + std::to_string(depth) + "_" + std::to_string(i);
+}
+
+
+// looks up the symbols of the innermost or outermost of 'depth' scopes of 'size' symbols each
+static void symbolLook(State &state, size_t depth, size_t size, bool outermost) {
+    state.pause();
+    SymbolTable table;
+    for (size_t d = 0; d < depth; d++) {
+        if (d > 0) {
+            table.pushScope();
+        }
+        for (size_t i = 0; i < size; i++) {
+            table.insert(symbolName(d, i));
+        }
+    }
+
+    std::vector<std::string> names;
+    Random random;
+    for (size_t i = 0; i < size; i++) {
+        names.push_back(symbolName(outermost ? 0 : depth - 1, random.next(size)));
+    }
+    state.resume();
+
+    SymbolTable::ID sum = 0;
+    for (size_t i = 0; i < state.iterations; i++) {
+        sum += table.look(names[i % size]);
+    }
+    doNotOptimise(sum);
+}
+
+
+// a function body: a scope is pushed, 'size' symbols are inserted and it is popped again
+static void symbolScope(State &state, size_t size) {
+    state.pause();
+    SymbolTable table;
+    std::vector<std::string> names;
+    for (size_t i = 0; i < size; i++) {
+        names.push_back(symbolName(1, i));
+    }
+    state.resume();
+
+    for (size_t i = 0; i < state.iterations; i += size) {
+        table.pushScope();
+        for (auto &name : names) {
+            doNotOptimise(table.insert(name));
+        }
+        table.popScope();
+    }
+}
+
+
+static std::string repeat(const std::string &text, size_t bytes) {
+    std::string source;
+    while (source.size() < bytes) {
+        source += text;
+    }
+    return source;
+}
+
+
+// one operation is one token, the lexer restarts at the end of the source
+static void lexTokens(State &state, const std::string &source) {
+    state.pause();
+    std::istringstream stream(source);
+    auto lexer = std::make_unique<Lexer2>();
+    state.resume();
+    for (size_t i = 0; i < state.iterations; i++) {
+        auto token = lexer->nextToken(stream);
+        if (token.type == Lexer2::Token2::Eof) {
+            state.pause();
+            stream.clear();
+            stream.str(source);
+            lexer = std::make_unique<Lexer2>();
+            state.resume();
+        }
+        doNotOptimise(token);
+    }
+}
+
+
+static std::vector<Benchmark> benchmarks() {
+    std::vector<Benchmark> list;
+
+    for (size_t n : {16, 1024, 65536}) {
+        auto suffix = "/" + std::to_string(n);
+        list.push_back({"sparse/fill" + suffix, [n](State &s) { sparseFill(s, n); }});
+        list.push_back({"sparse/churn" + suffix, [n](State &s) { sparseChurn(s, n); }});
+        list.push_back({"sparse/at" + suffix, [n](State &s) { sparseAt(s, n); }});
+        list.push_back({"sparse/clear" + suffix, [n](State &s) { sparseClear(s, n); }});
+    }
+
+    for (size_t depth : {1, 4, 16}) {
+        for (size_t size : {8, 256}) {
+            auto suffix = "/depth:" + std::to_string(depth) + "/size:" + std::to_string(size);
+            list.push_back({"symbols/look_inner" + suffix, [=](State &s) { symbolLook(s, depth, size, false); }});
+            list.push_back({"symbols/look_outer" + suffix, [=](State &s) { symbolLook(s, depth, size, true); }});
+        }
+    }
+    for (size_t size : {4, 64}) {
+        list.push_back({"symbols/scope/" + std::to_string(size), [size](State &s) { symbolScope(s, size); }});
+    }
+
+    static const std::pair<const char *, const char *> mixes[] = {
+        {"arithmetic", "12 * (345 + 6789) / 7 - 89 > 1000 == 0\n"},
+        {"identifiers", "let runningTotal = previousTotal + incrementAmount\nreturn runningTotal\n"},
+        {"blocks", "fn f(x)\n  if x < 2\n    return x\n  for i in 0..x\n    let y = f(i)\n  return x\n"},
+    };
+    for (auto &[name, text] : mixes) {
+        auto source = repeat(text, 16384);
+        list.push_back({std::string("lexer/") + name, [source](State &s) { lexTokens(s, source); }});
+    }
+
+    return list;
+}
+
+
+int main(int argc, char **argv) {
+    cl::ParseCommandLineOptions(argc, argv, "jitCalc microbenchmarks\n");
+
+    outs() << formatv("{0,-36} {1,14} {2,12} {3,12}\n", "benchmark", "iterations", "ns/op", "allocs/op");
+    for (auto &bench : benchmarks()) {
+        if (bench.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        auto m = measure(bench);
+        outs() << formatv("{0,-36} {1,14} {2,12:f2} {3,12:f3}\n", bench.name, m.iterations,
+            m.seconds * 1e9 / m.iterations, double(m.allocations) / m.iterations);
+        outs().flush();
+    }
+    return 0;
+}
@@ -0,0 +1,189 @@
+#include "compileStats.h"
+
+#include <algorithm>
+#include <iterator>
+#include <tuple>
+
+#include <llvm/ADT/Statistic.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Object/SymbolSize.h>
+#include <llvm/Support/JSON.h>
+
+using namespace llvm;
+
+// in the order of the alternatives of ast::Node
+static const char *nodeKindNames[] = {
+    "Program", "List", "Integer", "Prefix", "Infix", "Return", "Ident", "Call", "FnDef", "If",
+    "Let", "Set", "For", "Index", "SetIndex", "ForIn", "ArrayArg", "Range"
+};
+static_assert(std::size(nodeKindNames) == std::variant_size_v<ast::Node>);
+
+static const char *stageNames[CompileStats::NumStages] = { "before_opt", "after_opt" };
+
+
+CompileStats::CompileStats() {
+    // the statistics are only reported through write
+    EnableStatistics(false);
+}
+
+
+void CompileStats::recordAst(Sparse<ast::Node>::Key programKey, Sparse<ast::Node> &ast) {
+    hasAst = true;
+    astStats = AstStats();
+    astStats.live     = ast.size();
+    astStats.slots    = ast.slots();
+    astStats.capacity = ast.capacity();
+
+    std::vector<Sparse<ast::Node>::Key> stack = {programKey};
+    while (!stack.empty()) {
+        auto &node = ast.at(stack.back());
+        stack.pop_back();
+        astStats.nodesByKind[node.index()]++;
+        for (auto child : ast::children(node)) {
+            stack.push_back(child);
+        }
+    }
+}
+
+
+void CompileStats::recordModule(const Module &module, Stage stage) {
+    for (auto &fn : module) {
+        if (fn.isDeclaration()) {
+            continue;
+        }
+
+        IRSize size;
+        for (auto &block : fn) {
+            size.blocks++;
+            size.phis  += std::distance(block.phis().begin(), block.phis().end());
+            size.insts += block.size();
+        }
+
+        auto &stats = funcs[fn.getName().str()];
+        stats.ir[stage]       = size;
+        stats.recorded[stage] = true;
+    }
+}
+
+
+void CompileStats::recordObject(const MemoryBuffer &object) {
+    auto file = object::ObjectFile::createObjectFile(object.getMemBufferRef());
+    if (!file) {
+        consumeError(file.takeError());
+        return;
+    }
+
+    for (auto &[symbol, size] : object::computeSymbolSizes(**file)) {
+        auto type = symbol.getType();
+        auto name = symbol.getName();
+        if (!type || !name || *type != object::SymbolRef::ST_Function) {
+            consumeError(type.takeError());
+            consumeError(name.takeError());
+            continue;
+        }
+
+        auto &stats = funcs[name->str()];
+        stats.nativeBytes += size;
+        stats.jitted = true;
+    }
+}
+
+
+// GetStatistics() drops the DEBUG_TYPE and names are reused between passes, the JSON form
+// keys each counter by DEBUG_TYPE.name. Timers are printed with them and are skipped.
+std::vector<CompileStats::Counter> CompileStats::passStatistics() {
+    std::string text;
+    raw_string_ostream os(text);
+    PrintStatisticsJSON(os);
+
+    auto parsed = json::parse(text);
+    if (!parsed) {
+        consumeError(parsed.takeError());
+        return {};
+    }
+
+    std::vector<Counter> counters;
+    for (auto &[key, value] : *parsed->getAsObject()) {
+        StringRef qualified = key;
+        auto count = value.getAsInteger();
+        if (qualified.starts_with("time.") || !count) {
+            continue;
+        }
+        auto [pass, name] = qualified.rsplit('.');
+        counters.push_back(Counter{pass.str(), name.str(), uint64_t(*count)});
+    }
+
+    // the object isn't ordered
+    std::sort(counters.begin(), counters.end(), [](const Counter &a, const Counter &b) {
+        return std::tie(a.pass, a.name) < std::tie(b.pass, b.name);
+    });
+    return counters;
+}
+
+
+void CompileStats::write(raw_ostream &os, const std::string &title) {
+    json::OStream json(os);
+    json.object([&] {
+        json.attribute("title", title);
+
+        if (hasAst) {
+            json.attributeObject("ast", [&] {
+                json.attributeObject("nodes", [&] {
+                    for (size_t i = 0; i < astStats.nodesByKind.size(); i++) {
+                        if (astStats.nodesByKind[i] > 0) {
+                            json.attribute(nodeKindNames[i], int64_t(astStats.nodesByKind[i]));
+                        }
+                    }
+                });
+                json.attribute("live", int64_t(astStats.live));
+                json.attribute("slots", int64_t(astStats.slots));
+                json.attribute("capacity", int64_t(astStats.capacity));
+            });
+        }
+
+        json.attributeObject("functions", [&] {
+            for (auto &[name, stats] : funcs) {
+                json.attributeObject(name, [&] {
+                    for (size_t stage = 0; stage < NumStages; stage++) {
+                        if (!stats.recorded[stage]) {
+                            continue;
+                        }
+                        auto &ir = stats.ir[stage];
+                        json.attributeObject(stageNames[stage], [&] {
+                            json.attribute("blocks", int64_t(ir.blocks));
+                            json.attribute("phis", int64_t(ir.phis));
+                            json.attribute("instructions", int64_t(ir.insts));
+                        });
+                    }
+                    if (stats.jitted) {
+                        json.attribute("native_bytes", int64_t(stats.nativeBytes));
+                    }
+                });
+            }
+        });
+
+        auto counters = passStatistics();
+        statsSeen = statsSeen || !counters.empty();
+
+        // an LLVM built with assertions off and without LLVM_FORCE_ENABLE_STATS never
+        // registers a statistic, so an empty list doesn't mean the passes did nothing
+        json.attribute("statistics_available", bool(LLVM_FORCE_ENABLE_STATS) || statsSeen);
+        json.attributeArray("statistics", [&] {
+            for (auto &counter : counters) {
+                json.object([&] {
+                    json.attribute("pass", counter.pass);
+                    json.attribute("name", counter.name);
+                    json.attribute("value", int64_t(counter.value));
+                });
+            }
+        });
+    });
+    os << "\n";
+    os.flush();
+
+    hasAst = false;
+    funcs.clear();
+    ResetStatistics();
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <array>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <llvm/IR/Module.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "ast.h"
+#include "sparse.h"
+
+// Collects the size of a compilation for -stats-json: the syntax tree, the IR of each
+// function before and after optimisation, the machine code of each jitted function and
+// LLVM's statistics. A REPL cell or a program may span several modules, write emits
+// everything recorded since the last write as one JSON document on one line.
+class CompileStats {
+public:
+    enum Stage { BeforeOpt, AfterOpt, NumStages };
+
+    // enables LLVM's statistics, which must happen before the passes which count them run
+    CompileStats();
+
+    // counts the nodes reachable from programKey by kind, and the slots of the tree
+    void recordAst(Sparse<ast::Node>::Key programKey, Sparse<ast::Node> &ast);
+
+    // counts the blocks, phis and instructions of each function defined in module
+    void recordModule(const llvm::Module &module, Stage stage);
+
+    // the size of each function in a relocatable object produced by the JIT
+    void recordObject(const llvm::MemoryBuffer &object);
+
+    void write(llvm::raw_ostream &os, const std::string &title);
+
+private:
+    struct IRSize {
+        size_t blocks = 0;
+        size_t phis   = 0;
+        size_t insts  = 0;
+    };
+
+    struct FuncStats {
+        std::array<IRSize, NumStages> ir{};
+        std::array<bool, NumStages>   recorded{}; // a function can be inlined away or added
+        uint64_t                      nativeBytes = 0;
+        bool                          jitted = false;
+    };
+
+    struct Counter {
+        std::string pass; // the DEBUG_TYPE of the statistic
+        std::string name;
+        uint64_t    value;
+    };
+    std::vector<Counter> passStatistics();
+
+    struct AstStats {
+        std::array<size_t, std::variant_size_v<ast::Node>> nodesByKind{};
+        size_t live = 0, slots = 0, capacity = 0;
+    };
+
+    bool                             hasAst = false;
+    AstStats                         astStats;
+    std::map<std::string, FuncStats> funcs;
+    bool                             statsSeen = false; // a statistic has been registered
+};
@@ -1,14 +1,53 @@
 #include "emit.h"
+#include "output.h"
 
+#include <algorithm>
 #include <cmath>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Instructions.h>
 
 using namespace llvm;
 
+// Names a pfor body refers to and the assignments it makes. Statements which can't be
+// outlined into a function of the iteration range are errors.
+struct PforUses {
+    std::set<std::string>           names; // variables read or assigned and arrays used
+    std::map<std::string, int>      reads;
+    std::vector<const ast::Set*>    sets;
+    std::vector<std::pair<TextPos, std::string>> errors;
+};
+
+static void collectPforUses(Sparse<ast::Node> &ast, Sparse<ast::Node>::Key key, PforUses &uses) {
+    auto &node = ast.at(key);
+    if (auto *fnDef = std::get_if<ast::FnDef>(&node); fnDef != nullptr) {
+        uses.errors.emplace_back(fnDef->pos, "functions can't be defined in a pfor body");
+    } else if (auto *return_ = std::get_if<ast::Return>(&node); return_ != nullptr) {
+        uses.errors.emplace_back(return_->pos, "can't return from a pfor body");
+    } else if (auto *ident = std::get_if<ast::Ident>(&node); ident != nullptr) {
+        uses.names.insert(ident->ident);
+        uses.reads[ident->ident]++;
+    } else if (auto *set = std::get_if<ast::Set>(&node); set != nullptr) {
+        uses.names.insert(set->name);
+        uses.sets.push_back(set);
+    } else if (auto *index = std::get_if<ast::Index>(&node); index != nullptr) {
+        uses.names.insert(index->name);
+    } else if (auto *setIndex = std::get_if<ast::SetIndex>(&node); setIndex != nullptr) {
+        uses.names.insert(setIndex->name);
+    }
+
+    for (auto child : ast::children(node)) {
+        collectPforUses(ast, child, uses);
+    }
+}
+
+
 void Emit::emitPrintf(const char* fmt, std::vector<llvm::Value*> args) {
-    llvm::Value *ft = builder.ir().CreateGlobalString(fmt, "fmt");
-    std::vector args2 = {ft};
+    // one global per distinct format string in the module
+    auto &ft = fmtStrings[fmt];
+    if (ft == nullptr) {
+        ft = builder.ir().CreateGlobalString(fmt, "fmt");
+    }
+    std::vector<llvm::Value*> args2 = {ft};
     for (auto arg : args) {
         args2.push_back(arg);
     }
@@ -20,9 +59,11 @@ Emit::Emit(
     LLVMContext &context,
     const std::string &name,
     const std::string &startFunctionName,
+    const EmitOptions &options,
     const std::filesystem::path &debugFilePath
 )
     : builder(context, name, debugFilePath)
+    , options(options)
     , funcCurrent(startFunctionName)
 {
     builder.createFuncDeclaration("printf", builder.ir().getInt32Ty(), {builder.ir().getPtrTy()}, true);
@@ -56,6 +97,34 @@ Emit::Emit(
 
     builder.createGlobalDeclaration("_ZTIi", builder.ir().getPtrTy());
 
+    auto *alignedAlloc = builder.createFuncDeclaration(
+        "aligned_alloc",
+        builder.ir().getPtrTy(),
+        {builder.ir().getInt64Ty(), builder.ir().getInt64Ty()},
+        false);
+    alignedAlloc->setReturnDoesNotAlias();
+    alignedAlloc->setDoesNotThrow();
+    builder.createFuncDeclaration("free", builder.ir().getVoidTy(), {builder.ir().getPtrTy()}, false)
+        ->setDoesNotThrow();
+
+    // runtime/parallel.h
+    builder.createFuncDeclaration(
+        "jc_parallel_for",
+        builder.ir().getInt32Ty(),
+        {builder.ir().getPtrTy(), builder.ir().getPtrTy(), builder.ir().getInt32Ty(),
+            builder.ir().getInt32Ty(), builder.ir().getInt32Ty(), builder.ir().getPtrTy()},
+        false);
+
+    // runtime/output.h
+    builder.createFuncDeclaration(
+        "jc_output",
+        builder.ir().getVoidTy(),
+        {builder.ir().getInt32Ty(), builder.ir().getInt32Ty()},
+        false)->setDoesNotThrow();
+
+    if (funcCurrent.empty()) {
+        return;
+    }
     auto *fn = builder.createFunc(TextPos(0, 0, 0), funcCurrent.c_str(), {}, builder.ir().getInt32Ty());
     fn->setPersonalityFn(builder.getFunc("__gxx_personality_v0"));
     builder.setCurrentFunc(funcCurrent.c_str());
@@ -73,8 +142,7 @@ void Emit::emitProgram(Sparse<ast::Node>::Key key, Sparse<ast::Node> &ast) {
         if (std::holds_alternative<ast::FnDef>(ast.at(key))) {
             emitFuncDef(ast, std::get<ast::FnDef>(ast.at(key)));
         } else {
-            auto *value = emitExpression(ast, ast.at(key) );
-            emitPrintf("result: %d\n", {value});
+            emitResult(ast, ast.at(key));
         }
     }
 
@@ -82,32 +150,122 @@ void Emit::emitProgram(Sparse<ast::Node>::Key key, Sparse<ast::Node> &ast) {
 }
 
 
+void Emit::emitResult(Sparse<ast::Node> &ast, const ast::Node &expr) {
+    auto *value = emitExpression(ast, expr);
+    builder.createCall("jc_output", {emitInt32(OutputResult), value});
+}
+
+
+// Emits expressions into a function i32(ptr results, ptr next) which runs them from
+// expression *next, storing the result of expression j in results[j] and then j + 1 in
+// *next. Returns 0 once every expression has run, or the payload of an exception caught
+// from a call, which abandoned expression *next without printing it. Its result is then 0.
+Function* Emit::emitResultChunk(
+    Sparse<ast::Node> &ast,
+    const std::vector<Sparse<ast::Node>::Key> &exprs,
+    const std::string &name
+) {
+    auto &ir = builder.ir();
+    auto funcOld = funcCurrent;
+    funcCurrent = name;
+
+    auto *fn = builder.createFunc(TextPos(0, 0, 0), name, {ir.getPtrTy(), ir.getPtrTy()}, ir.getInt32Ty());
+    fn->setPersonalityFn(builder.getFunc("__gxx_personality_v0"));
+    builder.setCurrentFunc(name);
+    sealBlock(builder.getCurrentBlock());
+
+    auto *results = builder.getCurrentFuncArg(0);
+    auto *next    = builder.getCurrentFuncArg(1);
+
+    // an exception caught from a call returns from the chunk, the host records it in order
+    bool returnExceptionsOld = returnExceptions;
+    returnExceptions = true;
+
+    BasicBlock *doneBlk = builder.appendNewBlock("done");
+    auto *start = ir.CreateLoad(ir.getInt32Ty(), next, "start");
+    auto *jump  = ir.CreateSwitch(start, doneBlk, exprs.size());
+
+    for (size_t j = 0; j < exprs.size(); j++) {
+        BasicBlock *exprBlk = builder.appendNewBlock("expr");
+        jump->addCase(ir.getInt32(j), exprBlk);
+        if (j > 0) {
+            ir.CreateBr(exprBlk);
+        }
+        builder.setCurrentBlock(exprBlk);
+        sealBlock(exprBlk);
+
+        auto *value = emitExpression(ast, ast.at(exprs[j]));
+        ir.CreateStore(value, ir.CreateConstInBoundsGEP1_64(ir.getInt32Ty(), results, j));
+
+        // the host reads it after a division by zero, which the optimiser doesn't know about
+        ir.CreateStore(ir.getInt32(j + 1), next, true);
+    }
+    ir.CreateBr(doneBlk);
+    builder.setCurrentBlock(doneBlk);
+    sealBlock(doneBlk);
+    emitReturnNoBlock(emitInt32(0));
+
+    returnExceptions = returnExceptionsOld;
+    funcCurrent = funcOld;
+    if (!funcCurrent.empty()) {
+        builder.setCurrentFunc(funcCurrent.c_str());
+    }
+    return fn;
+}
+
+
 void Emit::emitStmt(Sparse<ast::Node> &ast, const ast::Node &stmt) {
     if (std::holds_alternative<ast::FnDef>(stmt)) {
         emitFuncDef(ast, std::get<ast::FnDef>(stmt));
 
     } else if (std::holds_alternative<ast::Return>(stmt)) {
-        auto *e = emitExpression(ast, ast.at(std::get<ast::Return>(stmt).expr));
-        emitReturn(e);
+        auto &return_ = std::get<ast::Return>(stmt);
+        auto *call = std::get_if<ast::Call>(&ast.at(return_.expr));
+
+        if (call != nullptr && tailRec.has_value() && call->name == tailRec->name) {
+            emitTailRecursion(ast, *call);
+        } else {
+            auto *e = emitExpression(ast, ast.at(return_.expr));
+            markTailCall(e);
+            emitReturn(e);
+        }
     
     } else if (std::holds_alternative<ast::Let>(stmt)) {
         auto &let = std::get<ast::Let>(stmt);
+
+        // let a = array(n)
+        auto *call = std::get_if<ast::Call>(&ast.at(let.expr));
+        if (call != nullptr && call->name == "array" && isBuiltin(call->name)) {
+            define(let.pos, let.name, emitArrayAlloc(ast, *call));
+            return;
+        }
+
         auto *expr = emitExpression(ast, ast.at(let.expr));
         auto key = builder.createVarLocalDebug(let.name.c_str());
         builder.setVarLocalDebugValue(let.pos, key, expr);
 
-        define(let.name, ObjVar{.debugKey = key});
+        define(let.pos, let.name, ObjVar{.debugKey = key});
         writeVariable(symTab.look(let.name), builder.getCurrentBlock(), expr);
 
     } else if (std::holds_alternative<ast::Set>(stmt)) {
         auto &set = std::get<ast::Set>(stmt);
         auto *expr = emitExpression(ast, ast.at(set.expr));
+        if (!lookVar(set.pos, set.name)) {
+            return;
+        }
         auto obj = look(set.name);
-        assert(std::holds_alternative<ObjVar>(obj));
 
         builder.setVarLocalDebugValue(set.pos, std::get<ObjVar>(obj).debugKey, expr);
         writeVariable(symTab.look(set.name), builder.getCurrentBlock(), expr);
 
+    } else if (std::holds_alternative<ast::SetIndex>(stmt)) {
+        auto &setIndex = std::get<ast::SetIndex>(stmt);
+        auto *ptr = emitArrayElemPtr(ast, setIndex.pos, setIndex.name, setIndex.index);
+        auto *expr = emitExpression(ast, ast.at(setIndex.expr));
+        if (ptr != nullptr) {
+            builder.ir().CreateAlignedStore(expr, ptr, Align(4));
+        }
+
     } else if (std::holds_alternative<ast::If>(stmt)) {
         auto &if_ = std::get<ast::If>(stmt);
 
@@ -124,23 +282,23 @@ void Emit::emitStmt(Sparse<ast::Node> &ast, const ast::Node &stmt) {
         sealBlock(trueBlk);
 
         builder.setCurrentBlock(trueBlk);
-        symTab.pushScope();
+        pushScope();
 
         auto &bodyList = std::get<ast::List>(ast.at(if_.trueBody));
         for (auto stmtKey : bodyList.list) {
             emitStmt(ast, ast.at(stmtKey));
         }
-        symTab.popScope();
+        popScope();
         builder.ir().CreateBr(end);
 
         builder.setCurrentBlock(falseBlk);
-        symTab.pushScope();
+        pushScope();
 
         auto &falseBodyList = std::get<ast::List>(ast.at(if_.falseBody));
         for (auto stmtKey : falseBodyList.list) {
             emitStmt(ast, ast.at(stmtKey));
         }
-        symTab.popScope();
+        popScope();
         builder.ir().CreateBr(end);
 
         sealBlock(end);
@@ -150,6 +308,11 @@ void Emit::emitStmt(Sparse<ast::Node> &ast, const ast::Node &stmt) {
     } else if (std::holds_alternative<ast::For>(stmt)) {
         auto &for_ = std::get<ast::For>(stmt);
 
+        // the bound is re-evaluated each iteration so termination can't be assumed
+        if (auto *objFn = funcEmitting(); objFn != nullptr) {
+            objFn->willReturn = false;
+        }
+
         BasicBlock *curBlk = builder.getCurrentBlock();
         BasicBlock *forBlk = builder.appendNewBlock("for");
         BasicBlock *bdyBlk = builder.appendNewBlock("body");
@@ -171,14 +334,14 @@ void Emit::emitStmt(Sparse<ast::Node> &ast, const ast::Node &stmt) {
         sealBlock(bdyBlk);
 
         builder.setCurrentBlock(bdyBlk);
-        symTab.pushScope();
+        pushScope();
 
         auto &bodyList = std::get<ast::List>(ast.at(for_.body));
 
         for (auto stmtKey : bodyList.list) {
             emitStmt(ast, ast.at(stmtKey));
         }
-        symTab.popScope();
+        popScope();
         builder.ir().CreateBr(bdyEndBlk);
         sealBlock(bdyEndBlk);
 
@@ -189,36 +352,435 @@ void Emit::emitStmt(Sparse<ast::Node> &ast, const ast::Node &stmt) {
         builder.setCurrentBlock(endBlk);
         sealBlock(endBlk);
 
+    } else if (std::holds_alternative<ast::ForIn>(stmt)) {
+        auto &forIn = std::get<ast::ForIn>(stmt);
+
+        // the bounds are evaluated once here so the trip count is known on entry
+        Value *lo, *hi;
+        int step = 1;
+        if (auto *range = std::get_if<ast::Range>(&ast.at(forIn.iter)); range != nullptr) {
+            if (range->step == 0) {
+                fail(range->pos, "step can't be 0");
+                return;
+            }
+            lo   = emitExpression(ast, ast.at(range->lo));
+            hi   = emitExpression(ast, ast.at(range->hi));
+            step = range->step;
+        } else {
+            auto *array = lookArrayArg(ast, forIn.iter);
+            if (array == nullptr) {
+                return;
+            }
+            lo = emitInt32(0);
+            hi = array->len;
+        }
+
+        if (forIn.parallel) {
+            emitParallelFor(ast, forIn, lo, hi, step);
+        } else {
+            emitForLoop(ast, forIn, lo, hi, step);
+        }
+
     } else {
-        assert(false);
+        fail(std::visit([](auto &node) { return node.pos; }, stmt), "expected a statement");
+    }
+}
+
+
+// Loop binding forIn.name to lo, lo + step... up to but not including hi. The bounds are
+// evaluated once by the caller. With a step of 1 or -1, i can't step past hi so it is
+// compared against it directly; larger steps could overflow, so they count iterations
+// up to a trip count worked out before the loop.
+void Emit::emitForLoop(Sparse<ast::Node> &ast, const ast::ForIn &forIn, Value *lo, Value *hi, int step) {
+    if (step == 1 || step == -1) {
+        emitLoop(ast, forIn, lo, hi, nullptr, step);
+    } else {
+        emitLoop(ast, forIn, lo, nullptr, emitTripCount(lo, hi, step), step);
+    }
+}
+
+
+// number of iterations of lo..hi step n, the span of a non-empty range fits an unsigned i32
+Value* Emit::emitTripCount(Value *lo, Value *hi, int step) {
+    auto &ir = builder.ir();
+    uint32_t stepSize = (step > 0) ? (uint32_t)step : -(uint32_t)step;
+
+    auto *nonEmpty = (step > 0) ? ir.CreateICmpSLT(lo, hi) : ir.CreateICmpSGT(lo, hi);
+    auto *span = (step > 0) ? ir.CreateSub(hi, lo) : ir.CreateSub(lo, hi);
+    auto *count = ir.CreateNUWAdd(
+        ir.CreateUDiv(ir.CreateSub(span, emitInt32(1)), ir.getInt32(stepSize)),
+        emitInt32(1));
+    return ir.CreateSelect(nonEmpty, count, emitInt32(0), "tripCount");
+}
+
+
+// The loop runs while i is before end, or for tripCount iterations when it is given.
+void Emit::emitLoop(
+    Sparse<ast::Node> &ast,
+    const ast::ForIn &forIn,
+    Value *start,
+    Value *end,
+    Value *tripCount,
+    int step
+) {
+    BasicBlock *curBlk = builder.getCurrentBlock();
+    BasicBlock *forBlk = builder.appendNewBlock("for");
+    BasicBlock *bdyBlk = builder.appendNewBlock("body");
+    BasicBlock *bdyEndBlk = builder.appendNewBlock("bodyEnd");
+    BasicBlock *endBlk = builder.appendNewBlock("end");
+
+    builder.ir().CreateBr(forBlk);
+    builder.setCurrentBlock(forBlk);
+
+    PHINode *idx = builder.ir().CreatePHI(builder.ir().getInt32Ty(), 2, forIn.name);
+    idx->addIncoming(start, curBlk);
+
+    Value *cnd;
+    PHINode *count = nullptr;
+    if (tripCount != nullptr) {
+        count = builder.ir().CreatePHI(builder.ir().getInt32Ty(), 2, "count");
+        count->addIncoming(emitInt32(0), curBlk);
+        cnd = builder.ir().CreateICmpULT(count, tripCount);
+    } else if (step > 0) {
+        cnd = builder.ir().CreateICmpSLT(idx, end);
+    } else {
+        cnd = builder.ir().CreateICmpSGT(idx, end);
+    }
+
+    builder.ir().CreateCondBr(cnd, bdyBlk, endBlk);
+    sealBlock(bdyBlk);
+
+    builder.setCurrentBlock(bdyBlk);
+    pushScope();
+
+    auto key = builder.createVarLocalDebug(forIn.name.c_str());
+    builder.setVarLocalDebugValue(forIn.pos, key, idx);
+    define(forIn.pos, forIn.name, ObjVar{.debugKey = key});
+    writeVariable(symTab.look(forIn.name), bdyBlk, idx);
+
+    auto &bodyList = std::get<ast::List>(ast.at(forIn.body));
+    for (auto stmtKey : bodyList.list) {
+        emitStmt(ast, ast.at(stmtKey));
+    }
+    popScope();
+    builder.ir().CreateBr(bdyEndBlk);
+    sealBlock(bdyEndBlk);
+
+    // assignments to i in the body don't change the iteration. i may wrap on the last
+    // iteration of a counted loop, where the new value is never used.
+    builder.setCurrentBlock(bdyEndBlk);
+    if (count != nullptr) {
+        idx->addIncoming(builder.ir().CreateAdd(idx, emitInt32(step), "increment"), bdyEndBlk);
+        count->addIncoming(builder.ir().CreateNUWAdd(count, emitInt32(1), "countNext"), bdyEndBlk);
+    } else {
+        idx->addIncoming(builder.ir().CreateNSWAdd(idx, emitInt32(step), "increment"), bdyEndBlk);
+    }
+    builder.ir().CreateBr(forBlk);
+    sealBlock(forBlk);
+
+    builder.setCurrentBlock(endBlk);
+    sealBlock(endBlk);
+}
+
+// pfor runs chunks of the iterations on the thread pool. The body is outlined into
+//     i32 body(i32 lo, i32 hi, ptr env, ptr acc)
+// and the variables and arrays it uses are passed by value in env. Variables from outside
+// the loop may only be assigned as reductions, s = s + e, each chunk sums e from 0 into
+// acc and the totals are added to s once every chunk has finished.
+void Emit::emitParallelFor(Sparse<ast::Node> &ast, const ast::ForIn &forIn, Value *lo, Value *hi, int step) {
+    auto &ir = builder.ir();
+    auto *i32 = ir.getInt32Ty();
+    auto *ptr = ir.getPtrTy();
+
+    PforUses uses;
+    collectPforUses(ast, forIn.body, uses);
+
+    // names declared in the body aren't defined yet, those of an enclosing function are
+    // reported when the body is emitted
+    struct Capture {
+        std::string     name;
+        SymbolTable::ID id;
+        Object          object;
+        unsigned        field;
+    };
+    std::vector<Capture>     captures;
+    std::vector<llvm::Type*> envFields;
+    for (auto &name : uses.names) {
+        if (!symTab.isDefined(name) || symTab.scopeOf(name) < funcScope) {
+            continue;
+        }
+        auto id = symTab.look(name);
+        auto object = objTable[id];
+        if (std::holds_alternative<ObjVar>(object)) {
+            captures.push_back(Capture{name, id, object, (unsigned)envFields.size()});
+            envFields.push_back(i32);
+        } else if (std::holds_alternative<ObjArray>(object)) {
+            captures.push_back(Capture{name, id, object, (unsigned)envFields.size()});
+            envFields.push_back(ptr);
+            envFields.push_back(i32);
+        }
+    }
+
+    std::vector<SymbolTable::ID>   reductions;
+    std::map<SymbolTable::ID, int> reductionSets;
+    std::map<SymbolTable::ID, std::string> reductionNames;
+    for (auto *set : uses.sets) {
+        // assigning an array or function is reported when the body is emitted
+        if (!symTab.isDefined(set->name) || !std::holds_alternative<ObjVar>(objTable[symTab.look(set->name)])) {
+            continue;
+        }
+
+        auto *infix = std::get_if<ast::Infix>(&ast.at(set->expr));
+        auto *left = (infix != nullptr) ? std::get_if<ast::Ident>(&ast.at(infix->left)) : nullptr;
+        if (infix == nullptr || infix->op != ast::Plus || left == nullptr || left->ident != set->name) {
+            uses.errors.emplace_back(set->pos, "variables from outside a pfor can only be assigned as s = s + e");
+        }
+
+        auto id = symTab.look(set->name);
+        if (reductionSets[id]++ == 0) {
+            reductions.push_back(id);
+            reductionNames[id] = set->name;
+        }
+    }
+
+    // each assignment reads s once, any other read would see a partial sum
+    for (auto id : reductions) {
+        if (uses.reads[reductionNames[id]] != reductionSets[id]) {
+            uses.errors.emplace_back(forIn.pos, "a reduction variable can't be read in a pfor body");
+        }
+    }
+    for (auto &[pos, message] : uses.errors) {
+        fail(pos, message);
+    }
+    if (!uses.errors.empty()) {
+        return;
+    }
+
+    // with a step other than 1 the pool runs iteration numbers 0..tripCount-1 and the
+    // body works out i from lo, which is passed at the end of env
+    unsigned loField = envFields.size();
+    Value *tripCount = nullptr;
+    if (step != 1) {
+        tripCount = emitTripCount(lo, hi, step);
+        envFields.push_back(i32);
+    }
+
+    // allocas go in the entry block so a pfor in a loop doesn't grow the stack
+    Function *enclosing = builder.getCurrentBlock()->getParent();
+    IRBuilder<> entryIR(&enclosing->getEntryBlock(), enclosing->getEntryBlock().begin());
+    auto *envTy = StructType::get(ir.getContext(), envFields);
+    auto *env = entryIR.CreateAlloca(envTy, nullptr, "env");
+    auto *resultTy = ArrayType::get(i32, std::max<size_t>(1, reductions.size()));
+    auto *result = entryIR.CreateAlloca(resultTy, nullptr, "reductions");
+
+    for (auto &capture : captures) {
+        if (std::holds_alternative<ObjVar>(capture.object)) {
+            auto *value = readVariable(capture.id, builder.getCurrentBlock());
+            ir.CreateStore(value, ir.CreateStructGEP(envTy, env, capture.field));
+        } else {
+            auto &array = std::get<ObjArray>(capture.object);
+            ir.CreateStore(array.data, ir.CreateStructGEP(envTy, env, capture.field));
+            ir.CreateStore(array.len, ir.CreateStructGEP(envTy, env, capture.field + 1));
+        }
+    }
+    if (step != 1) {
+        ir.CreateStore(lo, ir.CreateStructGEP(envTy, env, loField));
+    }
+
+    // the outlined body
+    auto ip = ir.saveIP();
+    auto funcOld = funcCurrent;
+    funcCurrent = funcOld + ".pfor" + std::to_string(numPfors++);
+
+    auto *fn = builder.createFunc(forIn.pos, funcCurrent, {i32, i32, ptr, ptr}, i32);
+    fn->setLinkage(GlobalValue::InternalLinkage);
+    fn->setPersonalityFn(builder.getFunc("__gxx_personality_v0"));
+    fn->addParamAttr(2, Attribute::NoCapture);
+    fn->addParamAttr(2, Attribute::ReadOnly);
+    fn->addParamAttr(3, Attribute::NoCapture);
+    builder.setCurrentFunc(funcCurrent);
+    BasicBlock *entry = builder.getCurrentBlock();
+    sealBlock(entry);
+
+    auto arrayScopesOld = std::move(arrayScopes);
+    arrayScopes.clear();
+    pushScope();
+
+    // an exception caught from a call ends the chunk, the pfor then ends like a serial loop
+    bool returnExceptionsOld = returnExceptions;
+    returnExceptions = true;
+    size_t numCatchesOld = numCatches;
+
+    auto *envArg = builder.getCurrentFuncArg(2);
+    for (auto &capture : captures) {
+        auto *fieldPtr = ir.CreateStructGEP(envTy, envArg, capture.field);
+        if (std::holds_alternative<ObjVar>(capture.object)) {
+            // reductions start from 0 in each chunk
+            Value *value = (reductionSets.count(capture.id) > 0)
+                ? emitInt32(0)
+                : ir.CreateLoad(i32, fieldPtr, capture.name);
+            auto key = builder.createVarLocalDebug(capture.name.c_str());
+            builder.setVarLocalDebugValue(forIn.pos, key, value);
+            objTable[capture.id] = ObjVar{.debugKey = key};
+            writeVariable(capture.id, entry, value);
+        } else {
+            // arrays come from array() or an array argument, both 64 byte aligned
+            auto *data = ir.CreateLoad(ptr, fieldPtr, "data");
+            ir.CreateAlignmentAssumption(builder.getLlModule().getDataLayout(), data, 64);
+            auto *len = ir.CreateLoad(i32, ir.CreateStructGEP(envTy, envArg, capture.field + 1), "len");
+            objTable[capture.id] = ObjArray{data, len};
+        }
+    }
+
+    Value *chunkLo = builder.getCurrentFuncArg(0);
+    Value *chunkHi = builder.getCurrentFuncArg(1);
+    if (step == 1) {
+        emitForLoop(ast, forIn, chunkLo, chunkHi, 1);
+    } else {
+        auto *base = ir.CreateLoad(i32, ir.CreateStructGEP(envTy, envArg, loField), "lo");
+        auto *start = ir.CreateAdd(base, ir.CreateMul(chunkLo, emitInt32(step)), "start");
+        emitLoop(ast, forIn, start, nullptr, ir.CreateSub(chunkHi, chunkLo), step);
+    }
+
+    auto *accArg = builder.getCurrentFuncArg(3);
+    for (size_t k = 0; k < reductions.size(); k++) {
+        auto *accPtr = ir.CreateConstInBoundsGEP1_32(i32, accArg, k);
+        auto *partial = readVariable(reductions[k], builder.getCurrentBlock());
+        ir.CreateStore(ir.CreateAdd(ir.CreateLoad(i32, accPtr), partial), accPtr);
+    }
+
+    popScope();
+    emitReturnNoBlock(emitInt32(0));
+
+    for (auto &capture : captures) {
+        objTable[capture.id] = capture.object;
+    }
+    returnExceptions = returnExceptionsOld;
+    arrayScopes = std::move(arrayScopesOld);
+    funcCurrent = funcOld;
+    builder.setCurrentFunc(funcCurrent);
+    ir.restoreIP(ip);
+
+    // chunks may run on any thread and a division in one throws or traps out of here
+    if (auto *objFn = funcEmitting(); objFn != nullptr) {
+        objFn->readNone = false;
+    }
+
+    auto *caught = builder.createCall(forIn.pos, "jc_parallel_for", {
+        fn,
+        env,
+        (step == 1) ? lo : emitInt32(0),
+        (step == 1) ? hi : tripCount,
+        emitInt32(reductions.size()),
+        result});
+
+    if (numCatches != numCatchesOld) {
+        BasicBlock *caughtBlk = builder.appendNewBlock("pfor_caught");
+        BasicBlock *doneBlk   = builder.appendNewBlock("pfor_done");
+        sealBlock(caughtBlk);
+        sealBlock(doneBlk);
+        ir.CreateCondBr(ir.CreateICmpNE(caught, emitInt32(0)), caughtBlk, doneBlk);
+
+        builder.setCurrentBlock(caughtBlk);
+        if (!returnExceptions) {
+            builder.createCall(forIn.pos, "jc_output", {emitInt32(OutputException), caught});
+        }
+        emitArrayFrees(arrayScopes.size());
+        emitReturnNoBlock(returnExceptions ? caught : emitInt32(0));
+        numCatches++;
+
+        builder.setCurrentBlock(doneBlk);
+    }
+
+    for (size_t k = 0; k < reductions.size(); k++) {
+        auto id = reductions[k];
+        auto *total = ir.CreateLoad(i32, ir.CreateConstInBoundsGEP2_32(resultTy, result, 0, k), "reduction");
+        auto *value = ir.CreateAdd(readVariable(id, builder.getCurrentBlock()), total);
+        builder.setVarLocalDebugValue(forIn.pos, std::get<ObjVar>(objTable[id]).debugKey, value);
+        writeVariable(id, builder.getCurrentBlock(), value);
     }
 }
 
 
 void Emit::emitFuncDef(Sparse<ast::Node> &ast, const ast::FnDef& fnDef) {
     auto &argsList = std::get<ast::List>(ast.at(fnDef.args));
+    if (symTab.isDefined(fnDef.name)) {
+        fail(fnDef.pos, fnDef.name + " is already defined");
+        return;
+    }
+
+    ObjFunc objFunc{argsList.size(), false};
+    for (auto argKey : argsList.list) {
+        objFunc.arrayArgs.push_back(std::holds_alternative<ast::ArrayArg>(ast.at(argKey)));
+    }
+
+    bool hasArrayArgs = std::find(objFunc.arrayArgs.begin(), objFunc.arrayArgs.end(), true)
+        != objFunc.arrayArgs.end();
+
+    // recursive calls see the function as pure while its own body is checked
+    objFunc.pure = !hasArrayArgs;
+    define(fnDef.pos, fnDef.name, objFunc);
+    if (objFunc.pure) {
+        std::get<ObjFunc>(objTable[symTab.look(fnDef.name)]).pure = isPure(ast, fnDef.body, fnDef.name);
+    }
 
-    define(fnDef.name, ObjFunc{argsList.size(), false});
     auto funcOld = funcCurrent;
     funcCurrent = fnDef.name;
+    funcsEmitting.push_back(fnDef.name);
 
-    std::vector<Type*> argTypes(argsList.size(), builder.ir().getInt32Ty());
-    auto *fn = builder.createFunc(fnDef.pos, fnDef.name.c_str(), argTypes, builder.ir().getInt32Ty());
+    // arrays of the enclosing function are not freed by returns in this one
+    auto arrayScopesOld = std::move(arrayScopes);
+    arrayScopes.clear();
+
+    auto *fn = builder.createFunc(fnDef.pos, fnDef.name.c_str(), funcArgTypes(objFunc), builder.ir().getInt32Ty());
     fn->setPersonalityFn(builder.getFunc("__gxx_personality_v0"));
     builder.setCurrentFunc(fnDef.name.c_str());
     BasicBlock *entry = builder.getCurrentBlock();
     sealBlock(entry);
 
-    symTab.pushScope();
+    pushScope();
+    auto funcScopeOld = funcScope;
+    funcScope = symTab.depth() - 1;
+
+    for (int i = 0, llArg = 0; i < argsList.size(); i++) {
+        if (auto *arrayArg = std::get_if<ast::ArrayArg>(&ast.at(argsList.list[i])); arrayArg != nullptr) {
+            // the caller owns the memory, it was allocated by array() with 64 byte alignment
+            fn->addParamAttr(llArg, Attribute::NoCapture);
+            fn->addParamAttr(llArg, Attribute::getWithAlignment(fn->getContext(), Align(64)));
+            define(arrayArg->pos, arrayArg->ident, ObjArray{builder.getCurrentFuncArg(llArg), builder.getCurrentFuncArg(llArg + 1)});
+            llArg += 2;
+            continue;
+        }
 
-    for (int i = 0; i < argsList.size(); i++) {
         auto &arg = std::get<ast::Ident>(ast.at(argsList.list[i]));
         auto key = builder.createArgDebug(arg.ident.c_str(), i + 1);
 
-        define(arg.ident, ObjVar{.debugKey = key});
+        define(arg.pos, arg.ident, ObjVar{.debugKey = key});
+
+        builder.setVarLocalDebugValue(arg.pos, key, builder.getCurrentFuncArg(llArg));
+        writeVariable(symTab.look(arg.ident), entry, builder.getCurrentFuncArg(llArg));
+        llArg++;
+    }
+
+    // Self tail calls become a loop back to the start of the body, the arguments are
+    // rewritten and the phi generation joins them. Not done when a division can throw as
+    // the exception would unwind past the frames which used to catch it.
+    auto tailRecOld = std::move(tailRec);
+    tailRec.reset();
+
+    if (!hasArrayArgs
+        && ast::hasSelfTailCall(ast, fnDef.body, fnDef.name)
+        && (options.trapDivZero || !ast::hasDivide(ast, fnDef.body))
+    ) {
+        std::vector<SymbolTable::ID> args;
+        for (auto argKey : argsList.list) {
+            args.push_back(symTab.look(std::get<ast::Ident>(ast.at(argKey)).ident));
+        }
 
-        builder.setVarLocalDebugValue(arg.pos, key, builder.getCurrentFuncArg(i));
-        writeVariable(symTab.look(arg.ident), entry, builder.getCurrentFuncArg(i));
+        BasicBlock *loop = builder.appendNewBlock("tailrec");
+        builder.ir().CreateBr(loop);
+        builder.setCurrentBlock(loop);
+        tailRec = TailRec{fnDef.name, loop, args};
     }
 
     auto &bodyList = std::get<ast::List>(ast.at(fnDef.body));
@@ -226,32 +788,109 @@ void Emit::emitFuncDef(Sparse<ast::Node> &ast, const ast::FnDef& fnDef) {
         emitStmt(ast, ast.at(stmtKey) );
     }
 
-    symTab.popScope();
+    if (tailRec.has_value()) {
+        sealBlock(tailRec->loop);
+    }
+    tailRec = std::move(tailRecOld);
+
+    popScope();
+    funcScope = funcScopeOld;
     emitReturnNoBlock(emitInt32(0));
+
+    auto *objFn = funcEmitting();
+    bool memoise = (fnDef.memo || (options.memoiseAll && argsList.size() > 0)) && objFn->pure;
+    if (memoise) {
+        // the wrapper writes its table and the body's recursive calls go through the
+        // wrapper, so neither can be treated as readnone
+        objFn->readNone = false;
+    }
+    emitFuncAttrs(fn, *objFn);
+
+    if (memoise) {
+        emitFuncAttrs(builder.memoiseFunc(fnDef.name), *objFn);
+    } else if (fnDef.memo) {
+        llvm::errs() << fnDef.pos.line << ":" << fnDef.pos.column << ": warning: "
+            << fnDef.name << " is not pure and will not be memoised\n";
+    }
+
+    arrayScopes = std::move(arrayScopesOld);
+    funcsEmitting.pop_back();
     funcCurrent = funcOld;
-    builder.setCurrentFunc(funcCurrent.c_str());
+    if (!funcCurrent.empty()) {
+        builder.setCurrentFunc(funcCurrent.c_str());
+    }
 }
 
 
 
 
 Value* Emit::emitCall(Sparse<ast::Node> &ast, const ast::Call &call, bool resume) {
-    auto objFunc = std::get<ObjFunc>(look(call.name));
     auto &argList = std::get<ast::List>(ast.at(call.args));
 
-    assert(argList.size() == objFunc.numArgs);
+    // builtins
+    if (isBuiltin(call.name)) {
+        if (call.name == "len") {
+            if (argList.size() != 1) {
+                fail(call.pos, "wrong number of arguments to len");
+                return emitInt32(0);
+            }
+            auto *array = lookArrayArg(ast, argList.list[0]);
+            return (array != nullptr) ? array->len : emitInt32(0);
+        }
+        if (call.name == "sum") {
+            return emitReduce(ast, call, Reduce::Sum);
+        }
+        if (call.name == "min") {
+            return emitReduce(ast, call, Reduce::Min);
+        }
+        if (call.name == "max") {
+            return emitReduce(ast, call, Reduce::Max);
+        }
+        if (call.name == "count") {
+            return emitReduce(ast, call, Reduce::Count);
+        }
+        if (call.name == "array") {
+            fail(call.pos, "array() must be bound with let");
+            return emitInt32(0);
+        }
+    }
+
+    auto *found = lookFunc(call.pos, call.name);
+    if (found == nullptr) {
+        return emitInt32(0);
+    }
+    auto objFunc = *found;
+
+    if (argList.size() != objFunc.numArgs) {
+        fail(call.pos, call.name + " takes " + std::to_string(objFunc.numArgs) + " arguments, not "
+            + std::to_string(argList.size()));
+        return emitInt32(0);
+    }
 
     std::vector<Value*> vals;
-    for (auto exprKey : argList.list) {
-        vals.push_back(emitExpression(ast, ast.at(exprKey)));
+    for (int i = 0; i < argList.size(); i++) {
+        auto &expr = ast.at(argList.list[i]);
+        if (!objFunc.arrayArgs.empty() && objFunc.arrayArgs[i]) {
+            auto *array = lookArrayArg(ast, argList.list[i]);
+            if (array == nullptr) {
+                return emitInt32(0);
+            }
+            vals.push_back(array->data);
+            vals.push_back(array->len);
+        } else {
+            vals.push_back(emitExpression(ast, expr));
+        }
     }
  
-    std::vector<Type*> argTypes(objFunc.numArgs, builder.ir().getInt32Ty());
+    std::vector<Type*> argTypes = funcArgTypes(objFunc);
 
     if (builder.getFunc(call.name.c_str()) == nullptr) {
-        builder.createFuncDeclaration(call.name.c_str(), builder.ir().getInt32Ty(), argTypes, false);
+        auto *fn = builder.createFuncDeclaration(call.name.c_str(), builder.ir().getInt32Ty(), argTypes, false);
+        emitFuncAttrs(fn, objFunc);
     }
 
+    inferFromCall(call.name, objFunc);
+
     if (objFunc.hasException) {
         BasicBlock* normalBlk = builder.appendNewBlock("normal");
         BasicBlock* unwindBlk = builder.appendNewBlock("unwind");
@@ -289,9 +928,13 @@ Value* Emit::emitCall(Sparse<ast::Node> &ast, const ast::Call &call, bool resume
         builder.setCurrentBlock(catchBlk);
         auto *payloadPtr = builder.createCall(call.pos, "__cxa_begin_catch", {lpPtr});
         auto *payload = builder.ir().CreateLoad(builder.ir().getInt32Ty(), payloadPtr, "payload");
-        this->emitPrintf("caught exception: %d\n", {payload});
+        if (!returnExceptions) {
+            builder.createCall(call.pos, "jc_output", {emitInt32(OutputException), payload});
+        }
         builder.createCall(call.pos, "__cxa_end_catch", {});
-        emitReturnNoBlock(emitInt32(0));
+        emitArrayFrees(arrayScopes.size());
+        emitReturnNoBlock(returnExceptions ? payload : emitInt32(0));
+        numCatches++;
 
 
         builder.setCurrentBlock(errBlk);
@@ -333,15 +976,21 @@ Value* Emit::emitExpression(Sparse<ast::Node> &ast, const ast::Node &expr) {
     }
     if (std::holds_alternative<ast::Ident>(expr)) {
         auto &ident = std::get<ast::Ident>(expr);
-        auto object = look(ident.ident);
-        if (std::holds_alternative<ObjVar>(object)) {
-            return readVariable(symTab.look(ident.ident), builder.getCurrentBlock());
+        if (!lookVar(ident.pos, ident.ident)) {
+            return emitInt32(0);
         }
-
-        assert(false);
+        return readVariable(symTab.look(ident.ident), builder.getCurrentBlock());
     }
-    assert(false);
-    return nullptr;
+    if (std::holds_alternative<ast::Index>(expr)) {
+        auto &index = std::get<ast::Index>(expr);
+        auto *ptr = emitArrayElemPtr(ast, index.pos, index.name, index.index);
+        if (ptr == nullptr) {
+            return emitInt32(0);
+        }
+        return builder.ir().CreateAlignedLoad(builder.ir().getInt32Ty(), ptr, Align(4), "elem");
+    }
+    fail(std::visit([](auto &node) { return node.pos; }, expr), "expected an expression");
+    return emitInt32(0);
 }
 
 
@@ -368,14 +1017,20 @@ Value* Emit::emitInfix(Sparse<ast::Node> & ast, const ast::Infix &infix) {
     case ast::Minus: return builder.ir().CreateSub(left, right,  "infix");
     case ast::Times: return builder.ir().CreateMul(left, right,  "infix");
     case ast::Divide: {
-        // function has exception
-        auto object = look(funcCurrent);
-        assert(std::holds_alternative<ObjFunc>(object));
-        auto objFn = std::get<ObjFunc>(object);
-        redefine(funcCurrent, ObjFunc{objFn.numArgs, true});
-
+        if (auto *objFn = funcEmitting(); objFn != nullptr) {
+            if (options.trapDivZero) {
+                // a trap neither returns nor may be removed
+                objFn->readNone   = false;
+                objFn->willReturn = false;
+            } else {
+                // function has exception
+                objFn->hasException = true;
+                objFn->noUnwind     = false;
+                objFn->readNone     = false;
+            }
+        }
 
-        // throw exception on 0
+        // throw exception or trap on 0
         auto *cmp = builder.ir().CreateICmpEQ(right, builder.ir().getInt32(0));
 
         BasicBlock *zeroBlk = builder.appendNewBlock("div_zero");
@@ -388,19 +1043,23 @@ Value* Emit::emitInfix(Sparse<ast::Node> & ast, const ast::Infix &infix) {
 
         builder.setCurrentBlock(zeroBlk);
 
-        // throw exception
-        auto *eh = builder.createCall(
-            infix.pos,
-            "__cxa_allocate_exception",
-            {builder.ir().getInt64(4)}
-        );
-        builder.ir().CreateStore(builder.ir().getInt32(123), eh);
-        builder.createCall(
-            infix.pos,
-            "__cxa_throw",
-            {eh, builder.getGlobalVariable("_ZTIi"),
-            builder.getNullptr()}
-        );
+        if (options.trapDivZero) {
+            builder.createTrap();
+        } else {
+            // throw exception
+            auto *eh = builder.createCall(
+                infix.pos,
+                "__cxa_allocate_exception",
+                {builder.ir().getInt64(4)}
+            );
+            builder.ir().CreateStore(builder.ir().getInt32(123), eh);
+            builder.createCall(
+                infix.pos,
+                "__cxa_throw",
+                {eh, builder.getGlobalVariable("_ZTIi"),
+                builder.getNullptr()}
+            );
+        }
         builder.ir().CreateUnreachable();
 
         builder.setCurrentBlock(okayBlk);
@@ -436,18 +1095,306 @@ Value* Emit::emitInt32(int n) {
 
 void Emit::emitReturn(Value *value) {
     BasicBlock *emptyBlock = builder.appendNewBlock();
+    emitArrayFrees(arrayScopes.size());
     builder.ir().CreateRet(value);
     builder.setCurrentBlock(emptyBlock);
 }
 
+// return f(args) inside f, the arguments are evaluated then assigned together.
+void Emit::emitTailRecursion(Sparse<ast::Node> &ast, const ast::Call &call) {
+    assert(tailRec.has_value());
+    auto &argList = std::get<ast::List>(ast.at(call.args));
+    if (argList.size() != tailRec->args.size()) {
+        fail(call.pos, call.name + " takes " + std::to_string(tailRec->args.size()) + " arguments, not "
+            + std::to_string(argList.size()));
+        return;
+    }
+
+    std::vector<Value*> vals;
+    for (auto exprKey : argList.list) {
+        vals.push_back(emitExpression(ast, ast.at(exprKey)));
+    }
+
+    for (size_t i = 0; i < vals.size(); i++) {
+        writeVariable(tailRec->args[i], builder.getCurrentBlock(), vals[i]);
+    }
+
+    // the loop has no bound to prove termination
+    if (auto *objFn = funcEmitting(); objFn != nullptr) {
+        objFn->willReturn = false;
+    }
+
+    BasicBlock *emptyBlock = builder.appendNewBlock();
+    emitArrayFrees(arrayScopes.size());
+    builder.ir().CreateBr(tailRec->loop);
+    builder.setCurrentBlock(emptyBlock);
+}
+
+
+// Marks a call whose result is returned directly. musttail needs matching prototypes
+// and the ret straight after the call, so no arrays may need freeing and the call must be
+// the last instruction emitted. A variable holding an earlier call's result only gets tail.
+void Emit::markTailCall(Value *value) {
+    auto *call = dyn_cast<CallInst>(value);
+    if (call == nullptr) {
+        return;
+    }
+
+    bool arraysLive = false;
+    for (auto &scope : arrayScopes) {
+        arraysLive = arraysLive || !scope.empty();
+    }
+
+    auto *callee = call->getCalledFunction();
+    if (!arraysLive
+        && call->getParent() == builder.getCurrentBlock()
+        && call->getNextNode() == nullptr
+        && callee != nullptr
+        && !callee->isIntrinsic()
+        && callee->getFunctionType() == call->getFunction()->getFunctionType()
+    ) {
+        call->setTailCallKind(CallInst::TCK_MustTail);
+    } else {
+        call->setTailCall();
+    }
+}
+
+
 void Emit::emitReturnNoBlock(Value *value) {
     builder.ir().CreateRet(value);
 }
 
 
 
-void Emit::define(const std::string &name, Object object) {
-    assert(not symTab.isDefined(name));
+// sum(a), min(a), max(a) and count(a, x) reduce the whole array, sum(a, lo, hi) and
+// count(a, x, lo, hi) reduce a[lo..hi). min and max of an empty range return the identity.
+Value* Emit::emitReduce(Sparse<ast::Node> &ast, const ast::Call &call, Reduce op) {
+    auto &argList = std::get<ast::List>(ast.at(call.args));
+    size_t numArgs = (op == Reduce::Count) ? 2 : 1;
+    if (argList.size() != numArgs && argList.size() != numArgs + 2) {
+        fail(call.pos, "wrong number of arguments to " + call.name);
+        return emitInt32(0);
+    }
+
+    auto *found = lookArrayArg(ast, argList.list[0]);
+    if (found == nullptr) {
+        return emitInt32(0);
+    }
+    auto array = *found;
+
+    if (auto *objFn = funcEmitting(); objFn != nullptr) {
+        objFn->readNone = false;
+    }
+
+    Value *x = emitInt32(0);
+    if (op == Reduce::Count) {
+        x = emitExpression(ast, ast.at(argList.list[1]));
+    }
+
+    Value *lo = emitInt32(0);
+    Value *hi = array.len;
+    if (argList.size() == numArgs + 2) {
+        lo = emitExpression(ast, ast.at(argList.list[numArgs]));
+        hi = emitExpression(ast, ast.at(argList.list[numArgs + 1]));
+    }
+
+    auto *kernel = getReduceKernel(builder.getLlModule(), op);
+    return builder.ir().CreateCall(kernel, {array.data, lo, hi, x}, "reduce");
+}
+
+
+// array(n) allocates n zeroed elements. The allocation is 64 byte aligned and padded to a
+// multiple of 64 bytes so that vector loops never straddle a cache line at the start.
+ObjArray Emit::emitArrayAlloc(Sparse<ast::Node> &ast, const ast::Call &call) {
+    auto &argList = std::get<ast::List>(ast.at(call.args));
+    if (argList.size() != 1 || arrayScopes.empty()) {
+        fail(call.pos, arrayScopes.empty() ? "arrays can only be created inside functions" : "array takes 1 argument");
+        return ObjArray{builder.getNullptr(), emitInt32(0)};
+    }
+
+    if (auto *objFn = funcEmitting(); objFn != nullptr) {
+        objFn->readNone = false;
+    }
+
+    auto *n = emitExpression(ast, ast.at(argList.list[0]));
+    auto *isPositive = builder.ir().CreateICmpSGT(n, emitInt32(0));
+    auto *len = builder.ir().CreateSelect(isPositive, n, emitInt32(0), "len");
+
+    auto *bytes = builder.ir().CreateMul(
+        builder.ir().CreateZExt(len, builder.ir().getInt64Ty()),
+        builder.ir().getInt64(4));
+    bytes = builder.ir().CreateAnd(
+        builder.ir().CreateAdd(bytes, builder.ir().getInt64(63)),
+        builder.ir().getInt64(~(uint64_t)63),
+        "bytes");
+
+    auto *data = builder.createCall(call.pos, "aligned_alloc", {builder.ir().getInt64(64), bytes});
+    cast<CallInst>(data)->addRetAttr(Attribute::getWithAlignment(data->getContext(), Align(64)));
+    builder.ir().CreateMemSet(data, builder.ir().getInt8(0), bytes, MaybeAlign(64));
+
+    arrayScopes.back().push_back(data);
+    return ObjArray{data, len};
+}
+
+
+// returns a pointer to a[index], indices are not bounds checked. Null when name isn't an array.
+Value* Emit::emitArrayElemPtr(Sparse<ast::Node> &ast, TextPos pos, const std::string &name, Sparse<ast::Node>::Key index) {
+    auto *found = lookArray(pos, name);
+    if (found == nullptr) {
+        return nullptr;
+    }
+    auto array = *found;
+
+    if (auto *objFn = funcEmitting(); objFn != nullptr) {
+        objFn->readNone = false;
+    }
+
+    auto *idx = emitExpression(ast, ast.at(index));
+    auto *idx64 = builder.ir().CreateSExt(idx, builder.ir().getInt64Ty());
+    return builder.ir().CreateInBoundsGEP(builder.ir().getInt32Ty(), array.data, {idx64}, "elemPtr");
+}
+
+
+// frees the arrays owned by the innermost numScopes scopes. Arrays are leaked when a
+// division by zero unwinds or traps out of the function.
+void Emit::emitArrayFrees(size_t numScopes) {
+    assert(numScopes <= arrayScopes.size());
+    for (size_t i = arrayScopes.size() - numScopes; i < arrayScopes.size(); i++) {
+        for (auto *data : arrayScopes[i]) {
+            builder.createCall("free", {data});
+        }
+    }
+}
+
+
+void Emit::pushScope() {
+    symTab.pushScope();
+    arrayScopes.emplace_back();
+}
+
+
+void Emit::popScope() {
+    assert(!arrayScopes.empty());
+    emitArrayFrees(1);
+    arrayScopes.pop_back();
+    symTab.popScope();
+}
+
+
+std::vector<Type*> Emit::funcArgTypes(const ObjFunc &objFunc) {
+    std::vector<Type*> argTypes;
+    for (size_t i = 0; i < objFunc.numArgs; i++) {
+        if (!objFunc.arrayArgs.empty() && objFunc.arrayArgs[i]) {
+            argTypes.push_back(builder.ir().getPtrTy());
+        }
+        argTypes.push_back(builder.ir().getInt32Ty());
+    }
+    return argTypes;
+}
+
+
+void Emit::emitFuncAttrs(Function *fn, const ObjFunc &objFunc) {
+    if (objFunc.noUnwind) {
+        fn->setDoesNotThrow();
+    }
+    if (objFunc.readNone) {
+        fn->setDoesNotAccessMemory();
+    }
+    if (objFunc.willReturn) {
+        fn->setWillReturn();
+    }
+    if (objFunc.noRecurse) {
+        fn->setDoesNotRecurse();
+    }
+}
+
+
+// A function body is pure if it has no array operations and only calls itself, functions
+// being emitted around it or pure functions which don't throw. The catch block of a call to a
+// throwing function prints, so it is an effect.
+bool Emit::isPure(Sparse<ast::Node> &ast, Sparse<ast::Node>::Key key, const std::string &funcName) {
+    auto &node = ast.at(key);
+    if (std::holds_alternative<ast::FnDef>(node)) {
+        return true;
+    }
+    if (std::holds_alternative<ast::Index>(node) || std::holds_alternative<ast::SetIndex>(node)) {
+        return false;
+    }
+    if (auto *call = std::get_if<ast::Call>(&node); call != nullptr && call->name != funcName) {
+        if (!symTab.isDefined(call->name)) {
+            return false; // builtins and functions defined later in the body
+        }
+        auto *objCallee = std::get_if<ObjFunc>(&objTable[symTab.look(call->name)]);
+        if (objCallee == nullptr || !objCallee->pure || objCallee->hasException) {
+            return false;
+        }
+    }
+
+    for (auto child : ast::children(node)) {
+        if (!isPure(ast, child, funcName)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// a call to a builtin, unless a function of the same name has been defined
+bool Emit::isBuiltin(const std::string &name) {
+    return ast::isBuiltinName(name)
+        && !(symTab.isDefined(name) && std::holds_alternative<ObjFunc>(look(name)));
+}
+
+
+// returns the function whose body is being emitted, nullptr for top-level code.
+ObjFunc* Emit::funcEmitting() {
+    if (funcsEmitting.empty()) {
+        return nullptr;
+    }
+    auto id = symTab.look(funcsEmitting.back());
+    assert(objTable.find(id) != objTable.end());
+    return std::get_if<ObjFunc>(&objTable[id]);
+}
+
+
+void Emit::inferFromCall(const std::string &callee, const ObjFunc &objCallee) {
+    auto *objFn = funcEmitting();
+    if (objFn == nullptr) {
+        return;
+    }
+
+    // calling a function which is still being emitted closes a cycle in the call graph,
+    // every function on the cycle may recurse.
+    auto it = std::find(funcsEmitting.begin(), funcsEmitting.end(), callee);
+    if (it != funcsEmitting.end()) {
+        for (; it != funcsEmitting.end(); it++) {
+            if (auto *objCycle = std::get_if<ObjFunc>(&objTable[symTab.look(*it)]); objCycle != nullptr) {
+                objCycle->noRecurse  = false;
+                objCycle->willReturn = false;
+            }
+        }
+        return;
+    }
+
+    objFn->noUnwind   = objFn->noUnwind && objCallee.noUnwind;
+    objFn->readNone   = objFn->readNone && objCallee.readNone;
+    objFn->willReturn = objFn->willReturn && objCallee.willReturn;
+
+    // the landing pad prints the exception and may resume unwinding
+    if (objCallee.hasException) {
+        objFn->noUnwind   = false;
+        objFn->readNone   = false;
+        objFn->willReturn = false;
+    }
+}
+
+
+// a name can't shadow another one, the first definition is kept after the error
+void Emit::define(TextPos pos, const std::string &name, Object object) {
+    if (symTab.isDefined(name)) {
+        fail(pos, name + " is already defined");
+        return;
+    }
 
     auto id = symTab.insert(name);
     assert(objTable.find(id) == objTable.end());
@@ -469,6 +1416,73 @@ Object Emit::look(const std::string &name) {
     return objTable[id];
 }
 
+// functions are visible from nested functions, the variables of an enclosing function aren't
+Object* Emit::lookChecked(TextPos pos, const std::string &name) {
+    if (!symTab.isDefined(name)) {
+        fail(pos, name + " is not defined");
+        return nullptr;
+    }
+    auto *object = &objTable[symTab.look(name)];
+    if (symTab.scopeOf(name) < funcScope && !std::holds_alternative<ObjFunc>(*object)) {
+        fail(pos, name + " belongs to an enclosing function");
+        return nullptr;
+    }
+    return object;
+}
+
+bool Emit::lookVar(TextPos pos, const std::string &name) {
+    auto *object = lookChecked(pos, name);
+    if (object != nullptr && !std::holds_alternative<ObjVar>(*object)) {
+        fail(pos, name + " is not a variable");
+        return false;
+    }
+    return object != nullptr;
+}
+
+ObjArray* Emit::lookArray(TextPos pos, const std::string &name) {
+    auto *object = lookChecked(pos, name);
+    if (object != nullptr && !std::holds_alternative<ObjArray>(*object)) {
+        fail(pos, name + " is not an array");
+        return nullptr;
+    }
+    return (object != nullptr) ? &std::get<ObjArray>(*object) : nullptr;
+}
+
+// arrays are passed to functions and builtins by name
+ObjArray* Emit::lookArrayArg(Sparse<ast::Node> &ast, Sparse<ast::Node>::Key key) {
+    auto &node = ast.at(key);
+    if (auto *ident = std::get_if<ast::Ident>(&node); ident != nullptr) {
+        return lookArray(ident->pos, ident->ident);
+    }
+    fail(std::visit([](auto &node) { return node.pos; }, node), "expected the name of an array");
+    return nullptr;
+}
+
+ObjFunc* Emit::lookFunc(TextPos pos, const std::string &name) {
+    auto *object = lookChecked(pos, name);
+    if (object != nullptr && !std::holds_alternative<ObjFunc>(*object)) {
+        fail(pos, name + " is not a function");
+        return nullptr;
+    }
+    return (object != nullptr) ? &std::get<ObjFunc>(*object) : nullptr;
+}
+
+
+void Emit::fail(TextPos pos, const std::string &what) {
+    if (!error) {
+        error = std::to_string(pos.line) + ":" + std::to_string(pos.column) + ": " + what;
+    }
+}
+
+Error Emit::takeError() {
+    if (!error) {
+        return Error::success();
+    }
+    auto err = createStringError(inconvertibleErrorCode(), "%s", error->c_str());
+    error.reset();
+    return err;
+}
+
 void Emit::sealBlock(BasicBlock *block) {
     assert(sealedBlocks.find(block) == sealedBlocks.end());
 
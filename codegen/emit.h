@@ -5,32 +5,69 @@
 #include "symbols.h"
 #include "sparse.h"
 #include "lexer.h"
+#include "kernels.h"
 
 #include <set>
 #include <map>
+#include <optional>
 #include <vector>
 
+#include <llvm/Support/Error.h>
+
 struct ObjFunc {
     size_t numArgs;
     bool   hasException;
+
+    // attributes inferred transitively over the call graph while the body is emitted
+    bool   noUnwind   = true;
+    bool   readNone   = true;
+    bool   willReturn = true;
+    bool   noRecurse  = true;
+
+    // no effects besides the result or a division exception, found from the body before it is emitted
+    bool   pure       = false;
+
+    // arguments declared as a[] are passed as a data pointer and a length
+    std::vector<bool> arrayArgs;
 };
 
 struct ObjVar {
     Sparse<ModuleBuilder::VarLocal>::Key debugKey;
 };
 
-using Object = std::variant<ObjFunc, ObjVar>;
+// arrays are immutable bindings to contiguous i32 memory, elements are mutable.
+struct ObjArray {
+    llvm::Value *data;
+    llvm::Value *len;
+};
+
+using Object = std::variant<ObjFunc, ObjVar, ObjArray>;
 
+// Options which change the code emitted for a program.
+struct EmitOptions {
+    // division by zero executes a trap which the host catches instead of throwing a
+    // c++ exception, so functions with division don't need invokes and landing pads.
+    bool trapDivZero = false;
+
+    // memoise every pure function with arguments, not just those declared 'memo fn'
+    bool memoiseAll = false;
+};
+
+// Emits a program into one module. The start function evaluates the top-level expressions,
+// a module with an empty start function name only holds the functions it is given.
 class Emit {
 public:
     Emit(
         llvm::LLVMContext &context,
         const std::string &name,
         const std::string &startFunctionName,
+        const EmitOptions &options = EmitOptions(),
         const std::filesystem::path &debugFilePath = "jitCalc"
     );
 
     void         emitProgram(Sparse<ast::Node>::Key, Sparse<ast::Node> &);
+    void         emitResult(Sparse<ast::Node> &, const ast::Node &);
+    llvm::Function* emitResultChunk(Sparse<ast::Node> &, const std::vector<Sparse<ast::Node>::Key> &, const std::string &name);
     void         emitStmt(Sparse<ast::Node> &, const ast::Node &);
     void         emitFuncDef(Sparse<ast::Node> &, const ast::FnDef &);
     llvm::Value* emitExpression(Sparse<ast::Node> &, const ast::Node &);
@@ -38,9 +75,20 @@ public:
     llvm::Value* emitPrefix(Sparse<ast::Node> &, const ast::Prefix &);
     llvm::Value* emitInt32(int n);
     llvm::Value* emitCall(Sparse<ast::Node> &, const ast::Call&, bool);
+    llvm::Value* emitReduce(Sparse<ast::Node> &, const ast::Call&, Reduce);
+    ObjArray     emitArrayAlloc(Sparse<ast::Node> &, const ast::Call&);
+    llvm::Value* emitArrayElemPtr(Sparse<ast::Node> &, TextPos, const std::string &name, Sparse<ast::Node>::Key index);
+    void         emitArrayFrees(size_t numScopes);
+    void         emitForLoop(Sparse<ast::Node> &, const ast::ForIn &, llvm::Value *lo, llvm::Value *hi, int step);
+    void         emitLoop(Sparse<ast::Node> &, const ast::ForIn &, llvm::Value *start, llvm::Value *end, llvm::Value *tripCount, int step);
+    llvm::Value* emitTripCount(llvm::Value *lo, llvm::Value *hi, int step);
+    void         emitParallelFor(Sparse<ast::Node> &, const ast::ForIn &, llvm::Value *lo, llvm::Value *hi, int step);
     void         emitReturn(llvm::Value *value);
+    void         emitTailRecursion(Sparse<ast::Node> &, const ast::Call &);
+    void         markTailCall(llvm::Value *value);
     void         emitReturnNoBlock(llvm::Value *value);
     void         emitPrintf(const char* fmt, std::vector<llvm::Value*> args);
+    void         emitFuncAttrs(llvm::Function *fn, const ObjFunc &);
 
     std::vector<std::pair<std::string, ObjFunc>> getFuncDefs() {
         std::vector<std::pair<std::string, ObjFunc>> funcDefs;
@@ -52,7 +100,7 @@ public:
                 auto fn = std::get<ObjFunc>(object);
                 funcDefs.push_back(std::make_pair<std::string, ObjFunc>(
                     std::string(pair.first),
-                    ObjFunc{fn.numArgs, fn.hasException}
+                    ObjFunc(fn)
                 ));
             }
         }
@@ -66,15 +114,65 @@ public:
         }
     }
 
+    // The first error in the source, such as an undefined name or a call with the wrong
+    // arguments. Emitting carries on past an error with placeholder values, so the module
+    // must be thrown away when this isn't success.
+    llvm::Error takeError();
+
     ModuleBuilder &mod() { return builder; }
 private:
+    EmitOptions options;
     std::string funcCurrent;
     ModuleBuilder builder;
 
-    // Symbol table uses IDs and Objects
+    std::optional<std::string> error;
+    void fail(TextPos pos, const std::string &what);
+
+    // Symbol table uses IDs and Objects. The checked lookups report a name which isn't
+    // defined, is the wrong kind or is a variable of an enclosing function, and return null.
     Object look(const std::string &name);
-    void define(const std::string &name, Object object);
+    void define(TextPos pos, const std::string &name, Object object);
     void redefine(const std::string &name, Object object);
+    Object*   lookChecked(TextPos pos, const std::string &name);
+    bool      lookVar(TextPos pos, const std::string &name);
+    ObjArray* lookArray(TextPos pos, const std::string &name);
+    ObjArray* lookArrayArg(Sparse<ast::Node> &, Sparse<ast::Node>::Key);
+    ObjFunc*  lookFunc(TextPos pos, const std::string &name);
+    size_t    funcScope = 0; // first scope of the function being emitted
+
+    bool isBuiltin(const std::string &name);
+
+    // Attribute inference for the functions currently being emitted
+    ObjFunc* funcEmitting();
+    bool     isPure(Sparse<ast::Node> &, Sparse<ast::Node>::Key, const std::string &funcName);
+    void     inferFromCall(const std::string &callee, const ObjFunc &);
+    std::vector<std::string> funcsEmitting;
+
+    // Scopes also own the arrays allocated in them, they are freed when the scope ends
+    void pushScope();
+    void popScope();
+    std::vector<llvm::Type*> funcArgTypes(const ObjFunc &);
+    std::vector<std::vector<llvm::Value*>> arrayScopes;
+
+    // Self tail calls of the function being emitted branch back to the top of its body
+    struct TailRec {
+        std::string                  name;
+        llvm::BasicBlock             *loop;
+        std::vector<SymbolTable::ID> args;
+    };
+    std::optional<TailRec> tailRec;
+
+    // numbers the functions outlined from pfor bodies
+    size_t numPfors = 0;
+
+    // In a pfor body or a batch chunk an exception caught from a call isn't printed, the
+    // chunk returns its payload and whatever started it reports the exception. numCatches
+    // counts the catch paths emitted, so a pfor knows whether its body has any.
+    bool   returnExceptions = false;
+    size_t numCatches       = 0;
+
+    // format strings emitted by emitPrintf
+    std::map<std::string, llvm::Constant*> fmtStrings;
 
     SymbolTable   symTab;
     std::map<SymbolTable::ID, Object> objTable;
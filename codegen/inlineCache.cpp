@@ -0,0 +1,202 @@
+#include "inlineCache.h"
+
+#include <cassert>
+
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DebugInfo.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+using namespace llvm;
+
+// the globals used by a function's instructions, including those inside constant expressions
+static void collectGlobals(const Value *value, std::set<const GlobalValue*> &globals, std::set<const Constant*> &seen) {
+    if (auto *global = dyn_cast<GlobalValue>(value); global != nullptr) {
+        globals.insert(global);
+        return;
+    }
+    if (auto *constant = dyn_cast<Constant>(value); constant != nullptr && seen.insert(constant).second) {
+        for (auto &operand : constant->operands()) {
+            collectGlobals(operand.get(), globals, seen);
+        }
+    }
+}
+
+static std::set<const GlobalValue*> collectGlobals(const Function &fn) {
+    std::set<const GlobalValue*> globals;
+    std::set<const Constant*>    seen;
+    if (fn.hasPersonalityFn()) {
+        collectGlobals(fn.getPersonalityFn(), globals, seen);
+    }
+    for (auto &block : fn) {
+        for (auto &inst : block) {
+            for (auto &operand : inst.operands()) {
+                collectGlobals(operand.get(), globals, seen);
+            }
+        }
+    }
+    return globals;
+}
+
+
+void InlineCache::add(const Module &module) {
+    // debug info would have to be merged with each importing module's compile unit, the
+    // copies are only there to be inlined so it is dropped.
+    std::shared_ptr<Module> copy = CloneModule(module);
+    StripDebugInfo(*copy);
+
+    for (auto &fn : *copy) {
+        std::set<const Function*> visiting;
+        if (fn.hasExternalLinkage() && !fn.isDeclaration() && canImport(fn, visiting)) {
+            bodies[fn.getName().str()] = Body{&fn, copy};
+        }
+    }
+}
+
+
+void InlineCache::remove(const std::string &name) {
+    auto it = bodies.find(name);
+    if (it == bodies.end()) {
+        return;
+    }
+
+    auto module = it->second.module;
+    for (auto jt = bodies.begin(); jt != bodies.end();) {
+        jt = (jt->second.module == module) ? bodies.erase(jt) : std::next(jt);
+    }
+}
+
+
+// Bodies may use external functions and globals, which are declared in the importing module,
+// internal functions, which are copied, and constants such as format strings. Internal
+// variables like memo tables would be duplicated, so functions using them aren't imported.
+bool InlineCache::canImport(const Function &fn, std::set<const Function*> &visiting) {
+    if (!visiting.insert(&fn).second) {
+        return true;
+    }
+
+    for (auto *global : collectGlobals(fn)) {
+        if (auto *callee = dyn_cast<Function>(global); callee != nullptr) {
+            if (callee->hasLocalLinkage() && !canImport(*callee, visiting)) {
+                return false;
+            }
+        } else if (auto *var = dyn_cast<GlobalVariable>(global); var != nullptr) {
+            if (var->hasLocalLinkage()
+                && !(var->isConstant() && var->hasInitializer() && isa<ConstantData>(var->getInitializer()))
+            ) {
+                return false;
+            }
+        } else {
+            return false; // aliases and ifuncs
+        }
+    }
+    return true;
+}
+
+
+// Maps the globals used by fn to their counterparts in module. Declarations which are
+// created for cached functions are added to the worklist so their bodies are imported too.
+void InlineCache::mapGlobals(
+    const Function                       &fn,
+    Module                               &module,
+    ValueToValueMapTy                    &vmap,
+    std::map<const Function*, Function*> &localClones,
+    std::vector<Function*>               &worklist
+) {
+    for (auto *global : collectGlobals(fn)) {
+        if (vmap.count(global) > 0) {
+            continue;
+        }
+
+        if (auto *callee = dyn_cast<Function>(global); callee != nullptr) {
+            if (callee->hasLocalLinkage()) {
+                auto it = localClones.find(callee);
+                if (it == localClones.end()) {
+                    auto *clone = Function::Create(
+                        callee->getFunctionType(), GlobalValue::InternalLinkage, callee->getName(), module);
+                    it = localClones.emplace(callee, clone).first;
+                    vmap[callee] = clone;
+
+                    mapGlobals(*callee, module, vmap, localClones, worklist);
+                    auto argIt = clone->arg_begin();
+                    for (auto &arg : callee->args()) {
+                        vmap[&arg] = &*argIt++;
+                    }
+                    SmallVector<ReturnInst*, 4> returns;
+                    CloneFunctionInto(clone, callee, vmap, CloneFunctionChangeType::DifferentModule, returns);
+                    clone->setLinkage(GlobalValue::InternalLinkage);
+                }
+                vmap[callee] = it->second;
+                continue;
+            }
+
+            auto *decl = module.getFunction(callee->getName());
+            if (decl == nullptr) {
+                decl = Function::Create(
+                    callee->getFunctionType(), GlobalValue::ExternalLinkage, callee->getName(), module);
+                decl->setAttributes(callee->getAttributes());
+                decl->setCallingConv(callee->getCallingConv());
+                if (bodies.count(callee->getName().str()) > 0) {
+                    worklist.push_back(decl);
+                }
+            }
+            vmap[callee] = decl;
+
+        } else if (auto *var = dyn_cast<GlobalVariable>(global); var != nullptr) {
+            GlobalVariable *copy;
+            if (var->hasLocalLinkage()) {
+                copy = new GlobalVariable(
+                    module,
+                    var->getValueType(),
+                    var->isConstant(),
+                    var->getLinkage(),
+                    const_cast<Constant*>(var->getInitializer()), // constants are shared by the context
+                    var->getName());
+                copy->setUnnamedAddr(var->getUnnamedAddr());
+                copy->setAlignment(var->getAlign());
+            } else if (copy = module.getNamedGlobal(var->getName()); copy == nullptr) {
+                copy = new GlobalVariable(
+                    module,
+                    var->getValueType(),
+                    var->isConstant(),
+                    GlobalValue::ExternalLinkage,
+                    nullptr,
+                    var->getName());
+            }
+            vmap[var] = copy;
+        }
+    }
+}
+
+
+void InlineCache::import(Module &module) {
+    std::vector<Function*> worklist;
+    for (auto &fn : module) {
+        if (fn.isDeclaration() && bodies.count(fn.getName().str()) > 0) {
+            worklist.push_back(&fn);
+        }
+    }
+
+    std::map<const Function*, Function*> localClones;
+    while (!worklist.empty()) {
+        auto *decl = worklist.back();
+        worklist.pop_back();
+
+        auto *body = bodies[decl->getName().str()].fn;
+        if (!decl->isDeclaration() || body->getFunctionType() != decl->getFunctionType()) {
+            continue;
+        }
+
+        ValueToValueMapTy vmap;
+        vmap[body] = decl;
+        mapGlobals(*body, module, vmap, localClones, worklist);
+        auto argIt = decl->arg_begin();
+        for (auto &arg : body->args()) {
+            vmap[&arg] = &*argIt++;
+        }
+
+        SmallVector<ReturnInst*, 4> returns;
+        CloneFunctionInto(decl, body, vmap, CloneFunctionChangeType::DifferentModule, returns);
+        decl->setLinkage(GlobalValue::AvailableExternallyLinkage);
+    }
+}
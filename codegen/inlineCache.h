@@ -0,0 +1,43 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <llvm/IR/Module.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
+
+// Keeps the optimised IR of the functions defined by earlier REPL cells. A new cell's module
+// is given available_externally copies of the bodies it calls so the inliner can work
+// across cells, while calls which aren't inlined still go to the one jitted definition.
+class InlineCache {
+public:
+    // copies the externally visible functions of an optimised module, it must share the
+    // context of the modules which import them.
+    void add(const llvm::Module &module);
+
+    // defines the declarations in module which have cached bodies, and the declarations
+    // those bodies call in turn, as available_externally.
+    void import(llvm::Module &module);
+
+    // forgets the bodies of the module which defined name, eg. when it is redefined. A
+    // cached module is freed once none of its bodies are left.
+    void remove(const std::string &name);
+
+private:
+    struct Body {
+        const llvm::Function          *fn;
+        std::shared_ptr<llvm::Module> module;
+    };
+    std::map<std::string, Body> bodies;
+
+    bool canImport(const llvm::Function &fn, std::set<const llvm::Function*> &visiting);
+    void mapGlobals(
+        const llvm::Function                             &fn,
+        llvm::Module                                     &module,
+        llvm::ValueToValueMapTy                          &vmap,
+        std::map<const llvm::Function*, llvm::Function*> &localClones,
+        std::vector<llvm::Function*>                     &worklist);
+};
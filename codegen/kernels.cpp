@@ -0,0 +1,296 @@
+#include "kernels.h"
+
+#include <cassert>
+#include <cstdint>
+#include <limits>
+
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Intrinsics.h>
+
+using namespace llvm;
+
+// memo tables have 2^memoTableBits entries and probe memoProbes consecutive slots
+static const unsigned memoTableBits = 12;
+static const unsigned memoProbes    = 4;
+
+// elements per vector iteration, 8 x i32 fills an avx2 register and is split by the
+// backend on narrower targets.
+static const unsigned vectorWidth = 8;
+
+
+static const char* kernelName(Reduce op) {
+    switch (op) {
+    case Reduce::Sum:   return "__jc_reduce_sum";
+    case Reduce::Min:   return "__jc_reduce_min";
+    case Reduce::Max:   return "__jc_reduce_max";
+    case Reduce::Count: return "__jc_reduce_count";
+    }
+    assert(false);
+    return nullptr;
+}
+
+
+static int32_t identityValue(Reduce op) {
+    switch (op) {
+    case Reduce::Sum:   return 0;
+    case Reduce::Min:   return std::numeric_limits<int32_t>::max();
+    case Reduce::Max:   return std::numeric_limits<int32_t>::min();
+    case Reduce::Count: return 0;
+    }
+    assert(false);
+    return 0;
+}
+
+
+// folds elem into acc, works on both scalars and vectors.
+static Value* combine(IRBuilder<> &ir, Reduce op, Value *acc, Value *elem, Value *x) {
+    switch (op) {
+    case Reduce::Sum:   return ir.CreateAdd(acc, elem, "acc");
+    case Reduce::Min:   return ir.CreateBinaryIntrinsic(Intrinsic::smin, acc, elem, nullptr, "acc");
+    case Reduce::Max:   return ir.CreateBinaryIntrinsic(Intrinsic::smax, acc, elem, nullptr, "acc");
+    case Reduce::Count: return ir.CreateAdd(acc, ir.CreateZExt(ir.CreateICmpEQ(elem, x), acc->getType()), "acc");
+    }
+    assert(false);
+    return nullptr;
+}
+
+
+static Value* reduceVector(IRBuilder<> &ir, Reduce op, Value *vec) {
+    switch (op) {
+    case Reduce::Sum:   return ir.CreateAddReduce(vec);
+    case Reduce::Min:   return ir.CreateIntMinReduce(vec, true);
+    case Reduce::Max:   return ir.CreateIntMaxReduce(vec, true);
+    case Reduce::Count: return ir.CreateAddReduce(vec);
+    }
+    assert(false);
+    return nullptr;
+}
+
+
+Function* getReduceKernel(Module &module, Reduce op) {
+    if (auto *fn = module.getFunction(kernelName(op)); fn != nullptr) {
+        return fn;
+    }
+
+    auto &context = module.getContext();
+    IRBuilder<> ir(context);
+    auto *i32 = ir.getInt32Ty();
+    auto *i64 = ir.getInt64Ty();
+    auto *vecTy = FixedVectorType::get(i32, vectorWidth);
+
+    auto *fnTy = FunctionType::get(i32, {ir.getPtrTy(), i32, i32, i32}, false);
+    auto *fn = Function::Create(fnTy, GlobalValue::InternalLinkage, kernelName(op), module);
+    fn->setDoesNotThrow();
+    fn->setWillReturn();
+    fn->setDoesNotRecurse();
+    fn->setOnlyReadsMemory();
+    fn->setOnlyAccessesArgMemory();
+    fn->addParamAttr(0, Attribute::NoCapture);
+
+    Value *data = fn->getArg(0);
+    Value *lo   = fn->getArg(1);
+    Value *hi   = fn->getArg(2);
+    Value *x    = fn->getArg(3);
+
+    BasicBlock *entry      = BasicBlock::Create(context, "entry", fn);
+    BasicBlock *vecLoop    = BasicBlock::Create(context, "vecLoop", fn);
+    BasicBlock *vecDone    = BasicBlock::Create(context, "vecDone", fn);
+    BasicBlock *scalarLoop = BasicBlock::Create(context, "scalarLoop", fn);
+    BasicBlock *exit       = BasicBlock::Create(context, "exit", fn);
+
+    // the vector loop covers the largest multiple of vectorWidth elements
+    ir.SetInsertPoint(entry);
+    auto *base   = ir.CreateInBoundsGEP(i32, data, {ir.CreateSExt(lo, i64)}, "base");
+    auto *n      = ir.CreateBinaryIntrinsic(Intrinsic::smax, ir.CreateSub(hi, lo), ir.getInt32(0));
+    auto *n64    = ir.CreateZExt(n, i64, "n");
+    auto *vecEnd = ir.CreateAnd(n64, ir.getInt64(~(uint64_t)(vectorWidth - 1)), "vecEnd");
+    auto *identVec = ir.CreateVectorSplat(vectorWidth, ir.getInt32(identityValue(op)));
+    auto *xVec     = ir.CreateVectorSplat(vectorWidth, x, "xVec");
+    ir.CreateCondBr(ir.CreateICmpUGT(vecEnd, ir.getInt64(0)), vecLoop, vecDone);
+
+    ir.SetInsertPoint(vecLoop);
+    auto *i   = ir.CreatePHI(i64, 2, "i");
+    auto *acc = ir.CreatePHI(vecTy, 2, "accVec");
+    auto *elems   = ir.CreateAlignedLoad(vecTy, ir.CreateInBoundsGEP(i32, base, {i}), Align(4), "elems");
+    auto *accNext = combine(ir, op, acc, elems, xVec);
+    auto *iNext   = ir.CreateNUWAdd(i, ir.getInt64(vectorWidth), "iNext");
+    ir.CreateCondBr(ir.CreateICmpULT(iNext, vecEnd), vecLoop, vecDone);
+    i->addIncoming(ir.getInt64(0), entry);
+    i->addIncoming(iNext, vecLoop);
+    acc->addIncoming(identVec, entry);
+    acc->addIncoming(accNext, vecLoop);
+
+    // horizontal reduction, then the scalar epilogue for the remaining elements
+    ir.SetInsertPoint(vecDone);
+    auto *accDone = ir.CreatePHI(vecTy, 2, "accDone");
+    accDone->addIncoming(identVec, entry);
+    accDone->addIncoming(accNext, vecLoop);
+    auto *reduced = reduceVector(ir, op, accDone);
+    ir.CreateCondBr(ir.CreateICmpULT(vecEnd, n64), scalarLoop, exit);
+
+    ir.SetInsertPoint(scalarLoop);
+    auto *j = ir.CreatePHI(i64, 2, "j");
+    auto *r = ir.CreatePHI(i32, 2, "r");
+    auto *elem  = ir.CreateAlignedLoad(i32, ir.CreateInBoundsGEP(i32, base, {j}), Align(4), "elem");
+    auto *rNext = combine(ir, op, r, elem, x);
+    auto *jNext = ir.CreateNUWAdd(j, ir.getInt64(1), "jNext");
+    ir.CreateCondBr(ir.CreateICmpULT(jNext, n64), scalarLoop, exit);
+    j->addIncoming(vecEnd, vecDone);
+    j->addIncoming(jNext, scalarLoop);
+    r->addIncoming(reduced, vecDone);
+    r->addIncoming(rNext, scalarLoop);
+
+    ir.SetInsertPoint(exit);
+    auto *result = ir.CreatePHI(i32, 2, "result");
+    result->addIncoming(reduced, vecDone);
+    result->addIncoming(rNext, scalarLoop);
+    ir.CreateRet(result);
+
+    return fn;
+}
+
+
+Function* createMemoWrapper(Module &module, Function *body, const std::string &name) {
+    auto &context = module.getContext();
+    IRBuilder<> ir(context);
+    auto *i32 = ir.getInt32Ty();
+    size_t numArgs = body->arg_size();
+
+    // entry = { i32 version, i32 value, [numArgs x i32] keys }
+    // version is a sequence lock, 0 is empty, odd while a writer owns the entry
+    auto *entryTy = StructType::get(context, {i32, i32, ArrayType::get(i32, numArgs)});
+    auto *tableTy = ArrayType::get(entryTy, 1 << memoTableBits);
+    auto *table = new GlobalVariable(
+        module,
+        tableTy,
+        false,
+        GlobalValue::InternalLinkage,
+        ConstantAggregateZero::get(tableTy),
+        name + ".memo");
+
+    auto *fn = Function::Create(body->getFunctionType(), GlobalValue::ExternalLinkage, name, module);
+    std::vector<Value*> args;
+    for (auto &arg : fn->args()) {
+        args.push_back(&arg);
+    }
+
+    auto slotPtr = [&](Value *slot, unsigned field) {
+        return ir.CreateInBoundsGEP(tableTy, table, {ir.getInt32(0), slot, ir.getInt32(field)});
+    };
+    auto keyPtr = [&](Value *slot, size_t i) {
+        return ir.CreateInBoundsGEP(tableTy, table, {ir.getInt32(0), slot, ir.getInt32(2), ir.getInt32(i)});
+    };
+
+    // entries may be written by another thread while they're read, every access is atomic
+    auto load = [&](Value *ptr, AtomicOrdering order, const char *valueName) {
+        auto *inst = ir.CreateAlignedLoad(i32, ptr, Align(4), valueName);
+        inst->setAtomic(order);
+        return inst;
+    };
+    auto store = [&](Value *value, Value *ptr, AtomicOrdering order) {
+        ir.CreateAlignedStore(value, ptr, Align(4))->setAtomic(order);
+    };
+
+    BasicBlock *entry = BasicBlock::Create(context, "entry", fn);
+    ir.SetInsertPoint(entry);
+
+    // multiplicative hash, the top bits pick the home slot
+    Value *hash = ir.getInt32(0x811c9dc5);
+    for (auto *arg : args) {
+        hash = ir.CreateMul(ir.CreateXor(hash, arg), ir.getInt32(0x9e3779b1));
+    }
+    auto *home = ir.CreateLShr(hash, 32 - memoTableBits, "home");
+
+    std::vector<Value*> slots;
+    BasicBlock *miss = BasicBlock::Create(context, "miss", fn);
+    for (unsigned p = 0; p < memoProbes; p++) {
+        auto *slot = ir.CreateAnd(ir.CreateAdd(home, ir.getInt32(p)), ir.getInt32((1 << memoTableBits) - 1), "slot");
+        slots.push_back(slot);
+
+        // a hit needs the same even, non-zero version before and after reading the entry
+        auto *version = load(slotPtr(slot, 0), AtomicOrdering::Acquire, "version");
+        Value *match = ir.CreateAnd(
+            ir.CreateICmpNE(version, ir.getInt32(0)),
+            ir.CreateICmpEQ(ir.CreateAnd(version, ir.getInt32(1)), ir.getInt32(0)));
+        for (size_t i = 0; i < numArgs; i++) {
+            auto *key = load(keyPtr(slot, i), AtomicOrdering::Monotonic, "key");
+            match = ir.CreateAnd(match, ir.CreateICmpEQ(key, args[i]));
+        }
+        auto *value = load(slotPtr(slot, 1), AtomicOrdering::Monotonic, "value");
+        ir.CreateFence(AtomicOrdering::Acquire);
+        auto *versionAfter = load(slotPtr(slot, 0), AtomicOrdering::Monotonic, "versionAfter");
+        match = ir.CreateAnd(match, ir.CreateICmpEQ(version, versionAfter));
+
+        BasicBlock *hit = BasicBlock::Create(context, "hit", fn, miss);
+        BasicBlock *next = (p + 1 < memoProbes) ? BasicBlock::Create(context, "probe", fn, miss) : miss;
+        ir.CreateCondBr(match, hit, next);
+
+        ir.SetInsertPoint(hit);
+        ir.CreateRet(value);
+
+        ir.SetInsertPoint(next);
+    }
+
+    // the body may have filled slots recursively, so pick the first free slot after the
+    // call returns and evict the home slot when all are taken.
+    auto *call = ir.CreateCall(body, args, "result");
+    Value *insert = slots[0];
+    for (int p = memoProbes - 1; p >= 0; p--) {
+        auto *version = load(slotPtr(slots[p], 0), AtomicOrdering::Monotonic, "version");
+        auto *empty = ir.CreateICmpEQ(version, ir.getInt32(0));
+        insert = ir.CreateSelect(empty, slots[p], insert, "insert");
+    }
+
+    // take the entry by making its version odd, give up if another writer has it
+    BasicBlock *write = BasicBlock::Create(context, "write", fn);
+    BasicBlock *done  = BasicBlock::Create(context, "done", fn);
+    auto *version = load(slotPtr(insert, 0), AtomicOrdering::Monotonic, "version");
+    auto *locked = ir.CreateOr(version, ir.getInt32(1), "locked");
+    auto *cmpXchg = ir.CreateAtomicCmpXchg(
+        slotPtr(insert, 0),
+        ir.CreateAnd(version, ir.getInt32(~1)),
+        locked,
+        MaybeAlign(4),
+        AtomicOrdering::Monotonic,
+        AtomicOrdering::Monotonic);
+    ir.CreateCondBr(ir.CreateExtractValue(cmpXchg, {1}), write, done);
+
+    // a reader which sees any of the new fields will then see the odd version
+    ir.SetInsertPoint(write);
+    ir.CreateFence(AtomicOrdering::Release);
+    for (size_t i = 0; i < numArgs; i++) {
+        store(args[i], keyPtr(insert, i), AtomicOrdering::Monotonic);
+    }
+    store(call, slotPtr(insert, 1), AtomicOrdering::Monotonic);
+    store(ir.CreateAdd(locked, ir.getInt32(1)), slotPtr(insert, 0), AtomicOrdering::Release);
+    ir.CreateBr(done);
+
+    ir.SetInsertPoint(done);
+    ir.CreateRet(call);
+
+    return fn;
+}
+
+
+Function* createBoxedEntry(Module &module, Function *fn, const std::string &name) {
+    auto &context = module.getContext();
+    IRBuilder<> ir(context);
+
+    auto *entryTy = FunctionType::get(ir.getInt32Ty(), {ir.getPtrTy()}, false);
+    auto *entry = Function::Create(entryTy, GlobalValue::ExternalLinkage, name, module);
+    ir.SetInsertPoint(BasicBlock::Create(context, "entry", entry));
+
+    std::vector<Value*> args;
+    for (auto &param : fn->args()) {
+        auto *slot = ir.CreateConstInBoundsGEP1_64(ir.getInt64Ty(), entry->getArg(0), args.size());
+        auto *boxed = ir.CreateAlignedLoad(ir.getInt64Ty(), slot, Align(8), "boxed");
+        if (param.getType()->isPointerTy()) {
+            args.push_back(ir.CreateIntToPtr(boxed, param.getType()));
+        } else {
+            args.push_back(ir.CreateTrunc(boxed, param.getType()));
+        }
+    }
+
+    ir.CreateRet(ir.CreateCall(fn, args, "result"));
+    return entry;
+}
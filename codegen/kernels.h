@@ -0,0 +1,27 @@
+#pragma once
+
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
+
+// Hand strip-mined kernels for the reduction builtins. Each is an internal function
+//     i32 kernel(ptr data, i32 lo, i32 hi, i32 x)
+// over data[lo..hi) which runs a vector loop of llvm.vector.reduce.* friendly
+// accumulators followed by a scalar epilogue. x is only used by count.
+
+enum class Reduce { Sum, Min, Max, Count };
+
+llvm::Function* getReduceKernel(llvm::Module &module, Reduce op);
+
+
+// Creates 'name' as a memoising wrapper of body, a pure function of i32 arguments. The
+// wrapper looks the arguments up in a fixed size open-addressed table, probing a few
+// slots from the hashed home slot, and only calls body on a miss. Entries are guarded by
+// sequence locks so pfor bodies may share the table, a writer which loses a race skips
+// storing its result.
+llvm::Function* createMemoWrapper(llvm::Module &module, llvm::Function *body, const std::string &name);
+
+
+// Creates an external i32 name(ptr args) which calls fn with its arguments unboxed from an
+// array of i64, an i32 in the low half of its slot and an a[] argument as a data pointer
+// slot followed by a length slot. The interpreter calls compiled code through it.
+llvm::Function* createBoxedEntry(llvm::Module &module, llvm::Function *fn, const std::string &name);
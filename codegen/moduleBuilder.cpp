@@ -1,11 +1,11 @@
 #include <cmath>
 #include <iterator>
 
-#include <llvm/Passes/PassBuilder.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/IR/Verifier.h>
 #include "moduleBuilder.h"
-#include "PPProfiler.h"
+#include "optimiser.h"
+#include "kernels.h"
 
 using namespace llvm;
 
@@ -43,28 +43,8 @@ ModuleBuilder::ModuleBuilder(
 }
 
 
-void ModuleBuilder::optimiseModule() {
-    LoopAnalysisManager LAM;
-    FunctionAnalysisManager FAM;
-    CGSCCAnalysisManager CGAM;
-    ModuleAnalysisManager MAM;
-
-    PassBuilder PB;
-
-    PB.registerModuleAnalyses(MAM);
-    PB.registerCGSCCAnalyses(CGAM);
-    PB.registerFunctionAnalyses(FAM);
-    PB.registerLoopAnalyses(LAM);
-    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
-
-    RegisterCB(PB);
-
-    ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(OptimizationLevel::O2);
-
-    //llvm::cantFail(PB.parsePassPipeline(MPM, "ppprofiler"));
-
-
-    MPM.run(*llModule, MAM);
+void ModuleBuilder::optimiseModule(Optimiser &optimiser) {
+    optimiser.run(*llModule);
 }
 
 
@@ -257,6 +237,31 @@ Function* ModuleBuilder::getFunc(const std::string &name) {
     return funcDefs[name].fnPtr;
 }
 
+// Renames the function to an internal body and puts a memoising wrapper in its place,
+// calls already emitted to the function, including recursive ones, go through the wrapper.
+// The profiler shows the wrapper under the source name and the body as "name [memo]".
+Function* ModuleBuilder::memoiseFunc(const std::string &name) {
+    assert(funcDefs.find(name) != funcDefs.end());
+    auto *body = funcDefs[name].fnPtr;
+    assert(!body->isDeclaration());
+
+    body->setName(name + ".body");
+    body->setLinkage(GlobalValue::InternalLinkage);
+
+    auto *wrapper = createMemoWrapper(*llModule, body, name);
+    body->replaceUsesWithIf(wrapper, [wrapper](Use &use) {
+        auto *inst = dyn_cast<Instruction>(use.getUser());
+        return inst == nullptr || inst->getFunction() != wrapper;
+    });
+
+    wrapper->addFnAttr("ppprofiler-name", name);
+    body->addFnAttr("ppprofiler-name", name + " [memo]");
+
+    funcDefs[name].fnPtr = wrapper;
+    return wrapper;
+}
+
+
 Sparse<ModuleBuilder::VarLocal>::Key ModuleBuilder::createVarLocalDebug(const char *name) {
     auto *fn = funcDefs[funcDefCurrent].diFunc;
     assert(nullptr != fn);
@@ -11,6 +11,7 @@
 
 #include "ast.h"
 #include "sparse.h"
+#include "optimiser.h"
 
 class ModuleBuilder {
 public:
@@ -30,6 +31,7 @@ public:
     void                  setCurrentFunc(const std::string &);
     llvm::Argument*       getCurrentFuncArg(size_t argIndex);
     llvm::Function*       getFunc(const std::string &name);
+    llvm::Function*       memoiseFunc(const std::string &name);
 
     void                  createGlobalDeclaration(const char*, llvm::Type*);
     llvm::Value*          createCall(const char *, const std::vector<llvm::Value*> &args);
@@ -48,7 +50,7 @@ public:
 
 
     void              printModule();
-    void              optimiseModule();
+    void              optimiseModule(Optimiser &optimiser);
     void              verifyModule();
     void              finaliseDebug() {
         diBuilder.finalize();
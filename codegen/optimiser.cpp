@@ -0,0 +1,120 @@
+#include "optimiser.h"
+#include "PPProfiler.h"
+#include "PGOLowering.h"
+#include "BlockCounters.h"
+
+#include <cassert>
+#include <optional>
+
+#include <llvm/Analysis/ProfileSummaryInfo.h>
+#include <llvm/ProfileData/InstrProfReader.h>
+#include <llvm/Support/VirtualFileSystem.h>
+#include <llvm/Transforms/Instrumentation/PGOInstrumentation.h>
+
+using namespace llvm;
+
+static std::optional<OptimizationLevel> parseOptLevel(char optLevel) {
+    switch (optLevel) {
+    case '0': return OptimizationLevel::O0;
+    case '1': return OptimizationLevel::O1;
+    case '2': return OptimizationLevel::O2;
+    case '3': return OptimizationLevel::O3;
+    case 's': return OptimizationLevel::Os;
+    case 'z': return OptimizationLevel::Oz;
+    default: break;
+    }
+    return std::nullopt;
+}
+
+
+Optimiser::Optimiser(TargetMachine *targetMachine) : targetMachine(targetMachine) {
+    assert(nullptr != targetMachine);
+    timePasses.registerCallbacks(PIC);
+    timeProfiling.registerCallbacks(PIC);
+}
+
+
+Error Optimiser::buildPipeline(char optLevel, const std::string &pipeline, const PipelineExtras &extras) {
+    auto level = parseOptLevel(optLevel);
+    if (!level.has_value()) {
+        return createStringError(inconvertibleErrorCode(), "invalid optimization level: -O%c", optLevel);
+    }
+
+    // match clang: vectorizers run at -O2 and above and at -Os
+    PipelineTuningOptions tuning;
+    tuning.LoopVectorization = level->getSpeedupLevel() > 1;
+    tuning.SLPVectorization  = level->getSpeedupLevel() > 1;
+
+    PB = std::make_unique<PassBuilder>(targetMachine, tuning, std::nullopt, &PIC);
+    PB->registerModuleAnalyses(MAM);
+    PB->registerCGSCCAnalyses(CGAM);
+    PB->registerFunctionAnalyses(FAM);
+    PB->registerLoopAnalyses(LAM);
+    PB->crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    RegisterCB(*PB);
+
+    MPM = ModulePassManager();
+
+    // the counters are placed and read on the unoptimised IR, so both see the same CFG hashes
+    if (extras.pgoGenerate) {
+        MPM.addPass(PGOInstrumentationGen());
+        addPGOLoweringPass(MPM);
+    }
+    if (extras.blockCounts) {
+        addBlockCountersPass(MPM);
+    }
+    if (!extras.pgoUse.empty()) {
+        // PGOInstrumentationUse reports an unreadable profile as a fatal diagnostic
+        auto reader = IndexedInstrProfReader::create(extras.pgoUse, *vfs::getRealFileSystem());
+        if (!reader) {
+            return reader.takeError();
+        }
+        MPM.addPass(PGOInstrumentationUse(extras.pgoUse));
+        MPM.addPass(RequireAnalysisPass<ProfileSummaryAnalysis, Module>());
+    }
+
+    if (!pipeline.empty()) {
+        if (auto err = PB->parsePassPipeline(MPM, pipeline)) {
+            return err;
+        }
+    } else if (*level == OptimizationLevel::O0) {
+        MPM.addPass(PB->buildO0DefaultPipeline(*level));
+    } else {
+        MPM.addPass(PB->buildPerModuleDefaultPipeline(*level));
+    }
+
+    if (!extras.pgoUse.empty() && *level != OptimizationLevel::O0) {
+        if (auto err = PB->parsePassPipeline(MPM, "hotcoldsplit")) {
+            return err;
+        }
+    }
+    if (extras.profile) {
+        addPPProfilerPass(MPM);
+    }
+    return Error::success();
+}
+
+
+void Optimiser::run(Module &module) {
+    assert(nullptr != PB);
+
+    // the cost model and vectorizers need to know what they're targeting
+    module.setTargetTriple(targetMachine->getTargetTriple().str());
+    module.setDataLayout(targetMachine->createDataLayout());
+
+    if (stats != nullptr) {
+        stats->recordModule(module, CompileStats::BeforeOpt);
+    }
+    MPM.run(module, MAM);
+    if (stats != nullptr) {
+        stats->recordModule(module, CompileStats::AfterOpt);
+    }
+
+    // cached results are keyed on IR pointers which are about to be freed, so
+    // drop them before the next module can reuse the addresses.
+    LAM.clear();
+    FAM.clear();
+    CGAM.clear();
+    MAM.clear();
+}
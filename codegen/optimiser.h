@@ -0,0 +1,63 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include <llvm/IR/Module.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Passes/StandardInstrumentations.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include "compileStats.h"
+
+// Instrumentation and profile feedback added around the optimisation pipeline.
+struct PipelineExtras {
+    // the ppprofiler pass after the pipeline, so only calls which survive inlining are
+    // instrumented
+    bool        profile = false;
+
+    // PGO block counters before the pipeline, read by PGOProfile
+    bool        pgoGenerate = false;
+
+    // a counter for each block with a source line before the pipeline, read by LineCounts
+    bool        blockCounts = false;
+
+    // an indexed profile written by PGOProfile, it annotates the IR with branch weights and
+    // entry counts before the pipeline and hot/cold splitting runs after it
+    std::string pgoUse;
+};
+
+// Owns the pass builder, analysis managers and pass pipeline. Built once per session and
+// reused for every module so that per-module optimisation doesn't pay for pipeline construction.
+class Optimiser {
+public:
+    // the target machine supplies the cost model and data layout, it must outlive the optimiser.
+    // A time trace has to be started before the optimiser to include its passes.
+    Optimiser(llvm::TargetMachine *targetMachine);
+
+    // optLevel is one of '0', '1', '2', '3', 's', 'z'. A non-empty pipeline string
+    // replaces the default pipeline for the given level.
+    llvm::Error buildPipeline(char optLevel, const std::string &pipeline = "", const PipelineExtras &extras = {});
+    void        run(llvm::Module &module);
+
+    // records the IR of every module before and after it is optimised, null stops recording
+    void        setStats(CompileStats *stats) { this->stats = stats; }
+
+private:
+    llvm::TargetMachine           *targetMachine;
+    CompileStats                  *stats = nullptr;
+
+    // LLVM's -time-passes report and the passes in a -time-trace
+    llvm::PassInstrumentationCallbacks   PIC;
+    llvm::TimePassesHandler              timePasses;
+    llvm::TimeProfilingPassesHandler     timeProfiling;
+
+    llvm::LoopAnalysisManager     LAM;
+    llvm::FunctionAnalysisManager FAM;
+    llvm::CGSCCAnalysisManager    CGAM;
+    llvm::ModuleAnalysisManager   MAM;
+    std::unique_ptr<llvm::PassBuilder> PB;
+    llvm::ModulePassManager       MPM;
+};
@@ -36,6 +36,16 @@ bool SymbolTable::isDefined(const std::string &symbol) {
     return false;
 }
 
+size_t SymbolTable::scopeOf(const std::string &symbol) {
+    for (size_t i = table.size(); i-- > 0;) {
+        if (table[i].find(symbol) != table[i].end()) {
+            return i;
+        }
+    }
+    assert(false);
+    return 0;
+}
+
 void SymbolTable::pushScope() {
     table.emplace_back();
 }
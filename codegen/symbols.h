@@ -16,6 +16,8 @@ public:
     ID insert(const std::string &symbol);
     ID look(const std::string &symbol);
     bool isDefined(const std::string &symbol);
+    size_t scopeOf(const std::string &symbol); // index of the innermost scope defining it
+    size_t depth() { return table.size(); }
     void pushScope();
     void popScope();
 
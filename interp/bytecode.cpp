@@ -0,0 +1,706 @@
+#include "bytecode.h"
+#include "interpreter.h"
+
+#include <algorithm>
+#include <map>
+#include <optional>
+
+using namespace llvm;
+
+namespace interp {
+
+namespace {
+
+// Compiles one function. Variables and temporaries are allocated from the bottom of the
+// frame like a stack, a scope gives its registers back when it ends. The first construct
+// which can't be compiled is remembered and compilation carries on with register 0, the
+// result is only used if there was none.
+class Compiler {
+public:
+    Compiler(Sparse<ast::Node> &ast, Interpreter &interpreter, const EmitOptions &options, const std::string &name)
+        : ast(ast)
+        , interpreter(interpreter)
+        , options(options)
+        , fn(std::make_shared<Function>())
+    {
+        fn->name = name;
+    }
+
+    void function(const ast::FnDef &fnDef);
+    void cell(const std::vector<Sparse<ast::Node>::Key> &exprs);
+    Expected<std::shared_ptr<const Function>> finish();
+
+private:
+    struct Var {
+        bool     isArray;
+        uint16_t reg;
+    };
+
+    struct Scope {
+        std::map<std::string, Var> vars;
+        std::vector<uint16_t>      arrays; // allocated in the scope, freed when it ends
+        size_t                     top, arrayTop;
+    };
+
+    Sparse<ast::Node>         &ast;
+    Interpreter               &interpreter;
+    EmitOptions               options;
+    std::shared_ptr<Function> fn;
+    std::optional<std::string> unsupported;
+
+    std::vector<Scope> scopes;
+    size_t             top = 0, arrayTop = 0;
+    bool               tailRec = false; // self tail calls jump back to the start, like Emit
+
+    void     fail(TextPos pos, const std::string &what);
+    uint16_t alloc();
+    uint16_t allocArray();
+    size_t   emit(Op op, size_t a = 0, size_t b = 0, size_t c = 0);
+    void     emitConstant(uint16_t reg, int32_t value);
+    void     emitMove(uint16_t dest, uint16_t src, size_t mark);
+    void     patch(size_t jump);
+    void     pushScope();
+    void     popScope();
+    void     freeArrays();
+
+    const Var* look(const std::string &name);
+    void       define(TextPos pos, const std::string &name, Var var);
+    const Var* lookArray(TextPos pos, const std::string &name);
+    const Var* lookArrayArg(TextPos pos, Sparse<ast::Node>::Key key);
+
+    void     stmts(Sparse<ast::Node>::Key list);
+    void     stmt(Sparse<ast::Node>::Key key);
+    void     forIn(const ast::ForIn &forIn);
+    void     tailCall(const ast::Call &call);
+    uint16_t expr(Sparse<ast::Node>::Key key);
+    bool     isBuiltin(const std::string &name);
+    uint16_t call(const ast::Call &call);
+    uint16_t callFunction(const ast::Call &call);
+    uint16_t reduce(const ast::Call &call, Op op);
+};
+
+
+void Compiler::fail(TextPos pos, const std::string &what) {
+    if (!unsupported) {
+        unsupported = std::to_string(pos.line) + ":" + std::to_string(pos.column) + ": " + what;
+    }
+}
+
+
+uint16_t Compiler::alloc() {
+    if (top >= UINT16_MAX) {
+        fail(TextPos(0, 0, 0), "too many registers");
+        return 0;
+    }
+    fn->numRegs = std::max<size_t>(fn->numRegs, top + 1);
+    return top++;
+}
+
+
+uint16_t Compiler::allocArray() {
+    if (arrayTop >= UINT16_MAX) {
+        fail(TextPos(0, 0, 0), "too many arrays");
+        return 0;
+    }
+    fn->numArrays = std::max<size_t>(fn->numArrays, arrayTop + 1);
+    return arrayTop++;
+}
+
+
+size_t Compiler::emit(Op op, size_t a, size_t b, size_t c) {
+    fn->code.push_back(Instr{op, uint16_t(a), uint16_t(b), uint16_t(c)});
+    return fn->code.size() - 1;
+}
+
+
+void Compiler::emitConstant(uint16_t reg, int32_t value) {
+    emit(LoadK, reg, uint32_t(value) & 0xffff, uint32_t(value) >> 16);
+}
+
+
+// copies src into dest. A temporary above mark was written by the last instruction, which
+// writes dest instead.
+void Compiler::emitMove(uint16_t dest, uint16_t src, size_t mark) {
+    if (dest == src) {
+        return;
+    }
+
+    if (src >= mark && !fn->code.empty()) {
+        auto &last = fn->code.back();
+        switch (last.op) {
+        case LoadK: case Move: case Neg: case Add: case Sub: case Mul: case Div: case Lt: case Gt:
+        case Eq: case AddK: case Call: case Len: case Load: case Sum: case Min: case Max: case Count:
+            if (last.a == src) {
+                last.a = dest;
+                return;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    emit(Move, dest, src);
+}
+
+
+// points a forward jump at the next instruction
+void Compiler::patch(size_t jump) {
+    fn->code[jump].c = uint16_t(fn->code.size());
+}
+
+
+void Compiler::pushScope() {
+    scopes.push_back(Scope{{}, {}, top, arrayTop});
+}
+
+
+void Compiler::popScope() {
+    assert(!scopes.empty());
+    for (auto reg : scopes.back().arrays) {
+        emit(FreeArray, reg);
+    }
+    top      = scopes.back().top;
+    arrayTop = scopes.back().arrayTop;
+    scopes.pop_back();
+}
+
+
+// frees the arrays of every scope, before a return or a self tail call
+void Compiler::freeArrays() {
+    for (auto &scope : scopes) {
+        for (auto reg : scope.arrays) {
+            emit(FreeArray, reg);
+        }
+    }
+}
+
+
+const Compiler::Var* Compiler::look(const std::string &name) {
+    for (auto it = scopes.rbegin(); it != scopes.rend(); it++) {
+        if (auto var = it->vars.find(name); var != it->vars.end()) {
+            return &var->second;
+        }
+    }
+    return nullptr;
+}
+
+
+// Emit's symbol table doesn't allow shadowing, functions included
+void Compiler::define(TextPos pos, const std::string &name, Var var) {
+    if (look(name) != nullptr || interpreter.find(name) != nullptr) {
+        fail(pos, name + " is already defined");
+        return;
+    }
+    scopes.back().vars[name] = var;
+}
+
+
+const Compiler::Var* Compiler::lookArray(TextPos pos, const std::string &name) {
+    auto *var = look(name);
+    if (var == nullptr || !var->isArray) {
+        fail(pos, name + " isn't an array");
+        return nullptr;
+    }
+    return var;
+}
+
+
+// the array an argument of a builtin or a call names
+const Compiler::Var* Compiler::lookArrayArg(TextPos pos, Sparse<ast::Node>::Key key) {
+    auto *ident = std::get_if<ast::Ident>(&ast.at(key));
+    if (ident == nullptr) {
+        fail(pos, "expected an array");
+        return nullptr;
+    }
+    return lookArray(pos, ident->ident);
+}
+
+
+void Compiler::function(const ast::FnDef &fnDef) {
+    auto &argsList = std::get<ast::List>(ast.at(fnDef.args));
+    if (fnDef.memo || (options.memoiseAll && argsList.size() > 0)) {
+        fail(fnDef.pos, "memoised functions are compiled");
+    }
+
+    fn->numArgs = argsList.size();
+    top = arrayTop = fn->numArgs;
+    fn->numRegs = fn->numArrays = fn->numArgs;
+    pushScope();
+
+    bool hasArrayArgs = false;
+    for (size_t i = 0; i < argsList.size(); i++) {
+        auto &arg = ast.at(argsList.list[i]);
+        if (auto *arrayArg = std::get_if<ast::ArrayArg>(&arg); arrayArg != nullptr) {
+            define(arrayArg->pos, arrayArg->ident, Var{true, uint16_t(i)});
+            hasArrayArgs = true;
+        } else {
+            auto &ident = std::get<ast::Ident>(arg);
+            define(ident.pos, ident.ident, Var{false, uint16_t(i)});
+        }
+        fn->arrayArgs.push_back(std::holds_alternative<ast::ArrayArg>(arg));
+    }
+
+    tailRec = !hasArrayArgs
+        && ast::hasSelfTailCall(ast, fnDef.body, fnDef.name)
+        && (options.trapDivZero || !ast::hasDivide(ast, fnDef.body));
+
+    stmts(fnDef.body);
+    popScope();
+
+    auto zero = alloc();
+    emitConstant(zero, 0);
+    emit(Return, zero);
+}
+
+
+void Compiler::cell(const std::vector<Sparse<ast::Node>::Key> &exprs) {
+    for (auto key : exprs) {
+        auto mark = top;
+        emit(Output, expr(key));
+        top = mark;
+    }
+
+    auto zero = alloc();
+    emitConstant(zero, 0);
+    emit(Return, zero);
+}
+
+
+Expected<std::shared_ptr<const Function>> Compiler::finish() {
+    if (fn->code.size() > UINT16_MAX) {
+        fail(TextPos(0, 0, 0), "too many instructions");
+    }
+    if (unsupported) {
+        return createStringError(inconvertibleErrorCode(), "%s", unsupported->c_str());
+    }
+    return std::shared_ptr<const Function>(std::move(fn));
+}
+
+
+void Compiler::stmts(Sparse<ast::Node>::Key list) {
+    for (auto key : std::get<ast::List>(ast.at(list)).list) {
+        stmt(key);
+    }
+}
+
+
+void Compiler::stmt(Sparse<ast::Node>::Key key) {
+    auto &node = ast.at(key);
+    auto mark = top;
+
+    if (auto *fnDef = std::get_if<ast::FnDef>(&node); fnDef != nullptr) {
+        fail(fnDef->pos, "nested functions are compiled");
+
+    } else if (auto *return_ = std::get_if<ast::Return>(&node); return_ != nullptr) {
+        auto *call = std::get_if<ast::Call>(&ast.at(return_->expr));
+        if (call != nullptr && tailRec && call->name == fn->name) {
+            tailCall(*call);
+        } else {
+            auto value = expr(return_->expr);
+            freeArrays();
+            emit(Return, value);
+        }
+
+    } else if (auto *let = std::get_if<ast::Let>(&node); let != nullptr) {
+        // the new variable keeps its register until the scope ends
+        auto *call = std::get_if<ast::Call>(&ast.at(let->expr));
+        if (call != nullptr && call->name == "array" && isBuiltin(call->name)) {
+            auto &args = std::get<ast::List>(ast.at(call->args)).list;
+            if (args.size() != 1) {
+                fail(call->pos, "array takes one argument");
+                return;
+            }
+            auto len = expr(args[0]);
+            top = mark;
+            auto reg = allocArray();
+            emit(NewArray, reg, len);
+            define(let->pos, let->name, Var{true, reg});
+            scopes.back().arrays.push_back(reg);
+            return;
+        }
+
+        auto value = expr(let->expr);
+        top = mark;
+        auto reg = alloc();
+        emitMove(reg, value, mark);
+        define(let->pos, let->name, Var{false, reg});
+        return;
+
+    } else if (auto *set = std::get_if<ast::Set>(&node); set != nullptr) {
+        auto value = expr(set->expr);
+        auto *var = look(set->name);
+        if (var == nullptr || var->isArray) {
+            fail(set->pos, set->name + " isn't a variable");
+        } else {
+            emitMove(var->reg, value, mark);
+        }
+
+    } else if (auto *setIndex = std::get_if<ast::SetIndex>(&node); setIndex != nullptr) {
+        auto *array = lookArray(setIndex->pos, setIndex->name);
+        auto index = expr(setIndex->index);
+        auto value = expr(setIndex->expr);
+        if (array != nullptr) {
+            emit(Store, array->reg, index, value);
+        }
+
+    } else if (auto *if_ = std::get_if<ast::If>(&node); if_ != nullptr) {
+        auto cnd = expr(if_->cnd);
+        top = mark;
+        auto toFalse = emit(JumpIfZero, cnd);
+
+        pushScope();
+        stmts(if_->trueBody);
+        popScope();
+        auto toEnd = emit(Jump);
+
+        patch(toFalse);
+        pushScope();
+        stmts(if_->falseBody);
+        popScope();
+        patch(toEnd);
+
+    } else if (auto *for_ = std::get_if<ast::For>(&node); for_ != nullptr) {
+        // the bound is evaluated again before each iteration
+        auto idx = alloc();
+        emitConstant(idx, 0);
+
+        size_t head = fn->code.size();
+        auto bodyMark = top;
+        auto bound = expr(for_->cnd);
+        top = bodyMark;
+        auto toEnd = emit(JumpIfGe, idx, bound);
+
+        pushScope();
+        stmts(for_->body);
+        popScope();
+        emit(AddK, idx, idx, 1);
+        emit(Loop, 0, 0, head);
+        patch(toEnd);
+
+    } else if (auto *forIn_ = std::get_if<ast::ForIn>(&node); forIn_ != nullptr) {
+        forIn(*forIn_);
+
+    } else {
+        fail(TextPos(0, 0, 0), "expected a statement");
+    }
+
+    top = mark;
+}
+
+
+// Like Emit, i is a copy of a hidden index so assignments to it don't change the iteration
+// and the bounds are evaluated once. Steps other than 1 and -1 count iterations up to a trip
+// count worked out before the loop.
+void Compiler::forIn(const ast::ForIn &forIn) {
+    if (forIn.parallel) {
+        fail(forIn.pos, "pfor is compiled");
+        return;
+    }
+
+    auto idx = alloc();
+    auto hi  = alloc();
+    int step = 1;
+    if (auto *range = std::get_if<ast::Range>(&ast.at(forIn.iter)); range != nullptr) {
+        if (range->step == 0) {
+            fail(range->pos, "step can't be 0");
+            return;
+        }
+        auto lo = expr(range->lo);
+        emitMove(idx, lo, hi + 1);
+        top = hi + 1;
+        auto end = expr(range->hi);
+        emitMove(hi, end, hi + 1);
+        top = hi + 1;
+        step = range->step;
+    } else {
+        auto *array = lookArrayArg(forIn.pos, forIn.iter);
+        emitConstant(idx, 0);
+        emit(Len, hi, array ? array->reg : 0);
+    }
+
+    // counts the iterations so far up to the trip count
+    uint16_t trip = 0, count = 0;
+    if (step != 1 && step != -1) {
+        trip = alloc();
+        emitConstant(trip, step);
+        emit(TripCount, trip, idx, hi);
+        count = alloc();
+        emitConstant(count, 0);
+    }
+
+    // a step which doesn't fit AddK is added from a register
+    std::optional<uint16_t> stepReg;
+    if (step < INT16_MIN || step > INT16_MAX) {
+        stepReg = alloc();
+        emitConstant(*stepReg, step);
+    }
+
+    size_t head = fn->code.size();
+    size_t toEnd;
+    if (step == 1) {
+        toEnd = emit(JumpIfGe, idx, hi);
+    } else if (step == -1) {
+        toEnd = emit(JumpIfLe, idx, hi);
+    } else {
+        toEnd = emit(JumpIfGeU, count, trip);
+    }
+
+    pushScope();
+    auto var = alloc();
+    emit(Move, var, idx);
+    define(forIn.pos, forIn.name, Var{false, var});
+    stmts(forIn.body);
+    popScope();
+
+    if (stepReg) {
+        emit(Add, idx, idx, *stepReg);
+    } else {
+        emit(AddK, idx, idx, uint16_t(int16_t(step)));
+    }
+    if (step != 1 && step != -1) {
+        emit(AddK, count, count, 1);
+    }
+    emit(Loop, 0, 0, head);
+    patch(toEnd);
+}
+
+
+// return f(args) inside f. The arguments are evaluated then assigned together and the body
+// starts again, which counts as an iteration towards tiering up.
+void Compiler::tailCall(const ast::Call &call) {
+    auto &args = std::get<ast::List>(ast.at(call.args)).list;
+    if (args.size() != fn->numArgs) {
+        fail(call.pos, call.name + " takes " + std::to_string(fn->numArgs) + " arguments");
+        return;
+    }
+
+    std::vector<uint16_t> values;
+    for (auto key : args) {
+        auto mark = top;
+        auto value = alloc();
+        emitMove(value, expr(key), mark + 1);
+        top = mark + 1;
+        values.push_back(value);
+    }
+    for (size_t i = 0; i < values.size(); i++) {
+        emit(Move, i, values[i]);
+    }
+    freeArrays();
+    emit(Loop, 0, 0, 0);
+}
+
+
+uint16_t Compiler::expr(Sparse<ast::Node>::Key key) {
+    auto &node = ast.at(key);
+    auto mark = top;
+
+    if (auto *integer = std::get_if<ast::Integer>(&node); integer != nullptr) {
+        auto dest = alloc();
+        emitConstant(dest, integer->integer);
+        return dest;
+    }
+
+    if (auto *prefix = std::get_if<ast::Prefix>(&node); prefix != nullptr) {
+        auto right = expr(prefix->right);
+        if (prefix->op != ast::Minus) {
+            fail(prefix->pos, "expected -");
+        }
+        top = mark;
+        auto dest = alloc();
+        emit(Neg, dest, right);
+        return dest;
+    }
+
+    if (auto *infix = std::get_if<ast::Infix>(&node); infix != nullptr) {
+        auto left  = expr(infix->left);
+        auto right = expr(infix->right);
+        top = mark;
+        auto dest = alloc();
+
+        switch (infix->op) {
+        case ast::Plus:   emit(Add, dest, left, right); break;
+        case ast::Minus:  emit(Sub, dest, left, right); break;
+        case ast::Times:  emit(Mul, dest, left, right); break;
+        case ast::Divide: emit(Div, dest, left, right); break;
+        case ast::LT:     emit(Lt, dest, left, right); break;
+        case ast::GT:     emit(Gt, dest, left, right); break;
+        case ast::EqEq:   emit(Eq, dest, left, right); break;
+        }
+        return dest;
+    }
+
+    if (auto *call_ = std::get_if<ast::Call>(&node); call_ != nullptr) {
+        return call(*call_);
+    }
+
+    // variables are read in place
+    if (auto *ident = std::get_if<ast::Ident>(&node); ident != nullptr) {
+        auto *var = look(ident->ident);
+        if (var == nullptr || var->isArray) {
+            fail(ident->pos, ident->ident + " isn't a variable");
+            return 0;
+        }
+        return var->reg;
+    }
+
+    if (auto *index = std::get_if<ast::Index>(&node); index != nullptr) {
+        auto *array = lookArray(index->pos, index->name);
+        auto idx = expr(index->index);
+        top = mark;
+        auto dest = alloc();
+        emit(Load, dest, array ? array->reg : 0, idx);
+        return dest;
+    }
+
+    fail(TextPos(0, 0, 0), "expected an expression");
+    return 0;
+}
+
+
+bool Compiler::isBuiltin(const std::string &name) {
+    return ast::isBuiltinName(name) && interpreter.find(name) == nullptr;
+}
+
+
+uint16_t Compiler::call(const ast::Call &call) {
+    auto &args = std::get<ast::List>(ast.at(call.args)).list;
+
+    // builtins, unless a function of the same name has been defined
+    if (!isBuiltin(call.name)) {
+        return callFunction(call);
+    }
+    if (call.name == "len") {
+        auto *array = (args.size() == 1) ? lookArrayArg(call.pos, args[0]) : nullptr;
+        if (args.size() != 1) {
+            fail(call.pos, "len takes one argument");
+        }
+        auto dest = alloc();
+        emit(Len, dest, array ? array->reg : 0);
+        return dest;
+    }
+    if (call.name == "sum") {
+        return reduce(call, Sum);
+    }
+    if (call.name == "min") {
+        return reduce(call, Min);
+    }
+    if (call.name == "max") {
+        return reduce(call, Max);
+    }
+    if (call.name == "count") {
+        return reduce(call, Count);
+    }
+    fail(call.pos, "array() must be bound with let");
+    return 0;
+}
+
+
+// The arguments are evaluated into consecutive registers, an array argument holds the
+// number of the caller's array register.
+uint16_t Compiler::callFunction(const ast::Call &call) {
+    auto &args = std::get<ast::List>(ast.at(call.args)).list;
+    auto mark = top;
+
+    auto *slot = interpreter.find(call.name);
+    if (slot == nullptr) {
+        fail(call.pos, call.name + " isn't defined");
+        return 0;
+    }
+    if (args.size() != slot->numArgs) {
+        fail(call.pos, call.name + " takes " + std::to_string(slot->numArgs) + " arguments");
+        return 0;
+    }
+    auto slotNumber = interpreter.slotOf(call.name);
+    if (slotNumber > UINT16_MAX) {
+        fail(call.pos, "too many functions");
+    }
+
+    for (size_t i = 0; i < args.size(); i++) {
+        auto argMark = top;
+        auto arg = alloc();
+        if (!slot->arrayArgs.empty() && slot->arrayArgs[i]) {
+            auto *array = lookArrayArg(call.pos, args[i]);
+            emitConstant(arg, array ? array->reg : 0);
+        } else {
+            emitMove(arg, expr(args[i]), argMark + 1);
+        }
+        top = argMark + 1;
+    }
+
+    // the arguments are copied into the callee's frame before the result is written
+    top = mark;
+    auto dest = alloc();
+    emit(Call, dest, slotNumber, mark);
+    return dest;
+}
+
+
+// sum(a), min(a), max(a) and count(a, x) over the whole array, or a[lo..hi) with two more
+// arguments. The operands are in three consecutive registers lo, hi and x.
+uint16_t Compiler::reduce(const ast::Call &call, Op op) {
+    auto &args = std::get<ast::List>(ast.at(call.args)).list;
+    size_t numArgs = (op == Count) ? 2 : 1;
+    if (args.size() != numArgs && args.size() != numArgs + 2) {
+        fail(call.pos, call.name + " takes " + std::to_string(numArgs) + " or "
+            + std::to_string(numArgs + 2) + " arguments");
+        return 0;
+    }
+
+    auto *array = lookArrayArg(call.pos, args[0]);
+    auto arrayReg = array ? array->reg : 0;
+
+    auto mark = top;
+    auto lo = alloc();
+    auto hi = alloc();
+    auto x  = alloc();
+
+    // evaluated in the order Emit evaluates them
+    if (op == Count) {
+        emitMove(x, expr(args[1]), x + 1);
+        top = x + 1;
+    } else {
+        emitConstant(x, 0);
+    }
+    if (args.size() == numArgs + 2) {
+        emitMove(lo, expr(args[numArgs]), x + 1);
+        top = x + 1;
+        emitMove(hi, expr(args[numArgs + 1]), x + 1);
+        top = x + 1;
+    } else {
+        emitConstant(lo, 0);
+        emit(Len, hi, arrayReg);
+    }
+
+    top = mark;
+    auto dest = alloc();
+    emit(op, dest, arrayReg, lo);
+    return dest;
+}
+
+}
+
+
+Expected<std::shared_ptr<const Function>> compileFunction(
+    Sparse<ast::Node> &ast,
+    const ast::FnDef  &fnDef,
+    Interpreter       &interpreter,
+    const EmitOptions &options
+) {
+    Compiler compiler(ast, interpreter, options, fnDef.name);
+    compiler.function(fnDef);
+    return compiler.finish();
+}
+
+
+Expected<std::shared_ptr<const Function>> compileCell(
+    Sparse<ast::Node>                         &ast,
+    const std::vector<Sparse<ast::Node>::Key> &exprs,
+    Interpreter                               &interpreter,
+    const EmitOptions                         &options
+) {
+    Compiler compiler(ast, interpreter, options, "");
+    compiler.cell(exprs);
+    return compiler.finish();
+}
+
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <llvm/Support/Error.h>
+
+#include "ast.h"
+#include "emit.h"
+#include "sparse.h"
+
+// Register bytecode for the interpreter tier, compiled straight from the syntax tree. A
+// function's frame has i32 registers and array registers, which hold the data and length of
+// an array. Argument i is in register i, or in array register i for an a[] argument.
+
+namespace interp {
+
+class Interpreter;
+
+// Each instruction has a destination a and operands b and c. Jump targets are instruction
+// indices in c, constants are b | c << 16.
+#define INTERP_OPS(X)                                                                  \
+    X(LoadK)      /* r[a] = constant                                                */ \
+    X(Move)       /* r[a] = r[b]                                                    */ \
+    X(Neg)        /* r[a] = -r[b]                                                   */ \
+    X(Add)        /* r[a] = r[b] + r[c], wrapping                                   */ \
+    X(Sub)                                                                             \
+    X(Mul)                                                                             \
+    X(Div)        /* r[a] = r[b] / r[c], throws or traps when r[c] is 0              */ \
+    X(Lt)         /* r[a] = r[b] < r[c]                                             */ \
+    X(Gt)                                                                              \
+    X(Eq)                                                                              \
+    X(AddK)       /* r[a] = r[b] + c as int16                                       */ \
+    X(Jump)       /* goto c                                                         */ \
+    X(Loop)       /* goto c backwards, counts an iteration towards tiering up        */ \
+    X(JumpIfZero) /* if r[a] == 0 goto c                                            */ \
+    X(JumpIfGe)   /* if r[a] >= r[b] goto c                                         */ \
+    X(JumpIfLe)   /* if r[a] <= r[b] goto c                                         */ \
+    X(JumpIfGeU)  /* if r[a] >= r[b] unsigned goto c                                */ \
+    X(TripCount)  /* r[a] = iterations of r[b]..r[c] step r[a]                      */ \
+    X(Call)       /* r[a] = function in slot b of the arguments from r[c] on        */ \
+    X(Return)     /* return r[a]                                                    */ \
+    X(Output)     /* prints r[a] as a result                                        */ \
+    X(NewArray)   /* array a = array(r[b])                                          */ \
+    X(FreeArray)  /* frees array a                                                  */ \
+    X(Len)        /* r[a] = len(array b)                                            */ \
+    X(Load)       /* r[a] = array b[r[c]]                                           */ \
+    X(Store)      /* array a[r[b]] = r[c]                                           */ \
+    X(Sum)        /* r[a] = sum(array b, r[c], r[c + 1])                            */ \
+    X(Min)                                                                             \
+    X(Max)                                                                             \
+    X(Count)      /* r[a] = count(array b, r[c + 2], r[c], r[c + 1])                */
+
+enum Op : uint8_t {
+#define INTERP_OP(name) name,
+    INTERP_OPS(INTERP_OP)
+#undef INTERP_OP
+    NumOps
+};
+
+struct Instr {
+    Op       op;
+    uint16_t a, b, c;
+
+    int32_t constant() const { return int32_t(uint32_t(b) | uint32_t(c) << 16); }
+};
+
+struct Function {
+    std::string        name;
+    size_t             numArgs = 0;
+    std::vector<bool>  arrayArgs;
+    uint16_t           numRegs   = 0;
+    uint16_t           numArrays = 0;
+    std::vector<Instr> code;
+};
+
+// Compiles a function whose callees are defined in the interpreter. Constructs the interpreter
+// doesn't run, pfor, memoised and nested functions, and anything Emit would reject are errors,
+// the function is then compiled with LLVM instead.
+llvm::Expected<std::shared_ptr<const Function>> compileFunction(
+    Sparse<ast::Node>   &ast,
+    const ast::FnDef    &fnDef,
+    Interpreter         &interpreter,
+    const EmitOptions   &options);
+
+// Compiles the top-level expressions of a REPL cell into a function which outputs each result.
+llvm::Expected<std::shared_ptr<const Function>> compileCell(
+    Sparse<ast::Node>                         &ast,
+    const std::vector<Sparse<ast::Node>::Key> &exprs,
+    Interpreter                               &interpreter,
+    const EmitOptions                         &options);
+
+}
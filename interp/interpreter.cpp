@@ -0,0 +1,398 @@
+#include "interpreter.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+#include "output.h"
+
+namespace interp {
+
+Interpreter::Interpreter(bool trapDivZero, size_t hotCalls, std::function<void(const std::string &)> hot)
+    : trapDivZero(trapDivZero)
+    , hotCalls(hotCalls)
+    , hot(std::move(hot))
+{}
+
+
+// frees the arrays of a cell abandoned by a trap
+Interpreter::~Interpreter() {
+    unwindTo(0);
+}
+
+
+size_t Interpreter::slotOf(const std::string &name) {
+    auto [it, inserted] = slotNumbers.emplace(name, slots.size());
+    if (inserted) {
+        slots.push_back(Slot{name});
+    }
+    return it->second;
+}
+
+
+const Interpreter::Slot* Interpreter::find(const std::string &name) const {
+    auto it = slotNumbers.find(name);
+    if (it == slotNumbers.end() || !slots[it->second].defined) {
+        return nullptr;
+    }
+    return &slots[it->second];
+}
+
+
+void Interpreter::define(const std::string &name, size_t numArgs, const std::vector<bool> &arrayArgs) {
+    auto &slot = slots[slotOf(name)];
+    slot.defined   = true;
+    slot.numArgs   = numArgs;
+    slot.arrayArgs = arrayArgs;
+    slot.code      = nullptr;
+    slot.native    = nullptr;
+    slot.heat      = 0;
+}
+
+
+void Interpreter::setCode(const std::string &name, std::shared_ptr<const Function> code) {
+    auto &slot = slots[slotOf(name)];
+    assert(slot.defined);
+    slot.code = std::move(code);
+}
+
+
+void Interpreter::setNative(const std::string &name, size_t numArgs, const std::vector<bool> &arrayArgs, NativeEntry native) {
+    auto &slot = slots[slotOf(name)];
+    if (!slot.defined) {
+        define(name, numArgs, arrayArgs);
+    }
+    slot.native = native;
+}
+
+
+void Interpreter::remove(const std::string &name) {
+    auto it = slotNumbers.find(name);
+    if (it == slotNumbers.end()) {
+        return;
+    }
+    auto &slot = slots[it->second];
+    slot.defined = false;
+    slot.code    = nullptr;
+    slot.native  = nullptr;
+    slot.heat    = 0;
+}
+
+
+void Interpreter::run(const Function &start) {
+    // a trap in compiled code jumps out of execute, leaving the frames of the last cell
+    unwindTo(0);
+    pushFrame(start, noSlot, 0);
+    execute();
+}
+
+
+void Interpreter::pushFrame(const Function &fn, size_t slot, uint16_t resultReg) {
+    size_t regBase = 0, arrayBase = 0;
+    if (!frames.empty()) {
+        regBase   = frames.back().regBase + frames.back().fn->numRegs;
+        arrayBase = frames.back().arrayBase + frames.back().numArrays;
+    }
+
+    if (regs.size() < regBase + fn.numRegs) {
+        regs.resize(regBase + fn.numRegs);
+    }
+    if (arrays.size() < arrayBase + fn.numArrays) {
+        arrays.resize(arrayBase + fn.numArrays);
+    }
+    std::fill(arrays.begin() + arrayBase, arrays.begin() + arrayBase + fn.numArrays, ArrayReg{});
+
+    frames.push_back(Frame{&fn, fn.code.data(), regBase, arrayBase, fn.numArrays, slot, resultReg});
+}
+
+
+// pops frames until depth are left, freeing the arrays they allocated
+void Interpreter::unwindTo(size_t depth) {
+    while (frames.size() > depth) {
+        auto &frame = frames.back();
+        for (size_t i = 0; i < frame.numArrays; i++) {
+            auto &array = arrays[frame.arrayBase + i];
+            if (array.owned) {
+                std::free(array.data);
+            }
+            array = ArrayReg{};
+        }
+        frames.pop_back();
+    }
+}
+
+
+// Like the landing pad of an invoke, the frame at catcher prints the exception and
+// returns 0. Returns false if it was the cell's start function.
+bool Interpreter::catchIn(size_t catcher, int32_t payload) {
+    jc_output(OutputException, payload);
+
+    auto resultReg = frames[catcher].resultReg;
+    unwindTo(catcher);
+    if (frames.empty()) {
+        return false;
+    }
+    regs[frames.back().regBase + resultReg] = 0;
+    return true;
+}
+
+
+// Returns false if the cell ends. A division in the start function itself has no caller
+// to catch it and is thrown, as compiled code would throw it.
+bool Interpreter::divideByZero() {
+    if (trapDivZero) {
+        unwindTo(0);
+        jc_output(OutputDivZero, 0);
+        return false;
+    }
+    if (frames.size() == 1) {
+        unwindTo(0);
+        throw int(123);
+    }
+    return catchIn(frames.size() - 2, 123);
+}
+
+
+// false with the payload if compiled code threw a division by zero. Traps aren't caught,
+// the host's handler abandons the cell.
+static bool callNative(Interpreter::NativeEntry native, const uint64_t *args, bool trapDivZero, int32_t &result) {
+    if (trapDivZero) {
+        result = native(args);
+        return true;
+    }
+
+    try {
+        result = native(args);
+        return true;
+    } catch (int payload) {
+        result = payload;
+        return false;
+    }
+}
+
+
+// the reduction kernels over data[lo..hi), see getReduceKernel
+static int32_t reduce(Op op, const int32_t *data, int32_t lo, int32_t hi, int32_t x) {
+    int32_t acc;
+    switch (op) {
+    case Min: acc = INT32_MAX; break;
+    case Max: acc = INT32_MIN; break;
+    default:  acc = 0; break;
+    }
+
+    for (int64_t i = lo; i < hi; i++) {
+        switch (op) {
+        case Sum:   acc = int32_t(uint32_t(acc) + uint32_t(data[i])); break;
+        case Min:   acc = std::min(acc, data[i]); break;
+        case Max:   acc = std::max(acc, data[i]); break;
+        case Count: acc += (data[i] == x); break;
+        default:    assert(false); break;
+        }
+    }
+    return acc;
+}
+
+
+// Each handler ends by jumping straight to the handler of the next instruction. The
+// pointers into the frame are loaded again whenever a call or return changes frame, as
+// pushing a frame may move the registers.
+void Interpreter::execute() {
+#define INTERP_LABEL(name) &&op##name,
+    static const void *const labels[NumOps] = {INTERP_OPS(INTERP_LABEL)};
+#undef INTERP_LABEL
+
+    Frame          *frame;
+    const Instr    *code, *ip;
+    int32_t        *r;
+    ArrayReg       *arr;
+    int32_t        result;
+
+#define LOAD_FRAME()                              \
+    frame = &frames.back();                       \
+    code  = frame->fn->code.data();               \
+    ip    = frame->ip;                            \
+    r     = regs.data() + frame->regBase;         \
+    arr   = arrays.data() + frame->arrayBase;
+#define DISPATCH() goto *labels[ip->op]
+#define NEXT()     ip++; DISPATCH()
+
+    LOAD_FRAME();
+    DISPATCH();
+
+opLoadK:
+    r[ip->a] = ip->constant();
+    NEXT();
+opMove:
+    r[ip->a] = r[ip->b];
+    NEXT();
+opNeg:
+    r[ip->a] = int32_t(0u - uint32_t(r[ip->b]));
+    NEXT();
+opAdd:
+    r[ip->a] = int32_t(uint32_t(r[ip->b]) + uint32_t(r[ip->c]));
+    NEXT();
+opSub:
+    r[ip->a] = int32_t(uint32_t(r[ip->b]) - uint32_t(r[ip->c]));
+    NEXT();
+opMul:
+    r[ip->a] = int32_t(uint32_t(r[ip->b]) * uint32_t(r[ip->c]));
+    NEXT();
+opDiv:
+    if (r[ip->c] == 0) {
+        if (!divideByZero()) {
+            return;
+        }
+        LOAD_FRAME();
+        DISPATCH();
+    }
+    // INT32_MIN / -1 wraps instead of faulting
+    r[ip->a] = (r[ip->c] == -1) ? int32_t(0u - uint32_t(r[ip->b])) : r[ip->b] / r[ip->c];
+    NEXT();
+opLt:
+    r[ip->a] = r[ip->b] < r[ip->c];
+    NEXT();
+opGt:
+    r[ip->a] = r[ip->b] > r[ip->c];
+    NEXT();
+opEq:
+    r[ip->a] = r[ip->b] == r[ip->c];
+    NEXT();
+opAddK:
+    r[ip->a] = int32_t(uint32_t(r[ip->b]) + uint32_t(int16_t(ip->c)));
+    NEXT();
+opJump:
+    ip = code + ip->c;
+    DISPATCH();
+opLoop:
+    if (frame->slot != noSlot) {
+        slots[frame->slot].heat++;
+    }
+    ip = code + ip->c;
+    DISPATCH();
+opJumpIfZero:
+    ip = (r[ip->a] == 0) ? code + ip->c : ip + 1;
+    DISPATCH();
+opJumpIfGe:
+    ip = (r[ip->a] >= r[ip->b]) ? code + ip->c : ip + 1;
+    DISPATCH();
+opJumpIfLe:
+    ip = (r[ip->a] <= r[ip->b]) ? code + ip->c : ip + 1;
+    DISPATCH();
+opJumpIfGeU:
+    ip = (uint32_t(r[ip->a]) >= uint32_t(r[ip->b])) ? code + ip->c : ip + 1;
+    DISPATCH();
+opTripCount: {
+    // the span of a non-empty range fits an unsigned i32
+    int32_t step = r[ip->a], lo = r[ip->b], hi = r[ip->c];
+    uint32_t stepSize = (step > 0) ? uint32_t(step) : 0u - uint32_t(step);
+    bool     nonEmpty = (step > 0) ? lo < hi : lo > hi;
+    uint32_t span     = (step > 0) ? uint32_t(hi) - uint32_t(lo) : uint32_t(lo) - uint32_t(hi);
+    r[ip->a] = nonEmpty ? int32_t((span - 1) / stepSize + 1) : 0;
+    NEXT();
+}
+opCall: {
+    size_t slotNumber = ip->b;
+    if (slots[slotNumber].native == nullptr && hotCalls > 0 && ++slots[slotNumber].heat >= hotCalls) {
+        hot(slots[slotNumber].name);
+        if (slots[slotNumber].native == nullptr) {
+            slots[slotNumber].heat = 0;
+        }
+    }
+
+    auto &slot = slots[slotNumber];
+    const int32_t *args = r + ip->c;
+    if (slot.native != nullptr) {
+        boxedArgs.clear();
+        for (size_t i = 0; i < slot.numArgs; i++) {
+            if (!slot.arrayArgs.empty() && slot.arrayArgs[i]) {
+                auto &array = arr[args[i]];
+                boxedArgs.push_back(uint64_t(reinterpret_cast<uintptr_t>(array.data)));
+                boxedArgs.push_back(uint32_t(array.len));
+            } else {
+                boxedArgs.push_back(uint32_t(args[i]));
+            }
+        }
+
+        if (!callNative(slot.native, boxedArgs.data(), trapDivZero, result)) {
+            // this frame called the code which threw, so it catches it
+            if (!catchIn(frames.size() - 1, result)) {
+                return;
+            }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        r[ip->a] = result;
+        NEXT();
+    }
+
+    assert(slot.code != nullptr);
+    size_t callerRegs = frame->regBase + ip->c, callerArrays = frame->arrayBase;
+    frame->ip = ip + 1;
+    pushFrame(*slot.code, slotNumber, ip->a);
+
+    auto &callee = frames.back();
+    for (size_t i = 0; i < slot.numArgs; i++) {
+        if (!slot.arrayArgs.empty() && slot.arrayArgs[i]) {
+            auto &array = arrays[callerArrays + regs[callerRegs + i]];
+            arrays[callee.arrayBase + i] = ArrayReg{array.data, array.len, false};
+        } else {
+            regs[callee.regBase + i] = regs[callerRegs + i];
+        }
+    }
+    LOAD_FRAME();
+    DISPATCH();
+}
+opReturn: {
+    result = r[ip->a];
+    auto resultReg = frame->resultReg;
+    unwindTo(frames.size() - 1);
+    if (frames.empty()) {
+        return;
+    }
+    LOAD_FRAME();
+    r[resultReg] = result;
+    DISPATCH();
+}
+opOutput:
+    jc_output(OutputResult, r[ip->a]);
+    NEXT();
+opNewArray: {
+    // like array(n), 64 byte aligned, padded to 64 bytes and zeroed
+    int32_t len   = std::max(r[ip->b], 0);
+    size_t  bytes = (size_t(len) * 4 + 63) & ~size_t(63);
+    auto   *data  = (bytes > 0) ? static_cast<int32_t *>(std::aligned_alloc(64, bytes)) : nullptr;
+    if (data != nullptr) {
+        std::memset(data, 0, bytes);
+    }
+    arr[ip->a] = ArrayReg{data, len, true};
+    NEXT();
+}
+opFreeArray:
+    if (arr[ip->a].owned) {
+        std::free(arr[ip->a].data);
+    }
+    arr[ip->a] = ArrayReg{};
+    NEXT();
+opLen:
+    r[ip->a] = arr[ip->b].len;
+    NEXT();
+opLoad:
+    r[ip->a] = arr[ip->b].data[r[ip->c]];
+    NEXT();
+opStore:
+    arr[ip->a].data[r[ip->b]] = r[ip->c];
+    NEXT();
+opSum:
+opMin:
+opMax:
+opCount:
+    r[ip->a] = reduce(ip->op, arr[ip->b].data, r[ip->c], r[ip->c + 1], r[ip->c + 2]);
+    NEXT();
+
+#undef LOAD_FRAME
+#undef DISPATCH
+#undef NEXT
+}
+
+}
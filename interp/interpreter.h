@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bytecode.h"
+
+namespace interp {
+
+// Runs bytecode with threaded dispatch, each instruction jumps straight to the handler of
+// the next. Frames live on the heap, so deep recursion doesn't grow the native stack. Calls
+// go through a slot per function name, which holds the bytecode of an interpreted function
+// or the entry of its compiled code, so a function can move to compiled code between calls.
+class Interpreter {
+public:
+    // i32 name.boxed(ptr args), see Emit::emitBoxedEntry
+    using NativeEntry = int32_t (*)(const uint64_t *args);
+
+    struct Slot {
+        std::string                     name;
+        bool                            defined = false;
+        size_t                          numArgs = 0;
+        std::vector<bool>               arrayArgs;
+        std::shared_ptr<const Function> code;             // kept for running frames once compiled
+        NativeEntry                     native = nullptr; // calls go here when it is set
+        size_t                          heat   = 0;       // calls and loop iterations while interpreted
+    };
+
+    // hot is called with the name of an interpreted function which has been called or looped
+    // hotCalls times, before it is called again. It may compile it and set its native entry.
+    Interpreter(bool trapDivZero, size_t hotCalls, std::function<void(const std::string &)> hot);
+    ~Interpreter();
+
+    // the number of a name's slot, which is added undefined if it is new. Numbers never change.
+    size_t      slotOf(const std::string &name);
+    const Slot* find(const std::string &name) const; // null if undefined
+
+    // a new definition, which has no code until setCode or setNative
+    void define(const std::string &name, size_t numArgs, const std::vector<bool> &arrayArgs);
+    void setCode(const std::string &name, std::shared_ptr<const Function> code);
+    void setNative(const std::string &name, size_t numArgs, const std::vector<bool> &arrayArgs, NativeEntry native);
+    void remove(const std::string &name);
+
+    // Runs the start function of a cell. A division by zero is caught by the frame which
+    // called the function it happened in, which prints it and returns 0 like a landing pad.
+    // Without a caller it is thrown to the host as an int, like compiled code throws it. With
+    // trapDivZero it abandons the cell.
+    void run(const Function &start);
+
+private:
+    struct ArrayReg {
+        int32_t *data  = nullptr;
+        int32_t len    = 0;
+        bool    owned  = false; // allocated by this frame, arguments belong to the caller
+    };
+
+    struct Frame {
+        const Function *fn;
+        const Instr    *ip;        // the next instruction while a callee runs
+        size_t         regBase;
+        size_t         arrayBase;
+        size_t         numArrays;
+        size_t         slot;       // noSlot for a cell's start function
+        uint16_t       resultReg;  // in the caller
+    };
+    static constexpr size_t noSlot = ~size_t(0);
+
+    bool                                     trapDivZero;
+    size_t                                   hotCalls;
+    std::function<void(const std::string &)> hot;
+
+    std::vector<Slot>             slots;
+    std::map<std::string, size_t> slotNumbers;
+
+    std::vector<Frame>    frames;
+    std::vector<int32_t>  regs;
+    std::vector<ArrayReg> arrays;
+    std::vector<uint64_t> boxedArgs;
+
+    void execute();
+    void pushFrame(const Function &fn, size_t slot, uint16_t resultReg);
+    void unwindTo(size_t depth);
+    bool catchIn(size_t catcher, int32_t payload);
+    bool divideByZero();
+};
+
+}
@@ -0,0 +1,81 @@
+#include "batch.h"
+#include "output.h"
+
+#include <algorithm>
+#include <optional>
+
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/GlobalVariable.h>
+
+using namespace llvm;
+
+Expected<Batch> compileBatch(
+    orc::LLJIT             &jit,
+    orc::JITDylib          &dyLib,
+    orc::ThreadSafeContext &context,
+    Optimiser              &optimiser,
+    const EmitOptions      &options,
+    Sparse<ast::Node>::Key programKey,
+    Sparse<ast::Node>      &ast,
+    PhaseTimers            *timers
+) {
+    auto lock = context.getLock();
+
+    auto &prog  = std::get<ast::Program>(ast.at(programKey));
+    auto &stmts = std::get<ast::List>(ast.at(prog.stmtList));
+
+    Emit emit(*context.getContext(), "jitCalc_batch", "", options);
+    std::optional<PhaseTimers::Scope> scope(std::in_place, timers, PhaseTimers::Emitting);
+
+    std::vector<Sparse<ast::Node>::Key> exprs;
+    for (auto key : stmts.list) {
+        if (auto *fnDef = std::get_if<ast::FnDef>(&ast.at(key)); fnDef != nullptr) {
+            emit.emitFuncDef(ast, *fnDef);
+        } else {
+            exprs.push_back(key);
+        }
+    }
+
+    // the chunks are only reachable through the table, so they are internal
+    std::vector<Constant*> table;
+    for (size_t i = 0; i < exprs.size(); i += Batch::chunkSize) {
+        std::vector<Sparse<ast::Node>::Key> chunk(
+            exprs.begin() + i, exprs.begin() + std::min(i + Batch::chunkSize, exprs.size()));
+
+        auto *fn = emit.emitResultChunk(ast, chunk, "batch.chunk" + std::to_string(table.size()));
+        fn->setLinkage(GlobalValue::InternalLinkage);
+        table.push_back(fn);
+    }
+    emit.mod().finaliseDebug();
+    if (auto err = emit.takeError()) {
+        return std::move(err);
+    }
+
+    auto &module = emit.mod().getLlModule();
+    auto *tableTy = ArrayType::get(PointerType::getUnqual(module.getContext()), table.size());
+    new GlobalVariable(
+        module, tableTy, true, GlobalValue::ExternalLinkage, ConstantArray::get(tableTy, table), "batch.table");
+
+    scope.emplace(timers, PhaseTimers::Verifying);
+    emit.mod().verifyModule();
+    scope.emplace(timers, PhaseTimers::Optimising);
+    emit.mod().optimiseModule(optimiser);
+
+    scope.emplace(timers, PhaseTimers::Materialising);
+    Batch batch;
+    batch.numExprs = exprs.size();
+    batch.tracker = dyLib.createResourceTracker();
+    cantFail(jit.addIRModule(batch.tracker, orc::ThreadSafeModule(emit.mod().moveModule(), context)));
+
+    auto *chunks = cantFail(jit.lookup(dyLib, "batch.table")).toPtr<Batch::ChunkFunc*>();
+    batch.chunks.assign(chunks, chunks + table.size());
+    return std::move(batch);
+}
+
+
+void outputResults(const std::vector<int32_t> &results, const std::vector<uint8_t> &failed) {
+    for (size_t i = 0; i < results.size(); i++) {
+        jc_output(failed[i] ? OutputDivZero : OutputResult, results[i]);
+    }
+    runtime::flushOutput();
+}
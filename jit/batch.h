@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+
+#include "ast.h"
+#include "emit.h"
+#include "optimiser.h"
+#include "phaseTimers.h"
+#include "sparse.h"
+
+// Evaluates the top-level expressions of a program independently. The expressions are
+// emitted in chunks of straight-line code into one module, which is optimised and added to
+// the JIT once. A chunk stores each result into a buffer and the index of the next
+// expression into *next, so after a failure the host resumes the chunk past the expression
+// which failed. A chunk returns 0 when it has run to the end, or the payload of an
+// exception caught from a call, which it leaves for the host to report.
+struct Batch {
+    using ChunkFunc = int32_t (*)(int32_t *results, int32_t *next);
+
+    // a function per expression costs far more to optimise and generate than the expression
+    static const size_t chunkSize = 256;
+
+    std::vector<ChunkFunc>       chunks;
+    size_t                       numExprs = 0;
+    llvm::orc::ResourceTrackerSP tracker;
+};
+
+// fails with the first error Emit reports, before anything is added to the JIT
+llvm::Expected<Batch> compileBatch(
+    llvm::orc::LLJIT             &jit,
+    llvm::orc::JITDylib          &dyLib,
+    llvm::orc::ThreadSafeContext &context,
+    Optimiser                    &optimiser,
+    const EmitOptions            &options,
+    Sparse<ast::Node>::Key       programKey,
+    Sparse<ast::Node>            &ast,
+    PhaseTimers                  *timers = nullptr
+);
+
+// writes a result record for each value, or a division by zero record where failed is set,
+// through the output runtime
+void outputResults(const std::vector<int32_t> &results, const std::vector<uint8_t> &failed);
@@ -0,0 +1,177 @@
+#include "engine.h"
+
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/TargetParser/SubtargetFeature.h>
+
+#include "parse.h"
+#include "output.h"
+#include "parallel.h"
+#include "profiler.h"
+
+using namespace llvm;
+
+Script::Script(Script &&other) : session(other.session), dyLib(other.dyLib), funcs(std::move(other.funcs)) {
+    other.dyLib = nullptr;
+}
+
+
+Script::~Script() {
+    if (dyLib != nullptr) {
+        cantFail(session->removeJITDylib(*dyLib));
+    }
+}
+
+
+Expected<void*> Script::lookup(StringRef name, size_t numArgs) const {
+    auto it = funcs.find(name);
+    if (it == funcs.end()) {
+        return createStringError(inconvertibleErrorCode(), "no function named %s", name.str().c_str());
+    }
+
+    auto &objFunc = it->second.objFunc;
+    for (bool isArray : objFunc.arrayArgs) {
+        if (isArray) {
+            return createStringError(inconvertibleErrorCode(), "%s has array arguments", name.str().c_str());
+        }
+    }
+    if (objFunc.numArgs != numArgs) {
+        return createStringError(inconvertibleErrorCode(), "%s takes %zu arguments, not %zu",
+            name.str().c_str(), objFunc.numArgs, numArgs);
+    }
+    return it->second.address;
+}
+
+
+Expected<std::unique_ptr<Engine>> Engine::create(const EngineOptions &options) {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+
+    std::unique_ptr<Engine> engine(new Engine(options));
+    engine->context = orc::ThreadSafeContext(std::make_unique<LLVMContext>());
+
+    auto targetMachineBuilder = orc::JITTargetMachineBuilder::detectHost();
+    if (!targetMachineBuilder) {
+        return targetMachineBuilder.takeError();
+    }
+    targetMachineBuilder->setCodeGenOptLevel(options.codegenLevel);
+    if (options.cpu != "host") {
+        targetMachineBuilder->setCPU(options.cpu);
+        targetMachineBuilder->getFeatures() = SubtargetFeatures();
+    }
+
+    // the optimiser uses its own target machine for the cost model and data layout
+    auto targetMachine = targetMachineBuilder->createTargetMachine();
+    if (!targetMachine) {
+        return targetMachine.takeError();
+    }
+    engine->targetMachine = std::move(*targetMachine);
+
+    engine->optimiser = std::make_unique<Optimiser>(engine->targetMachine.get());
+    if (auto err = engine->optimiser->buildPipeline(options.optLevel, options.passPipeline, options.extras)) {
+        return std::move(err);
+    }
+
+    auto jit = orc::LLJITBuilder()
+        .setJITTargetMachineBuilder(std::move(*targetMachineBuilder))
+        .create();
+    if (!jit) {
+        return jit.takeError();
+    }
+    engine->jit = std::move(*jit);
+    return engine;
+}
+
+
+Expected<orc::JITDylib&> Engine::createDyLib(const std::string &name) {
+    auto dyLib = jit->createJITDylib(name);
+    if (!dyLib) {
+        return dyLib.takeError();
+    }
+
+    // runtime functions called by jitted code
+    orc::SymbolMap runtimeSymbols;
+    runtimeSymbols[jit->mangleAndIntern("jc_parallel_for")] = orc::ExecutorSymbolDef(
+        orc::ExecutorAddr::fromPtr(&jc_parallel_for),
+        JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+    runtimeSymbols[jit->mangleAndIntern("jc_output")] = orc::ExecutorSymbolDef(
+        orc::ExecutorAddr::fromPtr(&jc_output),
+        JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+    runtimeSymbols[jit->mangleAndIntern("__ppp_enter")] = orc::ExecutorSymbolDef(
+        orc::ExecutorAddr::fromPtr(&__ppp_enter),
+        JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+    runtimeSymbols[jit->mangleAndIntern("__ppp_exit")] = orc::ExecutorSymbolDef(
+        orc::ExecutorAddr::fromPtr(&__ppp_exit),
+        JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+    if (auto err = dyLib->define(orc::absoluteSymbols(std::move(runtimeSymbols)))) {
+        return std::move(err);
+    }
+    return *dyLib;
+}
+
+
+Expected<Script> Engine::compile(StringRef source) {
+    std::lock_guard<std::mutex> guard(compileMutex);
+
+    auto buffer = MemoryBuffer::getMemBuffer(source, "script", false);
+    Sparse<ast::Node>::Key programKey;
+    auto *ast = parse(programKey, *buffer);
+    if (ast == nullptr) {
+        return createStringError(inconvertibleErrorCode(), "script has syntax errors");
+    }
+
+    auto &prog  = std::get<ast::Program>(ast->at(programKey));
+    auto &stmts = std::get<ast::List>(ast->at(prog.stmtList));
+    for (auto key : stmts.list) {
+        if (!std::holds_alternative<ast::FnDef>(ast->at(key))) {
+            auto pos = std::visit([](auto &node) { return node.pos; }, ast->at(key));
+            return createStringError(inconvertibleErrorCode(), "%d:%d: scripts can only define functions",
+                pos.line, pos.column);
+        }
+    }
+
+    auto name = "jitCalc_script" + std::to_string(numScripts++);
+    auto dyLib = createDyLib(name);
+    if (!dyLib) {
+        return dyLib.takeError();
+    }
+
+    // owns the library from here so that it is removed on failure
+    Script script(jit->getExecutionSession(), *dyLib);
+
+    std::vector<std::pair<std::string, ObjFunc>> funcDefs;
+    {
+        auto lock = context.getLock();
+        Emit emit(*context.getContext(), name, "", options.emit);
+        for (auto key : stmts.list) {
+            emit.emitFuncDef(*ast, std::get<ast::FnDef>(ast->at(key)));
+        }
+        if (auto err = emit.takeError()) {
+            return std::move(err);
+        }
+        emit.mod().finaliseDebug();
+        emit.mod().verifyModule();
+        emit.mod().optimiseModule(*optimiser);
+
+        funcDefs = emit.getFuncDefs();
+        if (auto err = jit->addIRModule(*dyLib, orc::ThreadSafeModule(emit.mod().moveModule(), context))) {
+            return std::move(err);
+        }
+    }
+
+    // every function is resolved in one lookup, which also compiles the module
+    orc::SymbolLookupSet lookupSet;
+    for (auto &[funcName, objFunc] : funcDefs) {
+        lookupSet.add(jit->mangleAndIntern(funcName));
+    }
+    auto symbols = jit->getExecutionSession().lookup(orc::makeJITDylibSearchOrder(&*dyLib), std::move(lookupSet));
+    if (!symbols) {
+        return symbols.takeError();
+    }
+
+    for (auto &[funcName, objFunc] : funcDefs) {
+        auto address = (*symbols)[jit->mangleAndIntern(funcName)].getAddress().toPtr<void*>();
+        script.funcs.emplace(funcName, Script::Func{address, objFunc});
+    }
+    return std::move(script);
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/Support/CodeGen.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Target/TargetMachine.h>
+
+#include "emit.h"
+#include "optimiser.h"
+
+struct EngineOptions {
+    EmitOptions           emit;
+    char                  optLevel = '2';
+    std::string           passPipeline;  // replaces the optLevel pipeline when not empty
+    llvm::CodeGenOptLevel codegenLevel = llvm::CodeGenOptLevel::Default;
+    std::string           cpu = "host";  // "host" uses the host cpu and features
+
+    // with profile, every function is instrumented for the profiler runtime and the host
+    // reports it with runtime::reportProfile after draining each thread which ran scripts
+    PipelineExtras        extras;
+};
+
+// The functions of a compiled source. Their addresses are looked up once when it is
+// compiled, so calls from the host go straight through a function pointer. The code is
+// freed when the script is destroyed, which must be before its engine.
+//
+// Division by zero throws an int out of the called function, or with trapDivZero raises
+// SIGILL or SIGTRAP, which the host has to handle as main.cpp does.
+class Script {
+public:
+    Script(Script &&other);
+    Script &operator=(Script &&other) = delete;
+    ~Script();
+
+    // the function with a signature like int32_t(int32_t, int32_t), which must match its
+    // number of arguments. Functions with array arguments can't be called from the host.
+    template <typename Sig>
+    llvm::Expected<Sig*> get(llvm::StringRef name) const {
+        static_assert(FuncSig<Sig>::valid, "script functions take and return int32_t");
+        auto address = lookup(name, FuncSig<Sig>::numArgs);
+        if (!address) {
+            return address.takeError();
+        }
+        return reinterpret_cast<Sig*>(*address);
+    }
+
+private:
+    friend class Engine;
+
+    template <typename Sig> struct FuncSig {
+        static constexpr bool valid = false;
+    };
+    template <typename... Args> struct FuncSig<int32_t(Args...)> {
+        static constexpr bool   valid   = (std::is_same_v<Args, int32_t> && ...);
+        static constexpr size_t numArgs = sizeof...(Args);
+    };
+
+    struct Func {
+        void    *address;
+        ObjFunc objFunc;
+    };
+
+    Script(llvm::orc::ExecutionSession &session, llvm::orc::JITDylib &dyLib) : session(&session), dyLib(&dyLib) {}
+
+    llvm::Expected<void*> lookup(llvm::StringRef name, size_t numArgs) const;
+
+    llvm::orc::ExecutionSession *session;
+    llvm::orc::JITDylib         *dyLib;    // null once moved from
+    std::map<std::string, Func, std::less<>> funcs;
+};
+
+// Owns a JIT and the optimiser for embedding jitCalc in a host program. Each compiled
+// source gets a dynamic library of its own, so scripts can define the same names.
+class Engine {
+public:
+    static llvm::Expected<std::unique_ptr<Engine>> create(const EngineOptions &options);
+
+    // compiles the functions of a source, top-level expressions are an error and so is
+    // anything Emit rejects. Scripts may be called from several threads at once,
+    // a thread outside the pool only takes part in the pfor loops it started.
+    llvm::Expected<Script> compile(llvm::StringRef source);
+
+    // a dynamic library which can call the runtime, for programs which drive the JIT themselves
+    llvm::Expected<llvm::orc::JITDylib&> createDyLib(const std::string &name);
+
+    llvm::orc::LLJIT             &getJIT()       { return *jit; }
+    llvm::orc::ThreadSafeContext &getContext()   { return context; }
+    Optimiser                    &getOptimiser() { return *optimiser; }
+
+private:
+    Engine(const EngineOptions &options) : options(options) {}
+
+    EngineOptions                         options;
+    llvm::orc::ThreadSafeContext          context;
+    std::unique_ptr<llvm::TargetMachine>  targetMachine;
+    std::unique_ptr<Optimiser>            optimiser;     // declared after the target machine it uses
+    std::unique_ptr<llvm::orc::LLJIT>     jit;
+    size_t                                numScripts = 0;
+
+    // the parser and optimiser aren't reentrant
+    std::mutex compileMutex;
+};
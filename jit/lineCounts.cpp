@@ -0,0 +1,68 @@
+#include "lineCounts.h"
+
+#include <algorithm>
+
+#include <llvm/IR/Constants.h>
+#include <llvm/Support/Format.h>
+
+#include "BlockCounters.h"
+
+using namespace llvm;
+
+void LineCounts::addModule(const Module &module) {
+    auto *counters = module.getGlobalVariable(BLOCK_COUNTERS_NAME);
+    if (counters == nullptr) {
+        return;
+    }
+
+    unread.clear();
+    symbol = counters->getName().str();
+    for (auto &lines : cast<MDTuple>(counters->getMetadata(BLOCK_COUNTERS_MD))->operands()) {
+        auto &counterLines = unread.emplace_back();
+        for (auto &line : cast<MDTuple>(lines)->operands()) {
+            counterLines.push_back(mdconst::extract<ConstantInt>(line)->getZExtValue());
+        }
+    }
+}
+
+
+Error LineCounts::readCounters(orc::LLJIT &jit, orc::JITDylib &dyLib) {
+    if (unread.empty()) {
+        return Error::success();
+    }
+
+    auto address = jit.lookup(dyLib, symbol);
+    if (!address) {
+        return address.takeError();
+    }
+
+    auto *values = address->toPtr<const uint64_t*>();
+    for (size_t i = 0; i < unread.size(); i++) {
+        for (unsigned line : unread[i]) {
+            counts[line] = std::max(counts[line], values[i]);
+        }
+    }
+    unread.clear();
+    return Error::success();
+}
+
+
+void LineCounts::writeListing(raw_ostream &os, StringRef source) {
+    SmallVector<StringRef, 64> lines;
+    source.split(lines, '\n');
+    if (!lines.empty() && lines.back().empty()) {
+        lines.pop_back();
+    }
+
+    for (size_t i = 0; i < lines.size(); i++) {
+        auto it = counts.find(i + 1);
+        if (it == counts.end()) {
+            os << "        -";
+        } else if (it->second == 0) {
+            os << "    #####";
+        } else {
+            os << format("%9llu", (unsigned long long)it->second);
+        }
+        os << format(":%5zu:", i + 1) << lines[i] << "\n";
+    }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/raw_ostream.h>
+
+// Reads the block counters of code built with -line-counts and lists the source with the
+// execution count of each line, in the style of gcov.
+class LineCounts {
+public:
+    // finds the counters of an optimised module, before it is added to the JIT
+    void addModule(const llvm::Module &module);
+
+    // adds the counts of the modules added since the last read, their code must still be
+    // in dyLib
+    llvm::Error readCounters(llvm::orc::LLJIT &jit, llvm::orc::JITDylib &dyLib);
+
+    // a line is counted as often as the most executed block with code from it. "-" marks
+    // lines without counted code and "#####" lines which never ran.
+    void writeListing(llvm::raw_ostream &os, llvm::StringRef source);
+
+private:
+    std::vector<std::vector<unsigned>> unread;  // the lines of each counter
+    std::string                        symbol;
+    std::map<unsigned, uint64_t>       counts;  // by line
+};
@@ -0,0 +1,64 @@
+#include "pgoProfile.h"
+
+#include <llvm/IR/Constants.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "PGOLowering.h"
+
+using namespace llvm;
+
+PGOProfile::PGOProfile() {
+    // PGOInstrumentationUse only accepts IR level profiles
+    cantFail(writer.mergeProfileKind(InstrProfKind::IRInstrumentation));
+}
+
+
+void PGOProfile::addModule(const Module &module) {
+    for (auto &global : module.globals()) {
+        auto *md = global.getMetadata(PGO_COUNTER_MD);
+        if (md == nullptr || global.isDeclaration()) {
+            continue;
+        }
+
+        Counters counters;
+        counters.name        = cast<MDString>(md->getOperand(0))->getString().str();
+        counters.hash        = mdconst::extract<ConstantInt>(md->getOperand(1))->getZExtValue();
+        counters.numCounters = cast<ArrayType>(global.getValueType())->getNumElements();
+        counters.symbol      = global.getName().str();
+        unread.push_back(std::move(counters));
+    }
+}
+
+
+Error PGOProfile::readCounters(orc::LLJIT &jit, orc::JITDylib &dyLib) {
+    for (auto &counters : unread) {
+        auto symbol = jit.lookup(dyLib, counters.symbol);
+        if (!symbol) {
+            return symbol.takeError();
+        }
+
+        auto *values = symbol->toPtr<const uint64_t*>();
+        NamedInstrProfRecord record(counters.name, counters.hash,
+            std::vector<uint64_t>(values, values + counters.numCounters));
+
+        Error mergeError = Error::success();
+        writer.addRecord(std::move(record), 1, [&mergeError](Error err) {
+            mergeError = joinErrors(std::move(mergeError), std::move(err));
+        });
+        if (mergeError) {
+            return mergeError;
+        }
+    }
+    unread.clear();
+    return Error::success();
+}
+
+
+Error PGOProfile::write(const std::string &path) {
+    std::error_code errorCode;
+    raw_fd_ostream os(path, errorCode, sys::fs::OF_None);
+    if (errorCode) {
+        return createStringError(errorCode, "cannot write %s", path.c_str());
+    }
+    return writer.write(os);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/IR/Module.h>
+#include <llvm/ProfileData/InstrProfWriter.h>
+#include <llvm/Support/Error.h>
+
+// Collects the block counts of code built with -gen-profile and writes them as an indexed
+// profile, the format llvm-profdata merge produces, so -use-profile can read it without
+// compiler-rt or llvm-profdata.
+class PGOProfile {
+public:
+    PGOProfile();
+
+    // finds the counter arrays of an optimised module, before it is added to the JIT
+    void addModule(const llvm::Module &module);
+
+    // adds the counts of the modules added since the last read, their code must still be
+    // in dyLib
+    llvm::Error readCounters(llvm::orc::LLJIT &jit, llvm::orc::JITDylib &dyLib);
+
+    llvm::Error write(const std::string &path);
+
+private:
+    struct Counters {
+        std::string name;    // PGO name of the function, "file;fn" when it is internal
+        uint64_t    hash;    // of the CFG when it was instrumented
+        size_t      numCounters;
+        std::string symbol;
+    };
+
+    std::vector<Counters> unread;
+    llvm::InstrProfWriter writer;
+};
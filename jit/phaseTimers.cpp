@@ -0,0 +1,68 @@
+#include "phaseTimers.h"
+
+#include <sys/resource.h>
+
+#include <llvm/Support/Format.h>
+#include <llvm/Support/TimeProfiler.h>
+
+using namespace llvm;
+
+static const char *phaseNames[PhaseTimers::NumPhases] = {
+    "parse", "emit", "verify", "optimise", "materialise", "execute"
+};
+
+
+static long peakRss() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss; // KiB on linux
+}
+
+
+PhaseTimers::Scope::Scope(PhaseTimers *timers, Phase phase) : timers(timers), phase(phase) {
+    if (timers == nullptr) {
+        return;
+    }
+    timeTraceProfilerBegin(phaseNames[phase], "");
+    timers->timers[phase].startTimer();
+}
+
+
+PhaseTimers::Scope::~Scope() {
+    if (timers == nullptr) {
+        return;
+    }
+    timers->timers[phase].stopTimer();
+    timeTraceProfilerEnd();
+    timers->peakRssKiB[phase] = peakRss();
+}
+
+
+PhaseTimers::PhaseTimers() : group("phases", "jitCalc phases") {
+    for (size_t i = 0; i < NumPhases; i++) {
+        timers[i].init(phaseNames[i], phaseNames[i], group);
+    }
+}
+
+
+// the group would print timers which ran after the last report when they are destroyed,
+// which is only wanted through report
+PhaseTimers::~PhaseTimers() {
+    for (auto &timer : timers) {
+        timer.clear();
+    }
+}
+
+
+void PhaseTimers::report(raw_ostream &os, const std::string &title) {
+    os << "===-- " << title << " --===\n";
+
+    // the group skips timers which haven't run since it was reset
+    os << "  Peak RSS at the end of each phase:\n";
+    for (size_t i = 0; i < NumPhases; i++) {
+        if (timers[i].hasTriggered()) {
+            os << format("  %10ld KiB  %s\n", peakRssKiB[i], phaseNames[i]);
+        }
+    }
+    group.print(os, true);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <array>
+#include <string>
+
+#include <llvm/Support/Timer.h>
+#include <llvm/Support/raw_ostream.h>
+
+// Times the stages of compiling and running a program for -time-phases. Each phase adds its
+// wall, user and system time to a timer in one TimerGroup and records the peak resident set
+// size of the process when it ends. Phases also appear in the -time-trace output.
+class PhaseTimers {
+public:
+    enum Phase { Parsing, Emitting, Verifying, Optimising, Materialising, Executing, NumPhases };
+
+    // times a phase until the end of the scope, phases shouldn't nest. Does nothing when
+    // timers is null.
+    class Scope {
+    public:
+        Scope(PhaseTimers *timers, Phase phase);
+        ~Scope();
+
+    private:
+        PhaseTimers *timers;
+        Phase       phase;
+    };
+
+    PhaseTimers();
+    ~PhaseTimers();
+
+    // prints the phases which ran since the last report under a title and resets them
+    void report(llvm::raw_ostream &os, const std::string &title);
+
+private:
+    llvm::TimerGroup                   group;  // declared before the timers it outlives
+    std::array<llvm::Timer, NumPhases> timers;
+    std::array<long, NumPhases>        peakRssKiB{};
+};
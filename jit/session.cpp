@@ -0,0 +1,532 @@
+#include "session.h"
+
+#include <algorithm>
+#include <cassert>
+#include <utility>
+
+#include <llvm/Support/raw_ostream.h>
+
+#include "bytecode.h"
+#include "kernels.h"
+
+using namespace llvm;
+
+// the names of the functions called in a tree, including nested functions
+static void collectCalls(Sparse<ast::Node> &ast, Sparse<ast::Node>::Key key, std::set<std::string> &calls) {
+    auto &node = ast.at(key);
+    if (auto *call = std::get_if<ast::Call>(&node); call != nullptr) {
+        calls.insert(call->name);
+    }
+
+    for (auto child : ast::children(node)) {
+        collectCalls(ast, child, calls);
+    }
+}
+
+
+// true if existing calls to a function can be compiled against its new definition
+static bool sameArgs(Sparse<ast::Node> &ast, const ast::FnDef &fnDef, const ObjFunc &objFunc) {
+    auto &argsList = std::get<ast::List>(ast.at(fnDef.args));
+    if (argsList.size() != objFunc.numArgs) {
+        return false;
+    }
+
+    for (size_t i = 0; i < argsList.size(); i++) {
+        bool isArray = std::holds_alternative<ast::ArrayArg>(ast.at(argsList.list[i]));
+        if (isArray != (!objFunc.arrayArgs.empty() && objFunc.arrayArgs[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// A stub can be repointed at any later definition with the same arguments, so callers
+// can't rely on what was inferred for the current one.
+static ObjFunc throughStub(const ObjFunc &objFunc, const EmitOptions &options) {
+    ObjFunc stubFunc{objFunc.numArgs, !options.trapDivZero};
+    stubFunc.noUnwind   = options.trapDivZero;
+    stubFunc.readNone   = false;
+    stubFunc.willReturn = false;
+    stubFunc.noRecurse  = false;
+    stubFunc.pure       = false;
+    stubFunc.arrayArgs  = objFunc.arrayArgs;
+    return stubFunc;
+}
+
+
+Session::Session(
+    orc::LLJIT            &jit,
+    orc::JITDylib         &dyLib,
+    orc::ThreadSafeContext context,
+    Optimiser             &optimiser,
+    const SessionOptions  &options
+)
+    : jit(jit)
+    , dyLib(dyLib)
+    , context(std::move(context))
+    , optimiser(optimiser)
+    , options(options)
+{
+    if (options.hotSwap) {
+        auto stubsBuilder = orc::createLocalIndirectStubsManagerBuilder(jit.getTargetTriple());
+        assert(stubsBuilder);
+        stubs = stubsBuilder();
+    }
+
+    if (options.interpret) {
+        interpreter = std::make_unique<interp::Interpreter>(
+            options.emit.trapDivZero,
+            options.tierUpAfter,
+            [this](const std::string &name) { tierUp(name); });
+    }
+}
+
+
+// the functions visible to new code, with the attributes it may rely on
+std::vector<std::pair<std::string, ObjFunc>> Session::funcDefs(bool direct) {
+    std::vector<std::pair<std::string, ObjFunc>> defs;
+    for (auto &[name, entry] : funcs) {
+        defs.emplace_back(name, direct ? entry.objFunc : throughStub(entry.objFunc, options.emit));
+    }
+    return defs;
+}
+
+
+// the functions which call any of names directly or through other functions. directOnly
+// follows only the calls which don't go through a stub.
+std::set<std::string> Session::callersOf(const std::set<std::string> &names, bool directOnly) {
+    std::set<std::string>    callers;
+    std::vector<std::string> worklist(names.begin(), names.end());
+    while (!worklist.empty()) {
+        auto callee = worklist.back();
+        worklist.pop_back();
+
+        for (auto &[name, entry] : funcs) {
+            if ((entry.direct || !directOnly)
+                && entry.callees.count(callee) > 0
+                && names.count(name) == 0
+                && callers.insert(name).second
+            ) {
+                worklist.push_back(name);
+            }
+        }
+    }
+    return callers;
+}
+
+
+std::vector<Session::Pending> Session::pendingByOrder(const std::set<std::string> &names) {
+    std::vector<std::pair<size_t, std::string>> byOrder;
+    for (auto &name : names) {
+        byOrder.emplace_back(funcs[name].order, name);
+    }
+    std::sort(byOrder.begin(), byOrder.end());
+
+    std::vector<Pending> pending;
+    for (auto &[order, name] : byOrder) {
+        auto &entry = funcs[name];
+        pending.push_back(Pending{
+            name, entry.direct, entry.definedAt, entry.ast, entry.fnDef, entry.callees, entry.tracker != nullptr});
+    }
+    return pending;
+}
+
+
+void Session::removeFuncs(const std::set<std::string> &names) {
+    for (auto &name : names) {
+        auto &entry = funcs[name];
+        if (entry.tracker) {
+            cantFail(entry.tracker->remove());
+            inlineCache.remove(entry.impl);
+        }
+        if (interpreter) {
+            interpreter->remove(name);
+        }
+        funcs.erase(name);
+    }
+}
+
+
+Session::StartFunc Session::addCell(Sparse<ast::Node>::Key programKey, Sparse<ast::Node> &cellAst) {
+    auto lock = context.getLock();
+
+    // the parser reuses its tree for the next cell, functions keep a copy to be recompiled from
+    auto ast = std::make_shared<Sparse<ast::Node>>(cellAst);
+    auto &prog  = std::get<ast::Program>(ast->at(programKey));
+    auto &stmts = std::get<ast::List>(ast->at(prog.stmtList));
+
+    std::vector<Pending>                pending;
+    std::vector<Sparse<ast::Node>::Key> exprs;
+    std::set<std::string>               defined, redefined, changed, cellCalls;
+    for (auto key : stmts.list) {
+        collectCalls(*ast, key, cellCalls);
+
+        auto *fnDef = std::get_if<ast::FnDef>(&ast->at(key));
+        if (fnDef == nullptr) {
+            exprs.push_back(key);
+            continue;
+        }
+
+        if (!defined.insert(fnDef->name).second) {
+            llvm::errs() << fnDef->pos.line << ":" << fnDef->pos.column << ": "
+                << fnDef->name << " is defined twice in one cell\n";
+            return nullptr;
+        }
+        if (auto it = funcs.find(fnDef->name); it != funcs.end()) {
+            redefined.insert(fnDef->name);
+            if (!sameArgs(*ast, *fnDef, it->second.objFunc)) {
+                changed.insert(fnDef->name);
+            }
+        }
+
+        Pending function{fnDef->name, !options.hotSwap, numCells, ast, key, {}};
+        collectCalls(*ast, fnDef->body, function.callees);
+        pending.push_back(std::move(function));
+    }
+
+    // callers of a function whose arguments changed can't be recompiled, they are removed
+    // unless this cell redefines them too. Callers through a stub keep working.
+    std::set<std::string> dropped, recompiled;
+    for (auto &name : callersOf(changed, false)) {
+        if (defined.count(name) == 0) {
+            dropped.insert(name);
+        }
+    }
+    for (auto &name : callersOf(redefined, true)) {
+        if (defined.count(name) == 0 && dropped.count(name) == 0) {
+            recompiled.insert(name);
+        }
+    }
+
+    for (auto &name : cellCalls) {
+        if (dropped.count(name) > 0) {
+            llvm::errs() << "error: " << name
+                << " depends on a function whose arguments change, it must be redefined in the same cell\n";
+            return nullptr;
+        }
+    }
+
+    for (auto &function : pendingByOrder(recompiled)) {
+        pending.push_back(std::move(function));
+    }
+
+    // each function is compiled after the pending functions it calls
+    std::vector<Pending> ordered;
+    while (!pending.empty()) {
+        auto it = std::find_if(pending.begin(), pending.end(), [&pending](const Pending &function) {
+            return std::none_of(pending.begin(), pending.end(), [&function](const Pending &other) {
+                return other.name != function.name && function.callees.count(other.name) > 0;
+            });
+        });
+        if (it == pending.end()) {
+            llvm::errs() << "error: " << pending.front().name
+                << " is in a cycle of calls through the definitions being replaced\n";
+            return nullptr;
+        }
+        ordered.push_back(std::move(*it));
+        pending.erase(it);
+    }
+
+    // the old code is freed before anything is added, the names are defined again below
+    removeFuncs(redefined);
+    removeFuncs(recompiled);
+    removeFuncs(dropped);
+    for (auto &name : dropped) {
+        llvm::errs() << "removed " << name << ", a function it calls has different arguments\n";
+    }
+
+    for (auto &function : ordered) {
+        defineFunc(function);
+    }
+
+    std::string startName = "main" + std::to_string(numCells++);
+    if (exprs.empty()) {
+        return nullptr;
+    }
+
+    if (interpreter) {
+        auto start = [&]() {
+            PhaseTimers::Scope scope(options.timers, PhaseTimers::Emitting);
+            return interp::compileCell(*ast, exprs, *interpreter, options.emit);
+        }();
+        if (start) {
+            return [interpreter = interpreter.get(), start = std::move(*start)]() { interpreter->run(*start); };
+        }
+        consumeError(start.takeError());
+
+        // the expressions are compiled, so the functions they call must be too
+        std::set<std::string> exprCalls;
+        for (auto key : exprs) {
+            collectCalls(*ast, key, exprCalls);
+        }
+        for (auto &name : exprCalls) {
+            promote(name);
+        }
+    }
+
+    Emit emit(*context.getContext(), "jitCalc_child", startName, options.emit);
+    {
+        PhaseTimers::Scope scope(options.timers, PhaseTimers::Emitting);
+        auto defs = funcDefs(true);
+        emit.addFuncDefs(defs);
+        for (auto key : exprs) {
+            emit.emitResult(*ast, ast->at(key));
+        }
+        emit.emitReturnNoBlock(emit.emitInt32(0));
+        emit.mod().finaliseDebug();
+    }
+    if (auto err = emit.takeError()) {
+        llvm::errs() << toString(std::move(err)) << "\n";
+        return nullptr;
+    }
+
+    // the start function runs once and is freed before anything can be redefined
+    linkDirect(emit.mod().getLlModule());
+    addModule(emit, cellTracker, false);
+
+    // functions are compiled to machine code when the first lookup needs them
+    PhaseTimers::Scope scope(options.timers, PhaseTimers::Materialising);
+    auto symbol = cantFail(jit.lookup(dyLib, startName));
+    return symbol.toPtr<void (*)()>();
+}
+
+
+void Session::endCell() {
+    if (cellTracker) {
+        cantFail(cellTracker->remove());
+        cellTracker = nullptr;
+    }
+
+    if (stubs && options.relinkAfter > 0) {
+        auto lock = context.getLock();
+        relinkStable();
+    }
+}
+
+
+// Functions calling through stubs whose callees have all been left alone for relinkAfter
+// cells are recompiled to call the code directly, which lets the inliner see it. Direct
+// callers of those are recompiled too as the code moves.
+void Session::relinkStable() {
+    std::set<std::string> stable;
+    for (auto &[name, entry] : funcs) {
+        if (entry.direct || !entry.tracker) {
+            continue;
+        }
+
+        bool calleesStable = std::all_of(entry.callees.begin(), entry.callees.end(), [&](const std::string &callee) {
+            auto it = funcs.find(callee);
+            return callee == name
+                || it == funcs.end()
+                || it->second.definedAt + options.relinkAfter <= numCells;
+        });
+        if (calleesStable) {
+            stable.insert(name);
+        }
+    }
+    if (stable.empty()) {
+        return;
+    }
+
+    auto relinked = callersOf(stable, true);
+    relinked.insert(stable.begin(), stable.end());
+
+    auto pending = pendingByOrder(relinked);
+    removeFuncs(relinked);
+    for (auto &function : pending) {
+        function.direct = true;
+        compileFunc(function);
+    }
+}
+
+
+// New definitions start in the interpreter, unless they were compiled before or compiled
+// code calls them. Compiled code only calls compiled code, so their callees are compiled first.
+void Session::defineFunc(const Pending &pending) {
+    bool calledByCompiled = std::any_of(funcs.begin(), funcs.end(), [&](const auto &pair) {
+        return pair.second.tracker && pair.second.callees.count(pending.name) > 0;
+    });
+    if (interpreter && !pending.compiled && !calledByCompiled && interpretFunc(pending)) {
+        return;
+    }
+
+    for (auto &callee : pending.callees) {
+        if (callee != pending.name) {
+            promote(callee);
+        }
+    }
+    compileFunc(pending);
+}
+
+
+// false if the function uses something the interpreter can't run, it is compiled instead
+bool Session::interpretFunc(const Pending &pending) {
+    auto &fnDef    = std::get<ast::FnDef>(pending.ast->at(pending.fnDef));
+    auto &argsList = std::get<ast::List>(pending.ast->at(fnDef.args));
+
+    ObjFunc objFunc{argsList.size(), false};
+    for (auto argKey : argsList.list) {
+        objFunc.arrayArgs.push_back(std::holds_alternative<ast::ArrayArg>(pending.ast->at(argKey)));
+    }
+
+    // defined first so recursive calls resolve
+    interpreter->define(pending.name, objFunc.numArgs, objFunc.arrayArgs);
+    auto code = [&]() {
+        PhaseTimers::Scope scope(options.timers, PhaseTimers::Emitting);
+        return interp::compileFunction(*pending.ast, fnDef, *interpreter, options.emit);
+    }();
+    if (!code) {
+        consumeError(code.takeError());
+        interpreter->remove(pending.name);
+        return false;
+    }
+    interpreter->setCode(pending.name, std::move(*code));
+
+    // calls from the interpreter go through a slot, like a stub
+    funcs[pending.name] = FuncEntry{
+        throughStub(objFunc, options.emit), nullptr, pending.name, false, pending.definedAt,
+        pending.ast, pending.fnDef, pending.callees, numDefinitions++};
+    return true;
+}
+
+
+// compiles an interpreted function, after the interpreted functions it calls
+void Session::promote(const std::string &name) {
+    auto it = funcs.find(name);
+    if (it == funcs.end() || it->second.tracker) {
+        return;
+    }
+
+    auto entry = it->second;
+    for (auto &callee : entry.callees) {
+        if (callee != name) {
+            promote(callee);
+        }
+    }
+    compileFunc(Pending{name, !options.hotSwap, entry.definedAt, entry.ast, entry.fnDef, entry.callees, true});
+}
+
+
+// called by the interpreter while a cell runs, its frames keep running the bytecode and
+// later calls go to the compiled code
+void Session::tierUp(const std::string &name) {
+    auto lock = context.getLock();
+
+    // the compile happens during the cell's execution, not in its compile phases
+    auto *timers = std::exchange(options.timers, nullptr);
+    promote(name);
+    options.timers = timers;
+}
+
+
+void Session::compileFunc(const Pending &pending) {
+    // without calls to other functions there is nothing to link through stubs
+    bool direct = pending.direct
+        || std::none_of(pending.callees.begin(), pending.callees.end(), [&](const std::string &callee) {
+            return callee != pending.name && funcs.count(callee) > 0;
+        });
+
+    Emit emit(*context.getContext(), pending.name, "", options.emit);
+    {
+        PhaseTimers::Scope scope(options.timers, PhaseTimers::Emitting);
+        // an interpreted function being promoted is still in funcs, its definition is this one
+        auto defs = funcDefs(direct);
+        defs.erase(std::remove_if(defs.begin(), defs.end(), [&](const auto &def) {
+            return def.first == pending.name;
+        }), defs.end());
+        emit.addFuncDefs(defs);
+        emit.emitFuncDef(*pending.ast, std::get<ast::FnDef>(pending.ast->at(pending.fnDef)));
+        emit.mod().finaliseDebug();
+    }
+
+    // the function isn't defined, calls to it are reported like any other undefined name
+    if (auto err = emit.takeError()) {
+        llvm::errs() << toString(std::move(err)) << "\n";
+        return;
+    }
+
+    FuncEntry entry{
+        ObjFunc{}, nullptr, pending.name, direct, pending.definedAt,
+        pending.ast, pending.fnDef, pending.callees, numDefinitions++};
+    for (auto &[name, objFunc] : emit.getFuncDefs()) {
+        if (name == pending.name) {
+            entry.objFunc = objFunc;
+        }
+    }
+
+    auto &module = emit.mod().getLlModule();
+    if (direct) {
+        linkDirect(module);
+    }
+
+    // each version gets its own symbol so the stub can be pointed at it
+    if (stubs) {
+        entry.impl = pending.name + ".v" + std::to_string(entry.order);
+        module.getFunction(pending.name)->setName(entry.impl);
+    }
+    if (interpreter) {
+        createBoxedEntry(module, module.getFunction(entry.impl), entry.impl + ".boxed");
+    }
+
+    addModule(emit, entry.tracker, true);
+    if (stubs) {
+        pointStub(pending.name, entry.impl);
+    }
+    if (interpreter) {
+        PhaseTimers::Scope scope(options.timers, PhaseTimers::Materialising);
+        auto boxed = cantFail(jit.lookup(dyLib, entry.impl + ".boxed"));
+        interpreter->setNative(
+            pending.name, entry.objFunc.numArgs, entry.objFunc.arrayArgs,
+            boxed.toPtr<interp::Interpreter::NativeEntry>());
+    }
+    funcs[pending.name] = std::move(entry);
+}
+
+
+// calls to functions behind stubs go to the current code instead
+void Session::linkDirect(Module &module) {
+    for (auto &fn : module) {
+        auto it = funcs.find(fn.getName().str());
+        if (fn.isDeclaration() && it != funcs.end() && it->second.impl != it->first) {
+            fn.setName(it->second.impl);
+        }
+    }
+}
+
+
+void Session::pointStub(const std::string &name, const std::string &impl) {
+    PhaseTimers::Scope scope(options.timers, PhaseTimers::Materialising);
+    auto address = cantFail(jit.lookup(dyLib, impl));
+    if (stubs->findStub(name, true).getAddress()) {
+        cantFail(stubs->updatePointer(name, address));
+        return;
+    }
+
+    cantFail(stubs->createStub(name, address, JITSymbolFlags::Exported | JITSymbolFlags::Callable));
+    orc::SymbolMap symbols;
+    symbols[jit.mangleAndIntern(name)] = stubs->findStub(name, true);
+    cantFail(dyLib.define(orc::absoluteSymbols(std::move(symbols))));
+}
+
+
+void Session::addModule(Emit &emit, orc::ResourceTrackerSP &tracker, bool cache) {
+    emit.mod().printModule();
+    {
+        PhaseTimers::Scope scope(options.timers, PhaseTimers::Verifying);
+        emit.mod().verifyModule();
+    }
+    {
+        PhaseTimers::Scope scope(options.timers, PhaseTimers::Optimising);
+        if (options.crossCellInline) {
+            inlineCache.import(emit.mod().getLlModule());
+        }
+        emit.mod().optimiseModule(optimiser);
+        if (options.crossCellInline && cache) {
+            inlineCache.add(emit.mod().getLlModule());
+        }
+    }
+
+    tracker = dyLib.createResourceTracker();
+    cantFail(jit.addIRModule(tracker, orc::ThreadSafeModule(emit.mod().moveModule(), context)));
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <llvm/ExecutionEngine/Orc/IndirectionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+
+#include "ast.h"
+#include "emit.h"
+#include "inlineCache.h"
+#include "interpreter.h"
+#include "optimiser.h"
+#include "phaseTimers.h"
+#include "sparse.h"
+
+struct SessionOptions {
+    EmitOptions emit;
+
+    // let the inliner use functions from earlier cells
+    bool crossCellInline = true;
+
+    // calls between functions go through an indirect stub per function, so a redefinition
+    // only recompiles that function
+    bool hotSwap = false;
+
+    // with hotSwap, a function whose callees haven't been redefined for this many cells is
+    // recompiled to call them directly. 0 never relinks.
+    unsigned relinkAfter = 8;
+
+    // cells and new functions run in the bytecode interpreter, a function is compiled once it
+    // has been called or looped tierUpAfter times. 0 leaves them in the interpreter.
+    bool     interpret   = false;
+    unsigned tierUpAfter = 1000;
+
+    // times the compile phases of each cell, null when -time-phases is off
+    PhaseTimers *timers = nullptr;
+};
+
+// A REPL session. Every top-level function is compiled into its own module with its own
+// resource tracker, so a redefinition frees the old code and data. Callers linked to the
+// old address are recompiled from their syntax trees, or removed when the arguments of a
+// function they depend on change. A cell's expressions are freed once they have run.
+//
+// With the interpreter, functions only compiled code calls are compiled. Everything else
+// starts as bytecode, and the interpreter calls compiled code through its boxed entry.
+class Session {
+public:
+    using StartFunc = std::function<void()>;
+
+    Session(
+        llvm::orc::LLJIT             &jit,
+        llvm::orc::JITDylib          &dyLib,
+        llvm::orc::ThreadSafeContext context,
+        Optimiser                    &optimiser,
+        const SessionOptions         &options
+    );
+
+    // compiles the functions and expressions of a cell. Returns the function which evaluates
+    // the expressions, or an empty function when there are none or the cell can't be added.
+    StartFunc addCell(Sparse<ast::Node>::Key programKey, Sparse<ast::Node> &ast);
+
+    // frees the start function of the last cell once it has run, and relinks the callers of
+    // functions which have stopped changing
+    void endCell();
+
+private:
+    struct FuncEntry {
+        ObjFunc                            objFunc;
+        llvm::orc::ResourceTrackerSP       tracker;   // null while it is interpreted
+        std::string                        impl;      // symbol of the code, the stub has the name
+        bool                               direct;    // calls other functions without stubs
+        size_t                             definedAt; // cell of the source definition
+        std::shared_ptr<Sparse<ast::Node>> ast;       // the tree of the defining cell
+        Sparse<ast::Node>::Key             fnDef;
+        std::set<std::string>              callees;
+        size_t                             order;     // callees always have a lower order
+    };
+
+    // a function waiting to be compiled
+    struct Pending {
+        std::string                        name;
+        bool                               direct;
+        size_t                             definedAt;
+        std::shared_ptr<Sparse<ast::Node>> ast;
+        Sparse<ast::Node>::Key             fnDef;
+        std::set<std::string>              callees;
+        bool                               compiled = false; // was compiled before, it stays compiled
+    };
+
+    llvm::orc::LLJIT             &jit;
+    llvm::orc::JITDylib          &dyLib;
+    llvm::orc::ThreadSafeContext context;
+    Optimiser                    &optimiser;
+    SessionOptions               options;
+
+    // holds modules in the context, so it is declared after it
+    InlineCache inlineCache;
+
+    // null without hot swapping. Stubs are never removed, a name keeps its stub if the
+    // function is defined again.
+    std::unique_ptr<llvm::orc::IndirectStubsManager> stubs;
+
+    // null without -interpret
+    std::unique_ptr<interp::Interpreter> interpreter;
+
+    std::map<std::string, FuncEntry> funcs;
+    size_t                           numDefinitions = 0;
+    size_t                           numCells = 0;
+    llvm::orc::ResourceTrackerSP     cellTracker;
+
+    std::vector<std::pair<std::string, ObjFunc>> funcDefs(bool direct);
+    std::set<std::string> callersOf(const std::set<std::string> &names, bool directOnly);
+    std::vector<Pending>  pendingByOrder(const std::set<std::string> &names);
+    void                  removeFuncs(const std::set<std::string> &names);
+    void                  defineFunc(const Pending &pending);
+    bool                  interpretFunc(const Pending &pending);
+    void                  compileFunc(const Pending &pending);
+    void                  promote(const std::string &name);
+    void                  tierUp(const std::string &name);
+    void                  linkDirect(llvm::Module &module);
+    void                  pointStub(const std::string &name, const std::string &impl);
+    void                  addModule(Emit &emit, llvm::orc::ResourceTrackerSP &tracker, bool cache);
+    void                  relinkStable();
+};
@@ -11,13 +11,13 @@
 // Implements a custom lexer to turn strings into vectors of tokens.
 
 
-const std::vector keywords = {"fn", "if", "else", "return", "let", "for"};
-const std::string symbols = "+-*/()><=,";
-const std::vector<std::string> doubleSymbols = {"=="};
+const std::vector keywords = {"fn", "if", "else", "return", "let", "for", "in", "memo", "pfor", "step"};
+const std::string symbols = "+-*/()[]><=,";
+const std::vector<std::string> doubleSymbols = {"==", ".."};
 
 class TextPos {
 public:
-    TextPos(size_t line, size_t column, size_t index) : line(line), column(column) {}
+    TextPos(size_t line, size_t column, size_t index) : line(line), column(column), index(index) {}
     size_t line;
     size_t column;
     size_t index;
@@ -3,30 +3,189 @@
 // Implements a JIT compiled calculator.
 
 #include <iostream>
+#include <optional>
 #include <cassert>
+#include <setjmp.h>
+#include <signal.h>
 
+#include <llvm/ADT/STLExtras.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
 #include <llvm/ExecutionEngine/Orc/LLJIT.h>
 #include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
-#include <llvm/Support/TargetSelect.h>
 #include <llvm/Support/Casting.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/Support/CodeGen.h>
+#include <llvm/Support/TimeProfiler.h>
 
 #include "lexer.h"
 #include "ast.h"
 #include "parse.h"
 #include "emit.h"
 #include "symbols.h"
+#include "optimiser.h"
+#include "session.h"
+#include "batch.h"
+#include "engine.h"
+#include "phaseTimers.h"
+#include "pgoProfile.h"
+#include "lineCounts.h"
+#include "compileStats.h"
+#include "parallel.h"
+#include "output.h"
+#include "profiler.h"
 
 using namespace llvm;
 
 cl::opt<bool>        replMode("i", cl::desc("Interactive REPL Mode"));
 cl::opt<bool>        emitLlFile("l", cl::desc("Emit LLVM IR file"));
+cl::opt<bool>        batchMode("batch", cl::desc("Evaluate each expression of the input file, or stdin, independently in one module"));
 cl::opt<std::string> inputFile(cl::Positional, cl::desc("<input file>"));
+cl::opt<char>        optLevel("O", cl::desc("Optimization level: -O0, -O1, -O2, -O3 or -Os"), cl::Prefix, cl::init('2'));
+cl::opt<std::string> passPipeline("passes", cl::desc("Custom pass pipeline, replaces the -O pipeline"), cl::init(""));
+cl::opt<std::string> targetCpu("mcpu", cl::desc("Target cpu, eg. -mcpu=x86-64 for a portable baseline"), cl::init("host"));
+cl::opt<bool>        trapDivZero("trap-div-zero", cl::desc("Division by zero traps to the host instead of throwing a C++ exception"));
+cl::opt<bool>        memoise("memoise", cl::desc("Memoise every pure function, not only those declared with 'memo fn'"));
+cl::opt<bool>        crossCellInline("cross-cell-inline", cl::desc("Let the inliner use functions from earlier REPL cells"), cl::init(true));
+cl::opt<bool>        hotSwap("hot-swap", cl::desc("Call REPL functions through stubs so a redefinition only recompiles that function"));
+cl::opt<unsigned>    relinkAfter("relink-after", cl::desc("With -hot-swap, cells without redefinitions before callers are relinked to call directly, 0 never relinks"), cl::init(8));
+cl::opt<bool>        binaryOutput("binary-output", cl::desc("Write results as native-endian int32 pairs of kind and value instead of text"));
+cl::opt<unsigned>    numThreads("threads", cl::desc("Worker threads for pfor, 0 uses one per hardware thread"), cl::init(0));
+cl::opt<bool>        timePhases("time-phases", cl::desc("Print the time and peak memory of each compile phase, per REPL cell"));
+cl::opt<std::string> timeTraceFile("time-trace", cl::desc("Write a Chrome trace of the compile phases and optimiser passes to a file"), cl::init(""));
+cl::opt<bool>        profile("profile", cl::desc("Count calls and time each function, reported on exit"));
+cl::opt<std::string> profileFolded("profile-folded", cl::desc("Profile and write the time of each call stack in folded format to a file"), cl::init(""));
+cl::opt<std::string> profileTrace("profile-trace", cl::desc("Profile and write each call as a Chrome trace event to a file"), cl::init(""));
+cl::opt<std::string> genProfile("gen-profile", cl::desc("Count the blocks of the program and write an indexed profile to a file"), cl::init(""));
+cl::opt<std::string> useProfile("use-profile", cl::desc("Optimise with an indexed profile written by -gen-profile"), cl::init(""));
+cl::opt<std::string> lineCountsFile("line-counts", cl::desc("Count the executions of each source line and write the annotated source to a file"), cl::init(""));
+cl::opt<std::string> statsJsonFile("stats-json", cl::desc("Write the IR and code size of each compilation to a file, one JSON document per line"), cl::init(""));
+cl::opt<bool>        interpret("interpret", cl::desc("Run REPL cells and new functions in a bytecode interpreter until they are called often"));
+cl::opt<unsigned>    tierUpAfter("tier-up-after", cl::desc("With -interpret, calls and loop iterations before a function is compiled, 0 never compiles it"), cl::init(1000));
+cl::opt<char>        codegenOptLevel("codegen-O", cl::desc("JIT code generation level: -codegen-O0 to -codegen-O3"), cl::Prefix, cl::init('2'));
+
+
+// jumps to the buffer of the thread which trapped, pfor workers set their own
+static void trapHandler(int) {
+    siglongjmp(*runtime::trapJmpBuf, 1);
+}
+
+// installs trapHandler for the lifetime of the scope
+struct TrapHandlerScope {
+    struct sigaction oldIll, oldTrap;
+
+    TrapHandlerScope() {
+        struct sigaction action = {};
+        action.sa_handler = trapHandler;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGILL, &action, &oldIll);
+        sigaction(SIGTRAP, &action, &oldTrap);
+    }
+
+    ~TrapHandlerScope() {
+        runtime::trapJmpBuf = nullptr;
+        sigaction(SIGILL, &oldIll, nullptr);
+        sigaction(SIGTRAP, &oldTrap, nullptr);
+    }
+};
+
+// Runs a jitted function. With -trap-div-zero a division by zero executes a trap
+// instruction, the signal handler jumps back here and the rest of the program is abandoned.
+void runJitted(llvm::function_ref<void()> funcPtr) {
+    if (!trapDivZero) {
+        funcPtr();
+        runtime::flushOutput();
+        runtime::drainProfile();
+        return;
+    }
+
+    TrapHandlerScope trapScope;
+    sigjmp_buf trapJmpBuf;
+    runtime::trapJmpBuf = &trapJmpBuf;
+    if (sigsetjmp(trapJmpBuf, 1) == 0) {
+        funcPtr();
+    } else {
+        jc_output(OutputDivZero, 0);
+    }
+    runtime::flushOutput();
+    runtime::drainProfile();
+}
+
+// Runs every expression of a batch, a division by zero only abandons its own expression.
+void runBatch(const Batch &batch, std::vector<int32_t> &results, std::vector<uint8_t> &failed) {
+    results.assign(batch.numExprs, 0);
+    failed.assign(batch.numExprs, 0);
+
+    // the chunks store the index of the next expression here before anything can fail, it
+    // is on the heap so it isn't cached in a register across a longjmp
+    auto next = std::make_unique<int32_t>(0);
+    volatile size_t chunk = 0;
+
+    // runs the chunks from where a failure left off. A chunk which caught an exception
+    // itself returns without printing it, so it is reported in order with the others.
+    auto runChunks = [&]() {
+        for (; chunk < batch.chunks.size(); chunk = chunk + 1, *next = 0) {
+            while (batch.chunks[chunk](results.data() + chunk * Batch::chunkSize, next.get()) != 0) {
+                failed[chunk * Batch::chunkSize + *next] = 1;
+                *next += 1;
+            }
+        }
+    };
+
+    if (!trapDivZero) {
+        for (;;) {
+            try {
+                runChunks();
+                return;
+            } catch (int) {
+                failed[chunk * Batch::chunkSize + *next] = 1;
+                *next += 1;
+            }
+        }
+    }
+
+    // saving the signal mask is a system call, so the buffer is only set again after a trap
+    TrapHandlerScope trapScope;
+    sigjmp_buf trapJmpBuf;
+    runtime::trapJmpBuf = &trapJmpBuf;
+    while (sigsetjmp(trapJmpBuf, 1) != 0) {
+        failed[chunk * Batch::chunkSize + *next] = 1;
+        *next += 1;
+    }
+    runChunks();
+}
+
+
+// lists the source of a program which has run with the execution count of each line
+void writeLineCounts(LineCounts &lineCounts, orc::LLJIT &jit, orc::JITDylib &dyLib, StringRef source) {
+    if (auto err = lineCounts.readCounters(jit, dyLib)) {
+        llvm::errs() << toString(std::move(err)) << "\n";
+        return;
+    }
+
+    std::error_code errorCode;
+    llvm::raw_fd_ostream file(lineCountsFile, errorCode, llvm::sys::fs::OF_Text);
+    if (errorCode) {
+        llvm::errs() << "Cannot write " << lineCountsFile << ": " << errorCode.message() << "\n";
+        return;
+    }
+    lineCounts.writeListing(file, source);
+}
+
+
+// writes a profile with one of the runtime's writers
+void writeProfile(const std::string &path, void (*write)(FILE*)) {
+    FILE *file = fopen(path.c_str(), "w");
+    if (file == nullptr) {
+        llvm::errs() << "Cannot write " << path << "\n";
+        return;
+    }
+    write(file);
+    fclose(file);
+}
 
 
 std::unique_ptr<llvm::MemoryBuffer> getNextInput() {
@@ -65,27 +224,143 @@ int main(int argc, char **argv) {
             llvm::errs() << "Cannot have output IR file in REPL mode (-l)\n";
             return -1;
         }
+        if (batchMode) {
+            llvm::errs() << "Cannot have batch mode in REPL mode (-i)\n";
+            return -1;
+        }
+        if (!genProfile.empty() || !lineCountsFile.empty()) {
+            llvm::errs() << "Cannot generate a profile or line counts in REPL mode (-i)\n";
+            return -1;
+        }
+    } else if (batchMode) {
+        if (emitLlFile.getNumOccurrences() > 0) {
+            llvm::errs() << "Cannot have output IR file in batch mode (-batch)\n";
+            return -1;
+        }
+        if (!genProfile.empty() || !lineCountsFile.empty()) {
+            llvm::errs() << "Cannot generate a profile or line counts in batch mode (-batch)\n";
+            return -1;
+        }
     } else {
         if (inputFile.getNumOccurrences() != 1) {
             llvm::errs() << "Need one input file\n";
             return -1;
         }
+        if (emitLlFile.getNumOccurrences() > 0 && (!genProfile.empty() || !lineCountsFile.empty())) {
+            llvm::errs() << "Cannot generate a profile or line counts without running the program (-l)\n";
+            return -1;
+        }
+    }
+
+
+    auto codegenLevel = CodeGenOpt::parseLevel(codegenOptLevel);
+    if (!codegenLevel.has_value()) {
+        llvm::errs() << "Invalid code generation level: -codegen-O" << codegenOptLevel << "\n";
+        return -1;
     }
 
+    EmitOptions emitOptions;
+    emitOptions.trapDivZero = trapDivZero;
+    emitOptions.memoiseAll  = memoise;
+
+    EngineOptions engineOptions;
+    engineOptions.emit         = emitOptions;
+    engineOptions.optLevel     = optLevel;
+    engineOptions.passPipeline = passPipeline;
+    engineOptions.codegenLevel = *codegenLevel;
+    engineOptions.cpu          = targetCpu;
+    engineOptions.extras.profile     = profile || !profileFolded.empty() || !profileTrace.empty();
+    engineOptions.extras.pgoGenerate = !genProfile.empty();
+    engineOptions.extras.pgoUse      = useProfile;
+    engineOptions.extras.blockCounts = !lineCountsFile.empty();
+
+    // the optimiser only records its passes when the profiler exists before it is built
+    if (!timeTraceFile.empty()) {
+        timeTraceProfilerInitialize(500 /* us, like opt */, argv[0]);
+    }
+    std::optional<PhaseTimers> phaseTimers;
+    if (timePhases || !timeTraceFile.empty()) {
+        phaseTimers.emplace();
+    }
+    auto *timers = phaseTimers ? &*phaseTimers : nullptr;
 
-    InitializeNativeTarget();
-    LLVMInitializeNativeAsmPrinter();
-    orc::ThreadSafeContext context(std::make_unique<LLVMContext>());
+    // the pass pipeline is built once and reused for every module
+    auto engine = Engine::create(engineOptions);
+    if (!engine) {
+        llvm::errs() << toString(engine.takeError()) << "\n";
+        return -1;
+    }
+    auto &jit       = (*engine)->getJIT();
+    auto &context   = (*engine)->getContext();
+    auto &optimiser = (*engine)->getOptimiser();
 
     // in ORCJit, you have to create a dynamic library to add/remove modules
-    auto jit = cantFail(orc::LLJITBuilder().create());
-    auto &dyLib = cantFail(jit->createJITDylib("jitCalc_dyLib"));
+    auto &dyLib = cantFail((*engine)->createDyLib("jitCalc_dyLib"));
+    runtime::setNumThreads(numThreads);
+    runtime::setBinaryOutput(binaryOutput);
+    runtime::setProfileStacks(!profileFolded.empty(), !profileTrace.empty());
+
+    // a document is written per program, batch or REPL cell
+    std::optional<raw_fd_ostream> statsFile;
+    std::optional<CompileStats>   compileStats;
+    if (!statsJsonFile.empty()) {
+        std::error_code errorCode;
+        statsFile.emplace(statsJsonFile, errorCode, sys::fs::OF_Text);
+        if (errorCode) {
+            llvm::errs() << "Cannot write " << statsJsonFile << ": " << errorCode.message() << "\n";
+            return -1;
+        }
+        compileStats.emplace();
+        optimiser.setStats(&*compileStats);
+
+        // every object the JIT compiles passes through the transform layer before it is linked
+        jit.getObjTransformLayer().setTransform(
+            [stats = &*compileStats](std::unique_ptr<MemoryBuffer> object) -> Expected<std::unique_ptr<MemoryBuffer>> {
+                stats->recordObject(*object);
+                return std::move(object);
+            });
+    }
+    auto *stats = compileStats ? &*compileStats : nullptr;
+
+    if (batchMode) {
+        auto buffer = (inputFile.empty() || inputFile == "-")
+            ? llvm::MemoryBuffer::getSTDIN()
+            : llvm::MemoryBuffer::getFile(inputFile);
+        if (!buffer) {
+            llvm::errs() << "Cannot read batch input: " << buffer.getError().message() << "\n";
+            return -1;
+        }
+
+        Sparse<ast::Node>::Key programKey;
+        Sparse<ast::Node> *prog;
+        {
+            PhaseTimers::Scope scope(timers, PhaseTimers::Parsing);
+            prog = parse(programKey, **buffer);
+        }
+        if (prog == nullptr) {
+            return -1;
+        }
+        if (stats != nullptr) {
+            stats->recordAst(programKey, *prog);
+        }
 
-    //cantFail(jit->addObjectFile(dyLib, std::move(*MemoryBuffer::getFile("../passes/ppprofiler_runtime.o"))));
+        auto batch = compileBatch(jit, dyLib, context, optimiser, emitOptions, programKey, *prog, timers);
+        if (!batch) {
+            llvm::errs() << toString(batch.takeError()) << "\n";
+            return -1;
+        }
 
-    std::vector<std::pair<std::string, ObjFunc>> funcDefs;
+        std::vector<int32_t> results;
+        std::vector<uint8_t> failed;
+        {
+            PhaseTimers::Scope scope(timers, PhaseTimers::Executing);
+            runBatch(*batch, results, failed);
+            runtime::drainProfile();
+            outputResults(results, failed);
+        }
 
-    if (not replMode) {
+        cantFail(batch->tracker->remove());
+    } else if (not replMode) {
         auto filePath = llvm::SmallString<128>(inputFile);
         assert(!llvm::sys::fs::make_absolute(filePath));
 
@@ -94,19 +369,40 @@ int main(int argc, char **argv) {
 
 
         Sparse<ast::Node>::Key programKey;
-        auto *prog = parse(programKey, *buffer);
+        Sparse<ast::Node> *prog;
+        {
+            PhaseTimers::Scope scope(timers, PhaseTimers::Parsing);
+            prog = parse(programKey, *buffer);
+        }
         assert(nullptr != prog);
+        if (stats != nullptr) {
+            stats->recordAst(programKey, *prog);
+        }
 
         auto lock = context.getLock();
-        Emit emit(*context.getContext(), "jitCalc_child", "main", filePath.c_str());
+        Emit emit(*context.getContext(), "jitCalc_child", "main", emitOptions, filePath.c_str());
 
-        emit.emitProgram(programKey, *prog);
-        emit.mod().finaliseDebug();
+        {
+            PhaseTimers::Scope scope(timers, PhaseTimers::Emitting);
+            emit.emitProgram(programKey, *prog);
+            emit.mod().finaliseDebug();
+        }
+        if (auto err = emit.takeError()) {
+            llvm::errs() << toString(std::move(err)) << "\n";
+            return -1;
+        }
 
         puts("");
-        emit.mod().verifyModule();
-        emit.mod().optimiseModule();
+        {
+            PhaseTimers::Scope scope(timers, PhaseTimers::Verifying);
+            emit.mod().verifyModule();
+        }
+        {
+            PhaseTimers::Scope scope(timers, PhaseTimers::Optimising);
+            emit.mod().optimiseModule(optimiser);
+        }
         emit.mod().printModule();
+        outs().flush(); // results are written to the file descriptor, after the module
 
         if (emitLlFile) {
             auto llFilePath = filePath;
@@ -117,46 +413,110 @@ int main(int argc, char **argv) {
             assert(!errorCode);
             emit.mod().getLlModule().print(llFile, nullptr);
         } else {
+            // the counters are read before the code is freed
+            std::optional<PGOProfile> pgoProfile;
+            if (!genProfile.empty()) {
+                pgoProfile.emplace();
+                pgoProfile->addModule(emit.mod().getLlModule());
+            }
+            std::optional<LineCounts> lineCounts;
+            if (!lineCountsFile.empty()) {
+                lineCounts.emplace();
+                lineCounts->addModule(emit.mod().getLlModule());
+            }
+
             auto tracker = dyLib.createResourceTracker();
-            cantFail(jit->addIRModule(tracker, orc::ThreadSafeModule(emit.mod().moveModule(), context)));
-            auto symbol = cantFail(jit->lookup(dyLib, "main"));
-            auto funcPtr = symbol.toPtr<void(*)()>();
-            funcPtr();
+            void (*funcPtr)();
+            {
+                PhaseTimers::Scope scope(timers, PhaseTimers::Materialising);
+                cantFail(jit.addIRModule(tracker, orc::ThreadSafeModule(emit.mod().moveModule(), context)));
+                auto symbol = cantFail(jit.lookup(dyLib, "main"));
+                funcPtr = symbol.toPtr<void(*)()>();
+            }
+            {
+                PhaseTimers::Scope scope(timers, PhaseTimers::Executing);
+                runJitted(funcPtr);
+            }
+            if (pgoProfile) {
+                auto err = pgoProfile->readCounters(jit, dyLib);
+                if (!err) {
+                    err = pgoProfile->write(genProfile);
+                }
+                if (err) {
+                    llvm::errs() << toString(std::move(err)) << "\n";
+                }
+            }
+            if (lineCounts) {
+                writeLineCounts(*lineCounts, jit, dyLib, buffer->getBuffer());
+            }
             cantFail(tracker->remove());
         }
     } else {
-        for (int i = 0;; i++) {
+        SessionOptions sessionOptions;
+        sessionOptions.emit            = emitOptions;
+        sessionOptions.crossCellInline = crossCellInline;
+        sessionOptions.hotSwap         = hotSwap;
+        sessionOptions.relinkAfter     = relinkAfter;
+        sessionOptions.interpret       = interpret;
+        sessionOptions.tierUpAfter     = tierUpAfter;
+        sessionOptions.timers          = timers;
+
+        Session session(jit, dyLib, context, optimiser, sessionOptions);
+        for (size_t cell = 0;; cell++) {
             auto buffer = getNextInput();
             if (buffer->getBuffer() == "q") {
                 break;
             }
 
             Sparse<ast::Node>::Key programKey;
-            auto *prog = parse(programKey, *buffer);
+            Sparse<ast::Node> *prog;
+            {
+                PhaseTimers::Scope scope(timers, PhaseTimers::Parsing);
+                prog = parse(programKey, *buffer);
+            }
             if (prog == nullptr) {
                 continue;
             }
+            if (stats != nullptr) {
+                stats->recordAst(programKey, *prog);
+            }
 
-            auto lock = context.getLock();
-            std::string funcName = "main" + std::to_string(i);
-            Emit emit(*context.getContext(), "jitCalc_child", funcName);
-            emit.addFuncDefs(funcDefs);
-
-            emit.emitProgram(programKey, *prog);
-
-            emit.mod().printModule();
-            emit.mod().verifyModule();
-            emit.mod().optimiseModule();
-
-            funcDefs = emit.getFuncDefs();
+            if (auto startFunc = session.addCell(programKey, *prog); startFunc != nullptr) {
+                {
+                    PhaseTimers::Scope scope(timers, PhaseTimers::Executing);
+                    runJitted(startFunc);
+                }
+                session.endCell();
+            }
+            if (timePhases) {
+                phaseTimers->report(errs(), "cell " + std::to_string(cell));
+            }
+            if (stats != nullptr) {
+                stats->write(*statsFile, "cell " + std::to_string(cell));
+            }
+        }
+    }
 
-            auto tracker = dyLib.createResourceTracker();
-            cantFail(jit->addIRModule(tracker, orc::ThreadSafeModule(emit.mod().moveModule(), context)));
-            auto symbol = cantFail(jit->lookup(dyLib, funcName.c_str()));
-            auto funcPtr = symbol.toPtr<void(*)()>();
-            funcPtr();
-            //cantFail(tracker->remove());
+    if (timePhases && !replMode) {
+        phaseTimers->report(errs(), batchMode ? "batch" : inputFile.getValue());
+    }
+    if (profile) {
+        runtime::reportProfile(stderr);
+    }
+    if (!profileFolded.empty()) {
+        writeProfile(profileFolded, runtime::writeFoldedStacks);
+    }
+    if (!profileTrace.empty()) {
+        writeProfile(profileTrace, runtime::writeTrace);
+    }
+    if (stats != nullptr && !replMode) {
+        stats->write(*statsFile, batchMode ? "batch" : inputFile.getValue());
+    }
+    if (!timeTraceFile.empty()) {
+        if (auto err = timeTraceProfilerWrite(timeTraceFile, "jitCalc")) {
+            llvm::errs() << toString(std::move(err)) << "\n";
         }
+        timeTraceProfilerCleanup();
     }
 
 
@@ -3,6 +3,86 @@
 
 using namespace ast;
 
+std::vector<Sparse<Node>::Key> ast::children(const Node &node) {
+    if (auto *list = std::get_if<List>(&node)) {
+        return list->list;
+    } else if (auto *program = std::get_if<Program>(&node)) {
+        return {program->stmtList};
+    } else if (auto *prefix = std::get_if<Prefix>(&node)) {
+        return {prefix->right};
+    } else if (auto *infix = std::get_if<Infix>(&node)) {
+        return {infix->left, infix->right};
+    } else if (auto *ret = std::get_if<Return>(&node)) {
+        return {ret->expr};
+    } else if (auto *call = std::get_if<Call>(&node)) {
+        return {call->args};
+    } else if (auto *fnDef = std::get_if<FnDef>(&node)) {
+        return {fnDef->args, fnDef->body};
+    } else if (auto *if_ = std::get_if<If>(&node)) {
+        return {if_->cnd, if_->trueBody, if_->falseBody};
+    } else if (auto *let = std::get_if<Let>(&node)) {
+        return {let->expr};
+    } else if (auto *set = std::get_if<Set>(&node)) {
+        return {set->expr};
+    } else if (auto *for_ = std::get_if<For>(&node)) {
+        return {for_->cnd, for_->body};
+    } else if (auto *index = std::get_if<Index>(&node)) {
+        return {index->index};
+    } else if (auto *setIndex = std::get_if<SetIndex>(&node)) {
+        return {setIndex->index, setIndex->expr};
+    } else if (auto *forIn = std::get_if<ForIn>(&node)) {
+        return {forIn->iter, forIn->body};
+    } else if (auto *range = std::get_if<Range>(&node)) {
+        return {range->lo, range->hi};
+    }
+
+    // Integer, Ident, ArrayArg
+    return {};
+}
+
+bool ast::hasSelfTailCall(Sparse<Node> &ast, Sparse<Node>::Key key, const std::string &name) {
+    auto &node = ast.at(key);
+    if (std::holds_alternative<FnDef>(node)) {
+        return false;
+    }
+    if (auto *return_ = std::get_if<Return>(&node); return_ != nullptr) {
+        auto *call = std::get_if<Call>(&ast.at(return_->expr));
+        return call != nullptr && call->name == name;
+    }
+
+    for (auto child : children(node)) {
+        if (hasSelfTailCall(ast, child, name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool ast::hasDivide(Sparse<Node> &ast, Sparse<Node>::Key key) {
+    auto &node = ast.at(key);
+    if (std::holds_alternative<FnDef>(node)) {
+        return false;
+    }
+    if (auto *infix = std::get_if<Infix>(&node); infix != nullptr && infix->op == Divide) {
+        return true;
+    }
+
+    for (auto child : children(node)) {
+        if (hasDivide(ast, child)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool ast::isBuiltinName(const std::string &name) {
+    return name == "len" || name == "sum" || name == "min" || name == "max" || name == "count"
+        || name == "array";
+}
+
+
 //std::ostream& operator<<(std::ostream& os, const Expression& expression) {
 //    if (std::holds_alternative<Integer>(expression)) {
 //        os << "Integer(" << std::get<Integer>(expression) << ")";
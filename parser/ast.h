@@ -26,9 +26,14 @@ struct If;
 struct Let;
 struct Set;
 struct For;
+struct Index;
+struct SetIndex;
+struct ForIn;
+struct ArrayArg;
+struct Range;
 
 using Node = std::variant<Program, List, Integer, Prefix, Infix, Return, Ident, Call, FnDef, If,
-    Let, Set, For>;
+    Let, Set, For, Index, SetIndex, ForIn, ArrayArg, Range>;
 
 // a class to represent a list of nodes such as a comma-separated list of expressions.
 struct List {
@@ -39,6 +44,7 @@ public:
     List(TextPos pos, Sparse<Node>::Key item) : pos(pos) { list.push_back(item); }
 
     void cons(Sparse<Node>::Key item) { list.insert(list.begin(), item); }
+    void append(Sparse<Node>::Key item) { list.push_back(item); }
     size_t size() { return list.size(); }
 
     std::vector< Sparse<Node>::Key > list;
@@ -123,11 +129,12 @@ struct Call {
 struct FnDef {
     FnDef& operator=(const FnDef&) = default;
 
-    FnDef(TextPos pos, const std::string &name, Sparse<Node>::Key args, Sparse<Node>::Key body)
-            : pos(pos), name(name), args(args), body(body) {}
+    FnDef(TextPos pos, const std::string &name, Sparse<Node>::Key args, Sparse<Node>::Key body, bool memo = false)
+            : pos(pos), name(name), args(args), body(body), memo(memo) {}
 
     std::string name;
     Sparse<Node>::Key args, body;
+    bool memo; // 'memo fn', results are cached by argument
     TextPos pos;
 };
 
@@ -176,5 +183,83 @@ struct For {
     Sparse<Node>::Key cnd, body;
     TextPos pos;
 };
+
+
+// a[i], reads one element of an array
+struct Index {
+    Index& operator=(const Index&) = default;
+
+    Index(TextPos pos, std::string &name, Sparse<Node>::Key index)
+        : pos(pos), name(name), index(index) {}
+
+    std::string name;
+    Sparse<Node>::Key index;
+    TextPos pos;
+};
+
+
+// a[i] = expr
+struct SetIndex {
+    SetIndex& operator=(const SetIndex&) = default;
+
+    SetIndex(TextPos pos, std::string &name, Sparse<Node>::Key index, Sparse<Node>::Key expr)
+        : pos(pos), name(name), index(index), expr(expr) {}
+
+    std::string name;
+    Sparse<Node>::Key index, expr;
+    TextPos pos;
+};
+
+
+// for i in a, binds i to each index of the array a or each value of a range. pfor runs the
+// iterations in parallel.
+struct ForIn {
+    ForIn& operator=(const ForIn&) = default;
+
+    ForIn(TextPos pos, std::string &name, Sparse<Node>::Key iter, Sparse<Node>::Key body, bool parallel = false)
+        : pos(pos), name(name), iter(iter), body(body), parallel(parallel) {}
+
+    std::string name;
+    Sparse<Node>::Key iter, body;
+    TextPos pos;
+    bool parallel;
+};
+
+
+// a[] in the argument list of a function
+struct ArrayArg {
+    ArrayArg& operator=(const ArrayArg&) = default;
+
+    ArrayArg(TextPos pos, const std::string &ident) : pos(pos), ident(ident) {}
+    std::string ident;
+    TextPos pos;
+};
+
+
+// lo..hi step n, the step is a constant so the loop direction is known when it is compiled
+struct Range {
+    Range& operator=(const Range&) = default;
+
+    Range(TextPos pos, Sparse<Node>::Key lo, Sparse<Node>::Key hi, int step)
+        : pos(pos), lo(lo), hi(hi), step(step) {}
+
+    Sparse<Node>::Key lo, hi;
+    int step;
+    TextPos pos;
+};
+
+
+// returns the keys of the direct children of a node, for analyses which walk the tree.
+std::vector<Sparse<Node>::Key> children(const Node &node);
+
+// true if a return in the statements directly returns a call to name, nested functions are not searched.
+bool hasSelfTailCall(Sparse<Node> &ast, Sparse<Node>::Key key, const std::string &name);
+
+// true if the statements contain a division, nested functions are not searched.
+bool hasDivide(Sparse<Node> &ast, Sparse<Node>::Key key);
+
+// true for len, sum, min, max, count and array. A function defined with one of these names
+// replaces the builtin.
+bool isBuiltinName(const std::string &name);
 }
 
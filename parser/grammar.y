@@ -34,9 +34,9 @@ using namespace ast;
 
 
 %token NEWLINE INDENT DEDENT INTEGER FLOATING ident
-%token fn If Else Return Let For
-%token '(' ')' ','
-%token '+' '-' '*' '/' '<' '>' EqEq
+%token fn If Else Return Let For In Memo Pfor Step
+%token '(' ')' '[' ']' ','
+%token '+' '-' '*' '/' '<' '>' EqEq DotDot
 
 // precedence rules
 %left EqEq
@@ -49,8 +49,9 @@ using namespace ast;
 
 program : topStmts1 { astResultProgramKey = astResult.insert(Program(textPos(@1), $1)); };
 
+// left recursive so long batch inputs are appended in constant time with a shallow stack
 topStmts1 : topStmt           { $$ = astResult.insert(List(textPos(@1), $1)); }
-          | topStmt topStmts1 { ((ast::List*)&astResult.at($2))->cons($1); $$ = $2; };
+          | topStmts1 topStmt { ((ast::List*)&astResult.at($1))->append($2); $$ = $1; };
 
 topStmt : expr NEWLINE { $$ = $1; }
         | block        { $$ = $1; };
@@ -69,7 +70,8 @@ expr
     | '(' expr ')'         { $$ = $2; }
     | ident                { $$ = $1; }
     | ident '(' exprs1 ')' { $$ = astResult.insert(Call(textPos(@2), ((ast::Ident*)&astResult.at($1))->ident, $3)); astResult.remove($1); }
-    | ident '(' ')'        { $$ = astResult.insert(Call(textPos(@2), ((ast::Ident*)&astResult.at($1))->ident, astResult.insert(List(textPos(@2))))); astResult.remove($1); };
+    | ident '(' ')'        { $$ = astResult.insert(Call(textPos(@2), ((ast::Ident*)&astResult.at($1))->ident, astResult.insert(List(textPos(@2))))); astResult.remove($1); }
+    | ident '[' expr ']'   { $$ = astResult.insert(Index(textPos(@2), ((ast::Ident*)&astResult.at($1))->ident, $3)); astResult.remove($1); };
 
 //    // error ast node can go here
 //    //| error               { llvm::errs() << "syntax error in expr\n"; yyclearin; };
@@ -78,17 +80,35 @@ expr
 line
     : Return expr        { $$ = astResult.insert(Return(textPos(@1), $2)); }
     | ident '=' expr     { $$ = astResult.insert(Set(textPos(@2), ((ast::Ident*)&astResult.at($1))->ident, $3)); astResult.remove($1); }
+    | ident '[' expr ']' '=' expr
+        { $$ = astResult.insert(SetIndex(textPos(@5), ((ast::Ident*)&astResult.at($1))->ident, $3, $6)); astResult.remove($1); }
     | Let ident '=' expr { $$ = astResult.insert(Let(textPos(@1), ((ast::Ident*)&astResult.at($2))->ident, $4)); astResult.remove($2); };
 
 block
     : fn ident '(' idents ')' INDENT stmts1 DEDENT
         { $$ = astResult.insert(FnDef(textPos(@1), ((ast::Ident*)&astResult.at($2))->ident, $4, $7)); astResult.remove($2); }
+    | Memo fn ident '(' idents ')' INDENT stmts1 DEDENT
+        { $$ = astResult.insert(FnDef(textPos(@1), ((ast::Ident*)&astResult.at($3))->ident, $5, $8, true)); astResult.remove($3); }
     | If expr INDENT stmts1 DEDENT
         { $$ = astResult.insert(If(textPos(@1), $2, $4, astResult.insert(List(textPos(@1))))); }
     | If expr INDENT stmts1 DEDENT Else INDENT stmts1 DEDENT
         { $$ = astResult.insert(If(textPos(@1), $2, $4, $8)); }
     | For expr INDENT stmts1 DEDENT 
-        { $$ = astResult.insert(For(textPos(@1), $2, $4)); };
+        { $$ = astResult.insert(For(textPos(@1), $2, $4)); }
+    | For ident In iter INDENT stmts1 DEDENT
+        { $$ = astResult.insert(ForIn(textPos(@1), ((ast::Ident*)&astResult.at($2))->ident, $4, $6)); astResult.remove($2); }
+    | Pfor ident In iter INDENT stmts1 DEDENT
+        { $$ = astResult.insert(ForIn(textPos(@1), ((ast::Ident*)&astResult.at($2))->ident, $4, $6, true)); astResult.remove($2); };
+
+// an array, or a range with a constant step
+iter
+    : expr { $$ = $1; }
+    | expr DotDot expr
+        { $$ = astResult.insert(Range(textPos(@2), $1, $3, 1)); }
+    | expr DotDot expr Step INTEGER
+        { $$ = astResult.insert(Range(textPos(@2), $1, $3, ((ast::Integer*)&astResult.at($5))->integer)); astResult.remove($5); }
+    | expr DotDot expr Step '-' INTEGER
+        { $$ = astResult.insert(Range(textPos(@2), $1, $3, -((ast::Integer*)&astResult.at($6))->integer)); astResult.remove($6); };
 
 stmts1
     : line NEWLINE        { $$ = astResult.insert(List(textPos(@1), $1)); }
@@ -101,8 +121,11 @@ idents
     : idents1 { $$ = $1; }
     |         { $$ = astResult.insert(List(TextPos(0, 0, 0))); };
 idents1
-    : ident             { $$ = astResult.insert(List(textPos(@1), $1)); }
-    | ident ',' idents1 { ((ast::List*)&astResult.at($3))->cons($1); $$ = $3; };
+    : arg             { $$ = astResult.insert(List(textPos(@1), $1)); }
+    | arg ',' idents1 { ((ast::List*)&astResult.at($3))->cons($1); $$ = $3; };
+arg
+    : ident         { $$ = $1; }
+    | ident '[' ']' { $$ = astResult.insert(ArrayArg(textPos(@1), ((ast::Ident*)&astResult.at($1))->ident)); astResult.remove($1); };
 
 
 exprs1
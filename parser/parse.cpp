@@ -47,6 +47,14 @@ int yylex(yy::parser::semantic_type *un, yy::parser::location_type *yyloc) {
             return yy::parser::token::Let;
         } else if (token.str == "for") {
             return yy::parser::token::For;
+        } else if (token.str == "in") {
+            return yy::parser::token::In;
+        } else if (token.str == "memo") {
+            return yy::parser::token::Memo;
+        } else if (token.str == "pfor") {
+            return yy::parser::token::Pfor;
+        } else if (token.str == "step") {
+            return yy::parser::token::Step;
         }
         assert(false);
         break;
@@ -69,6 +77,10 @@ int yylex(yy::parser::semantic_type *un, yy::parser::location_type *yyloc) {
             return '(';
         } else if (token.str == ")") {
             return ')';
+        } else if (token.str == "[") {
+            return '[';
+        } else if (token.str == "]") {
+            return ']';
         } else if (token.str == "=") {
             return '=';
         } else if (token.str == ",") {
@@ -79,6 +91,8 @@ int yylex(yy::parser::semantic_type *un, yy::parser::location_type *yyloc) {
             return '>';
         } else if (token.str == "==") {
             return yy::parser::token::EqEq;
+        } else if (token.str == "..") {
+            return yy::parser::token::DotDot;
         }
         assert(false);
         break;
@@ -0,0 +1,98 @@
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DebugProgramInstruction.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "BlockCounters.h"
+#include "Instrumented.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "blockcounters"
+
+ALWAYS_ENABLED_STATISTIC(NumOfBlocks, "Number of counted blocks.");
+
+namespace {
+class BlockCountersPass : public llvm::PassInfoMixin<BlockCountersPass> {
+public:
+    llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &AM);
+};
+
+
+// the lines of the instructions and variable locations in a block
+static SmallSetVector<unsigned, 4> blockLines(BasicBlock &BB) {
+    SmallSetVector<unsigned, 4> Lines;
+    auto Add = [&Lines](const DebugLoc &Loc) {
+        if (Loc && Loc.getLine() != 0) {
+            Lines.insert(Loc.getLine());
+        }
+    };
+    for (Instruction &I : BB) {
+        Add(I.getDebugLoc());
+        for (DbgRecord &DR : I.getDbgRecordRange()) {
+            Add(DR.getDebugLoc());
+        }
+    }
+    return Lines;
+}
+
+
+PreservedAnalyses BlockCountersPass::run(Module &M, ModuleAnalysisManager &AM) {
+    if (M.getGlobalVariable(BLOCK_COUNTERS_NAME)) {
+        return PreservedAnalyses::all();
+    }
+
+    LLVMContext &Ctx = M.getContext();
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+
+    SmallVector<BasicBlock *, 64> Blocks;
+    SmallVector<Metadata *, 64> LinesByCounter;
+    for (Function &F : M) {
+        // bodies imported from earlier REPL cells are counted where they are defined
+        if (F.isDeclaration() || F.hasAvailableExternallyLinkage()) {
+            continue;
+        }
+        for (BasicBlock &BB : F) {
+            auto Lines = blockLines(BB);
+            if (Lines.empty()) {
+                continue;
+            }
+
+            SmallVector<Metadata *, 4> LineMDs;
+            for (unsigned Line : Lines) {
+                LineMDs.push_back(ConstantAsMetadata::get(ConstantInt::get(Type::getInt32Ty(Ctx), Line)));
+            }
+            LinesByCounter.push_back(MDTuple::get(Ctx, LineMDs));
+            Blocks.push_back(&BB);
+        }
+    }
+    if (Blocks.empty()) {
+        return PreservedAnalyses::all();
+    }
+    dropMemoryAttrs(M);
+
+    auto *CountersTy = ArrayType::get(Int64Ty, Blocks.size());
+    auto *Counters = new GlobalVariable(M, CountersTy, false, GlobalValue::ExternalLinkage,
+        Constant::getNullValue(CountersTy), BLOCK_COUNTERS_NAME);
+    Counters->setAlignment(Align(8));
+    Counters->setMetadata(BLOCK_COUNTERS_MD, MDTuple::get(Ctx, LinesByCounter));
+
+    for (size_t I = 0; I < Blocks.size(); I++) {
+        IRBuilder<> Builder(&*Blocks[I]->getFirstInsertionPt());
+        Value *Addr = Builder.CreateConstInBoundsGEP2_64(CountersTy, Counters, 0, I);
+        Builder.CreateAtomicRMW(AtomicRMWInst::Add, Addr, Builder.getInt64(1), MaybeAlign(8),
+            AtomicOrdering::Monotonic);
+        NumOfBlocks++;
+    }
+
+    return PreservedAnalyses::none();
+}
+
+}
+
+
+void addBlockCountersPass(ModulePassManager &MPM) {
+    MPM.addPass(BlockCountersPass());
+}
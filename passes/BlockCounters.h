@@ -0,0 +1,17 @@
+#ifndef BLOCKCOUNTERS_H
+#define BLOCKCOUNTERS_H
+
+#include "llvm/Passes/PassBuilder.h"
+
+// The counters of a module are an external i64 array with this name. Its BLOCK_COUNTERS_MD
+// node has an operand per counter, the tuple of source lines of the counted block.
+#define BLOCK_COUNTERS_NAME "__jc_blockcounts"
+#define BLOCK_COUNTERS_MD   "jc.blockcounts"
+
+// adds the pass which counts the executions of each basic block with a debug location,
+// before the pipeline so that blocks still map to the source. Functions and calls lose
+// memory(none) and willreturn, so no call is hoisted or merged away from its count. The
+// counts are updated atomically, as pfor workers run the same blocks.
+void addBlockCountersPass(llvm::ModulePassManager &MPM);
+
+#endif
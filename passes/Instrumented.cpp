@@ -0,0 +1,20 @@
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "Instrumented.h"
+
+using namespace llvm;
+
+void dropMemoryAttrs(Module &M) {
+    for (Function &F : M) {
+        if (!F.isIntrinsic()) {
+            F.removeFnAttr(Attribute::Memory);
+            F.removeFnAttr(Attribute::WillReturn);
+        }
+        for (Instruction &I : instructions(F)) {
+            if (auto *Call = dyn_cast<CallBase>(&I); Call != nullptr && !isa<IntrinsicInst>(Call)) {
+                Call->removeFnAttr(Attribute::Memory);
+                Call->removeFnAttr(Attribute::WillReturn);
+            }
+        }
+    }
+}
@@ -0,0 +1,12 @@
+#ifndef INSTRUMENTED_H
+#define INSTRUMENTED_H
+
+#include "llvm/IR/Module.h"
+
+// Emit marks functions and their calls memory(none) and willreturn when it can, which stops
+// being true once counters are stored in them. Passes which add counters before the pipeline
+// call this first, so the calls can't be hoisted, merged or removed and the stores aren't
+// undefined behaviour. Intrinsics keep their attributes.
+void dropMemoryAttrs(llvm::Module &M);
+
+#endif
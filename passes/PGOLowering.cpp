@@ -0,0 +1,106 @@
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "Instrumented.h"
+#include "PGOLowering.h"
+
+using namespace llvm;
+
+namespace {
+class PGOLoweringPass : public llvm::PassInfoMixin<PGOLoweringPass> {
+public:
+    llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &AM);
+
+private:
+    GlobalVariable *getCounters(Module &M, InstrProfIncrementInst *Inc);
+
+    DenseMap<GlobalVariable *, GlobalVariable *> CountersByName;
+};
+
+
+GlobalVariable *PGOLoweringPass::getCounters(Module &M, InstrProfIncrementInst *Inc) {
+    auto *NameVar = cast<GlobalVariable>(Inc->getArgOperand(0)->stripPointerCasts());
+    if (GlobalVariable *Counters = CountersByName.lookup(NameVar)) {
+        return Counters;
+    }
+
+    StringRef PGOName = cast<ConstantDataArray>(NameVar->getInitializer())->getAsString();
+    uint64_t NumCounters = Inc->getNumCounters()->getZExtValue();
+
+    auto *CountersTy = ArrayType::get(Type::getInt64Ty(M.getContext()), NumCounters);
+    auto *Counters = new GlobalVariable(
+        M,
+        CountersTy,
+        false,
+        GlobalValue::ExternalLinkage,
+        Constant::getNullValue(CountersTy),
+        PGO_COUNTER_PREFIX + PGOName);
+    Counters->setAlignment(Align(8));
+
+    LLVMContext &Ctx = M.getContext();
+    Counters->setMetadata(PGO_COUNTER_MD, MDNode::get(Ctx, {
+        MDString::get(Ctx, PGOName),
+        ConstantAsMetadata::get(Inc->getHash()),
+    }));
+
+    CountersByName[NameVar] = Counters;
+    return Counters;
+}
+
+
+PreservedAnalyses PGOLoweringPass::run(Module &M, ModuleAnalysisManager &AM) {
+    CountersByName.clear();
+
+    SmallVector<InstrProfInstBase *, 64> Insts;
+    for (Function &F : M) {
+        for (Instruction &I : instructions(F)) {
+            if (auto *Inst = dyn_cast<InstrProfInstBase>(&I)) {
+                Insts.push_back(Inst);
+            }
+        }
+    }
+
+    if (!Insts.empty()) {
+        dropMemoryAttrs(M);
+    }
+
+    // pfor bodies and the functions they call run on the pool's threads, so the counters are
+    // updated with atomics, as with -instrprof-atomic-counter-update-all
+    for (InstrProfInstBase *Inst : Insts) {
+        if (auto *Inc = dyn_cast<InstrProfIncrementInst>(Inst)) {
+            GlobalVariable *Counters = getCounters(M, Inc);
+            IRBuilder<> Builder(Inc);
+            Value *Addr = Builder.CreateConstInBoundsGEP2_32(
+                Counters->getValueType(), Counters, 0, Inc->getIndex()->getZExtValue());
+            Builder.CreateAtomicRMW(AtomicRMWInst::Add, Addr,
+                Builder.CreateZExtOrTrunc(Inc->getStep(), Builder.getInt64Ty()), MaybeAlign(8),
+                AtomicOrdering::Monotonic);
+        }
+        Inst->eraseFromParent();
+    }
+
+    // the names were only needed by the increments, the version and file name variables are
+    // read by compiler-rt which isn't linked
+    for (const char *Name : {"__llvm_profile_raw_version", "__llvm_profile_filename"}) {
+        if (GlobalVariable *GV = M.getGlobalVariable(Name, true); GV && GV->use_empty()) {
+            GV->eraseFromParent();
+        }
+    }
+    for (auto &[NameVar, Counters] : CountersByName) {
+        if (NameVar->use_empty()) {
+            NameVar->eraseFromParent();
+        }
+    }
+
+    return Insts.empty() ? PreservedAnalyses::all() : PreservedAnalyses::none();
+}
+
+}
+
+
+void addPGOLoweringPass(ModulePassManager &MPM) {
+    MPM.addPass(PGOLoweringPass());
+}
@@ -0,0 +1,17 @@
+#ifndef PGOLOWERING_H
+#define PGOLOWERING_H
+
+#include "llvm/Passes/PassBuilder.h"
+
+// Counter arrays of lowered PGO instrumentation are external globals with this prefix
+// followed by the PGO name of the function. Each has a PGOCounterMD node holding the name
+// and the CFG hash which the profile record needs.
+#define PGO_COUNTER_PREFIX "__jc_profc."
+#define PGO_COUNTER_MD     "jc.pgo"
+
+// adds the pass which lowers the llvm.instrprof.increment calls of PGOInstrumentationGen
+// to plain counter arrays, instead of the sections the compiler-rt profile runtime reads.
+// The counters are updated atomically and value profiling calls are removed.
+void addPGOLoweringPass(llvm::ModulePassManager &MPM);
+
+#endif
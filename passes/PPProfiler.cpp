@@ -1,5 +1,6 @@
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Passes/PassBuilder.h"
@@ -25,57 +26,70 @@ private:
 
 void PPProfilerIRPass::instrument(Function &F, Function *EnterFn, Function *ExitFn) {
     NumOfFunc++;
+    F.addFnAttr("ppprofiler");
 
-    IRBuilder<> Builder(&*F.getEntryBlock().begin());
+    IRBuilder<> Builder(&*F.getEntryBlock().getFirstInsertionPt());
 
-    GlobalVariable *FnName = Builder.CreateGlobalString(F.getName());
+    // the source name, the symbol may have been renamed, eg. by hot swapping. Functions
+    // which share a source name, like a memo wrapper and its body, are named by the emitter.
+    StringRef Name = F.getName();
+    if (F.hasFnAttribute("ppprofiler-name")) {
+        Name = F.getFnAttribute("ppprofiler-name").getValueAsString();
+    } else if (DISubprogram *SP = F.getSubprogram()) {
+        Name = SP->getName();
+    }
+    GlobalVariable *FnName = Builder.CreateGlobalString(Name);
 
     Builder.CreateCall(EnterFn->getFunctionType(), EnterFn, {FnName});
 
+    SmallVector<ReturnInst *, 4> Rets;
     for (BasicBlock &BB : F) {
-        for (Instruction &Inst : BB) {
-            if (Inst.getOpcode() == Instruction::Ret) {
-                Builder.SetInsertPoint(&Inst);
-                Builder.CreateCall(ExitFn->getFunctionType(), ExitFn, {FnName});
-            }
+        if (auto *Ret = dyn_cast<ReturnInst>(BB.getTerminator())) {
+            Rets.push_back(Ret);
         }
     }
-}
 
-PreservedAnalyses PPProfilerIRPass::run(llvm::Module &M, ModuleAnalysisManager &AM) {
-    if (M.getFunction("__ppp_enter") ||
-        M.getFunction("__ppp_exit")) {
-        return PreservedAnalyses::all();
+    // nothing may come between a musttail call and its return, the callee's frame replaces
+    // this one so the function exits before the call
+    for (ReturnInst *Ret : Rets) {
+        if (CallInst *MustTail = Ret->getParent()->getTerminatingMustTailCall()) {
+            Builder.SetInsertPoint(MustTail);
+        } else {
+            Builder.SetInsertPoint(Ret);
+        }
+        Builder.CreateCall(ExitFn->getFunctionType(), ExitFn, {FnName});
     }
+}
 
+PreservedAnalyses PPProfilerIRPass::run(llvm::Module &M, ModuleAnalysisManager &AM) {
     Type *VoidTy = Type::getVoidTy(M.getContext());
     PointerType *PtrTy = PointerType::getUnqual(M.getContext());
     FunctionType *EnterExitFty = FunctionType::get(VoidTy, {PtrTy}, false);
-    Function *EnterFn = Function::Create(
-        EnterExitFty,
-        GlobalValue::ExternalLinkage,
-        "__ppp_enter",
-        M
-    );
-    Function *ExitFn = Function::Create(
-        EnterExitFty,
-        GlobalVariable::ExternalLinkage,
-        "__ppp_exit",
-        M
-    );
+    auto *EnterFn = cast<Function>(M.getOrInsertFunction("__ppp_enter", EnterExitFty).getCallee());
+    auto *ExitFn = cast<Function>(M.getOrInsertFunction("__ppp_exit", EnterExitFty).getCallee());
 
+    // bodies imported from earlier REPL cells are already instrumented, as is anything this
+    // pass has seen before
+    bool Changed = false;
     for (auto &F : M.functions()) {
-        if (!F.isDeclaration() && F.hasName()) {
+        if (!F.isDeclaration() && F.hasName() && !F.hasAvailableExternallyLinkage()
+                && !F.hasFnAttribute("ppprofiler")) {
             instrument(F, EnterFn, ExitFn);
+            Changed = true;
         }
     }
 
-    return PreservedAnalyses::none();
+    return Changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
 }
     
 }
 
 
+void addPPProfilerPass(ModulePassManager &MPM) {
+    MPM.addPass(PPProfilerIRPass());
+}
+
+
 void RegisterCB(PassBuilder &PB) {
     PB.registerPipelineParsingCallback(
         [](StringRef Name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
@@ -5,4 +5,7 @@
 
 void RegisterCB(llvm::PassBuilder &PB);
 
+// adds the pass which calls __ppp_enter and __ppp_exit around the body of each function
+void addPPProfilerPass(llvm::ModulePassManager &MPM);
+
 #endif
@@ -0,0 +1,99 @@
+#include "output.h"
+
+#include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+namespace runtime {
+
+static bool binaryOutput = false;
+
+// room for the longest text record, "caught exception: -2147483648\n"
+static const size_t maxRecord = 48;
+
+
+struct OutputBuffer {
+    static const size_t capacity = 64 * 1024;
+
+    char   data[capacity];
+    size_t size = 0;
+
+    ~OutputBuffer() { flush(); }
+
+    void flush() {
+        if (size == 0) {
+            return;
+        }
+        fflush(stdout);
+
+        const char *ptr = data;
+        while (size > 0) {
+            ssize_t written = write(STDOUT_FILENO, ptr, size);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                break; // stdout is gone, drop the output
+            }
+            ptr  += written;
+            size -= written;
+        }
+        size = 0;
+    }
+
+    void append(const char *str, size_t len) {
+        memcpy(data + size, str, len);
+        size += len;
+    }
+};
+
+static thread_local OutputBuffer outputBuffer;
+
+
+void setBinaryOutput(bool binary) {
+    binaryOutput = binary;
+}
+
+
+void flushOutput() {
+    outputBuffer.flush();
+}
+
+}
+
+
+extern "C" void jc_output(int32_t kind, int32_t value) {
+    using namespace runtime;
+    auto &buffer = outputBuffer;
+    if (buffer.size + maxRecord > OutputBuffer::capacity) {
+        buffer.flush();
+    }
+
+    if (binaryOutput) {
+        int32_t record[2] = {kind, value};
+        buffer.append(reinterpret_cast<const char*>(record), sizeof(record));
+        return;
+    }
+
+    switch (kind) {
+    case OutputResult:
+        buffer.append("result: ", 8);
+        break;
+    case OutputException:
+        buffer.append("caught exception: ", 18);
+        break;
+    case OutputDivZero:
+        buffer.append("caught exception: division by zero\n", 35);
+        return;
+    default:
+        assert(false);
+    }
+
+    auto [end, error] = std::to_chars(buffer.data + buffer.size, buffer.data + OutputBuffer::capacity, value);
+    assert(error == std::errc());
+    buffer.size = end - buffer.data;
+    buffer.data[buffer.size++] = '\n';
+}
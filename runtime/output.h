@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+
+// Kinds of output record. As text they are printed as "result: n", "caught exception: n"
+// and "caught exception: division by zero".
+enum OutputKind : int32_t {
+    OutputResult    = 0,
+    OutputException = 1,
+    OutputDivZero   = 2,
+};
+
+// Appends a record to this thread's output buffer, which is written to stdout with one
+// write call when it fills, when it is flushed and when the thread exits. No locks are
+// taken, so buffers of different threads are only ordered by their flushes.
+extern "C" void jc_output(int32_t kind, int32_t value);
+
+namespace runtime {
+
+// Records are written as pairs of native-endian int32, kind then value, instead of text.
+void setBinaryOutput(bool binary);
+
+// Writes this thread's buffered output. stdio is flushed first so earlier printf output
+// stays in order.
+void flushOutput();
+
+}
@@ -0,0 +1,289 @@
+#include "parallel.h"
+#include "output.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool. Each thread owns a deque of chunks, it pops from the back of its own
+// and steals from the front of the others when it runs dry. Threads which aren't workers,
+// the main thread and any thread hosting an Engine, share deque 0 and accumulator row 0, so
+// they only ever run chunks of the pfor they started.
+
+namespace runtime {
+
+thread_local sigjmp_buf *trapJmpBuf = nullptr;
+
+// accumulator rows are padded to a cache line so workers don't share one
+static const size_t accRowInts = 16;
+
+// aim for this many chunks per thread so stealing can even out uneven iterations
+static const int32_t chunksPerThread = 8;
+
+static unsigned numThreadsRequested = 0;
+
+// 0 for threads outside the pool, workers are numbered from 1
+static thread_local size_t workerIndex = 0;
+
+
+struct Job {
+    PforBody body;
+    void     *env;
+    bool     trapping;
+    size_t   accStride;
+
+    std::vector<int32_t> acc; // one row per thread
+    std::atomic<int32_t> pending;
+    std::atomic<bool>    failed;
+    bool                 trapped = false;
+    int32_t              caught  = 0;
+    std::exception_ptr   error;
+    std::mutex           errorMutex;
+};
+
+
+struct Task {
+    Job     *job;
+    int32_t lo, hi;
+};
+
+
+struct WorkQueue {
+    std::mutex       mutex;
+    std::deque<Task> tasks;
+};
+
+
+class ThreadPool {
+public:
+    ThreadPool(unsigned numWorkers) : queues(numWorkers + 1) {
+        for (unsigned i = 0; i < numWorkers; i++) {
+            workers.emplace_back([this, i] { workerLoop(i + 1); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stop = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+
+    size_t numThreads() { return queues.size(); }
+
+    void push(size_t queue, const Task &task) {
+        {
+            std::lock_guard<std::mutex> lock(queues[queue].mutex);
+            queues[queue].tasks.push_back(task);
+        }
+        queued.fetch_add(1);
+    }
+
+    void notify() {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        wake.notify_all();
+    }
+
+    // runs queued chunks on the calling thread until job has none left running
+    void helpUntilDone(Job &job) {
+        Job *only = (workerIndex == 0) ? &job : nullptr;
+        while (job.pending.load(std::memory_order_acquire) > 0) {
+            Task task;
+            if (take(workerIndex, task, only)) {
+                run(task);
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+private:
+    std::vector<WorkQueue>   queues;
+    std::vector<std::thread> workers;
+    std::atomic<int64_t>     queued{0};
+
+    std::mutex              sleepMutex;
+    std::condition_variable wake;
+    bool                    stop = false;
+
+
+    void workerLoop(size_t index) {
+        workerIndex = index;
+        for (;;) {
+            Task task;
+            if (take(index, task)) {
+                run(task);
+                flushOutput();
+                drainProfile();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [this] { return stop || queued.load() > 0; });
+            if (stop) {
+                return;
+            }
+        }
+    }
+
+
+    // own queue from the back, everyone else's from the front. With only set just that
+    // job's chunks are taken.
+    bool take(size_t index, Task &task, Job *only = nullptr) {
+        for (size_t i = 0; i < queues.size(); i++) {
+            auto &queue = queues[(index + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) {
+                continue;
+            }
+
+            if (only != nullptr) {
+                auto it = std::find_if(queue.tasks.begin(), queue.tasks.end(),
+                    [only](const Task &queued) { return queued.job == only; });
+                if (it == queue.tasks.end()) {
+                    continue;
+                }
+                task = *it;
+                queue.tasks.erase(it);
+            } else if (i == 0) {
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+            } else {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+            queued.fetch_sub(1);
+            return true;
+        }
+        return false;
+    }
+
+
+    // chunks of a job which has failed are skipped, the job still counts them down. The
+    // first exception, thrown or caught by a chunk, is the one the job reports.
+    static void run(const Task &task) {
+        Job &job = *task.job;
+        if (!job.failed.load(std::memory_order_relaxed)) {
+            int32_t *acc = job.acc.data() + workerIndex * job.accStride;
+
+            if (job.trapping) {
+                sigjmp_buf buf;
+                sigjmp_buf *outer = trapJmpBuf;
+                trapJmpBuf = &buf;
+                if (sigsetjmp(buf, 1) == 0) {
+                    job.body(task.lo, task.hi, job.env, acc);
+                } else {
+                    std::lock_guard<std::mutex> lock(job.errorMutex);
+                    job.trapped = true;
+                    job.failed  = true;
+                }
+                trapJmpBuf = outer;
+            } else {
+                try {
+                    int32_t caught = job.body(task.lo, task.hi, job.env, acc);
+                    if (caught != 0) {
+                        std::lock_guard<std::mutex> lock(job.errorMutex);
+                        if (!job.error && job.caught == 0) {
+                            job.caught = caught;
+                        }
+                        job.failed = true;
+                    }
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(job.errorMutex);
+                    if (!job.error && job.caught == 0) {
+                        job.error = std::current_exception();
+                    }
+                    job.failed = true;
+                }
+            }
+        }
+
+        job.pending.fetch_sub(1, std::memory_order_release);
+    }
+};
+
+
+static ThreadPool& pool() {
+    static ThreadPool threadPool(numThreadsRequested != 0
+        ? numThreadsRequested
+        : std::max(1u, std::thread::hardware_concurrency()) - 1);
+    return threadPool;
+}
+
+
+void setNumThreads(unsigned numThreads) {
+    numThreadsRequested = numThreads;
+}
+
+}
+
+
+using namespace runtime;
+
+extern "C" int32_t jc_parallel_for(
+    PforBody body,
+    void     *env,
+    int32_t  lo,
+    int32_t  hi,
+    int32_t  numReductions,
+    int32_t  *result)
+{
+    std::fill(result, result + numReductions, 0);
+    if (hi <= lo) {
+        return 0;
+    }
+
+    auto &threads = pool();
+    size_t numThreads = threads.numThreads();
+
+    int64_t n = (int64_t)hi - lo;
+    int64_t chunk = std::max<int64_t>(1, n / (int64_t)(numThreads * chunksPerThread));
+    int64_t numChunks = (n + chunk - 1) / chunk;
+
+    Job job;
+    job.body      = body;
+    job.env       = env;
+    job.trapping  = trapJmpBuf != nullptr;
+    job.accStride = ((numReductions + accRowInts - 1) / accRowInts) * accRowInts;
+    job.acc.assign(numThreads * job.accStride, 0);
+    job.pending   = numChunks;
+    job.failed    = false;
+
+    // spread the chunks so every worker starts with local work
+    for (int64_t i = 0; i < numChunks; i++) {
+        int32_t chunkLo = lo + i * chunk;
+        int32_t chunkHi = (int32_t)std::min<int64_t>(hi, chunkLo + chunk);
+        threads.push((workerIndex + i) % numThreads, Task{&job, chunkLo, chunkHi});
+    }
+    threads.notify();
+    threads.helpUntilDone(job);
+
+    if (job.trapped) {
+        __builtin_trap();
+    }
+    if (job.error) {
+        std::rethrow_exception(job.error);
+    }
+    if (job.caught != 0) {
+        return job.caught;
+    }
+
+    for (size_t t = 0; t < numThreads; t++) {
+        for (int32_t k = 0; k < numReductions; k++) {
+            result[k] += job.acc[t * job.accStride + k];
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <setjmp.h>
+
+// An outlined pfor body. Runs the iterations [lo, hi) with the captured variables in env
+// and adds each of its reductions to acc[k]. Returns 0, or the payload of an exception
+// thrown by a function it called, which stops the chunk without printing it.
+using PforBody = int32_t (*)(int32_t lo, int32_t hi, void *env, int32_t *acc);
+
+// Splits [lo, hi) into chunks which are run on the thread pool, the calling thread takes
+// part until every chunk has finished. result[k] is set to the sum of reduction k over all
+// chunks. An exception thrown by a chunk is rethrown here once the others have stopped, a
+// trap is raised again on the calling thread. Returns 0, or the payload a chunk returned,
+// which the caller handles like an exception caught in a serial loop.
+extern "C" int32_t jc_parallel_for(
+    PforBody body,
+    void     *env,
+    int32_t  lo,
+    int32_t  hi,
+    int32_t  numReductions,
+    int32_t  *result);
+
+namespace runtime {
+
+// Number of worker threads besides the caller, 0 uses one per hardware thread. Only has
+// an effect before the first pfor runs.
+void setNumThreads(unsigned numThreads);
+
+// Jump buffer for the trap handler on this thread, null when division by zero throws
+// instead of trapping.
+extern thread_local sigjmp_buf *trapJmpBuf;
+
+}
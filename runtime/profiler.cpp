@@ -0,0 +1,338 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Each thread appends enter and exit events to a fixed buffer of its own. When it fills, the
+// thread folds the events into totals keyed by the address of the function name, keeping
+// a shadow stack of the calls in progress. Draining moves the totals to tables shared by
+// all threads, the only place a lock is taken.
+
+namespace runtime {
+
+// the time stamp counter where there is one, it is converted to time in the reports
+static inline uint64_t timestamp() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// the counter and the clock when the program started, to convert ticks to nanoseconds
+static const uint64_t startTicks = timestamp();
+static const auto     startClock = std::chrono::steady_clock::now();
+
+static double nsPerTick() {
+    double elapsedNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - startClock).count();
+    double elapsedTicks = double(timestamp() - startTicks);
+    return elapsedTicks > 0 ? elapsedNs / elapsedTicks : 0;
+}
+
+
+static const size_t maxTraceEvents = 1 << 20;
+
+static bool keepStacks = false;
+static bool keepTrace  = false;
+
+static std::atomic<uint32_t> numThreads{0};
+
+
+struct Totals {
+    uint64_t calls     = 0;
+    uint64_t inclusive = 0; // time of the outermost call when the function recurses
+    uint64_t exclusive = 0;
+};
+
+struct TraceEvent {
+    std::string name;
+    uint64_t    start, duration;
+    uint32_t    thread;
+};
+
+static std::mutex                      totalsMutex;
+static std::map<std::string, Totals>   totals;
+static std::map<std::string, uint64_t> stacks;   // exclusive ticks by folded stack
+static std::vector<TraceEvent>         trace;
+static bool                            traceTruncated = false;
+
+
+struct ProfileBuffer {
+    static const size_t capacity = 4096;
+
+    struct Event {
+        const char *name;
+        uint64_t    time;
+        bool        exit;
+    };
+
+    struct Frame {
+        const char *name;
+        uint64_t    start;
+        uint64_t    children = 0;
+        uint32_t    node     = 0; // in the calling context tree
+    };
+
+    struct FuncState {
+        Totals   totals;
+        uint32_t active = 0; // calls in progress
+    };
+
+    // a call stack, identified by the stack of its caller and the function called
+    struct ContextNode {
+        const char *name;
+        uint32_t    parent;
+        uint64_t    exclusive = 0;
+    };
+
+    struct ContextKey {
+        uint32_t    parent;
+        const char *name;
+        bool operator==(const ContextKey &other) const { return parent == other.parent && name == other.name; }
+    };
+
+    struct ContextHash {
+        size_t operator()(const ContextKey &key) const {
+            return std::hash<const char*>()(key.name) ^ (size_t(key.parent) * 0x9e3779b97f4a7c15ull);
+        }
+    };
+
+    struct Call {
+        const char *name;
+        uint64_t    start, duration;
+    };
+
+    Event  events[capacity];
+    size_t size = 0;
+
+    std::vector<Frame>                          stack;
+    std::unordered_map<const char*, FuncState>  funcs;
+
+    // node 0 is the root, outside any jitted function
+    std::vector<ContextNode>                                contexts = {ContextNode{nullptr, 0}};
+    std::unordered_map<ContextKey, uint32_t, ContextHash>   contextIds;
+
+    std::vector<Call> calls;
+    bool              callsDropped = false;
+    uint32_t          thread = numThreads.fetch_add(1);
+
+    ~ProfileBuffer() { drain(); }
+
+    void fold() {
+        for (size_t i = 0; i < size; i++) {
+            auto &event = events[i];
+            if (!event.exit) {
+                auto &state = funcs[event.name];
+                state.totals.calls++;
+                state.active++;
+                uint32_t node = keepStacks ? context(stack.empty() ? 0 : stack.back().node, event.name) : 0;
+                stack.push_back(Frame{event.name, event.time, 0, node});
+                continue;
+            }
+
+            // frames above the one exiting were left by an exception which it caught
+            auto match = std::find_if(stack.rbegin(), stack.rend(),
+                [&event](const Frame &frame) { return frame.name == event.name; });
+            if (match != stack.rend()) {
+                popTo(stack.rend() - match - 1, event.time);
+            }
+        }
+        size = 0;
+    }
+
+    uint32_t context(uint32_t parent, const char *name) {
+        auto [it, inserted] = contextIds.try_emplace(ContextKey{parent, name}, uint32_t(contexts.size()));
+        if (inserted) {
+            contexts.push_back(ContextNode{name, parent});
+        }
+        return it->second;
+    }
+
+    // ends the calls at stack[depth] and above at time
+    void popTo(size_t depth, uint64_t time) {
+        while (stack.size() > depth) {
+            auto frame = stack.back();
+            stack.pop_back();
+
+            uint64_t elapsed   = time - frame.start;
+            uint64_t exclusive = elapsed - std::min(elapsed, frame.children);
+            auto &state = funcs[frame.name];
+            state.totals.exclusive += exclusive;
+            if (--state.active == 0) {
+                state.totals.inclusive += elapsed;
+            }
+            if (!stack.empty()) {
+                stack.back().children += elapsed;
+            }
+
+            if (keepStacks) {
+                contexts[frame.node].exclusive += exclusive;
+            }
+            if (keepTrace) {
+                if (calls.size() < maxTraceEvents) {
+                    calls.push_back(Call{frame.name, frame.start, elapsed});
+                } else {
+                    callsDropped = true;
+                }
+            }
+        }
+    }
+
+    void drain();
+};
+
+static thread_local ProfileBuffer profileBuffer;
+
+
+void ProfileBuffer::drain() {
+    if (size == 0 && funcs.empty()) {
+        return;
+    }
+    fold();
+    popTo(0, timestamp());
+
+    std::lock_guard<std::mutex> lock(totalsMutex);
+    for (auto &[name, state] : funcs) {
+        auto &total = totals[name];
+        total.calls     += state.totals.calls;
+        total.inclusive += state.totals.inclusive;
+        total.exclusive += state.totals.exclusive;
+    }
+    funcs.clear();
+
+    for (uint32_t node = 1; node < contexts.size(); node++) {
+        if (contexts[node].exclusive == 0) {
+            continue;
+        }
+        std::string folded = contexts[node].name;
+        for (uint32_t parent = contexts[node].parent; parent != 0; parent = contexts[parent].parent) {
+            folded = std::string(contexts[parent].name) + ";" + folded;
+        }
+        stacks[folded] += contexts[node].exclusive;
+    }
+    contexts.resize(1);
+    contextIds.clear();
+
+    traceTruncated |= callsDropped;
+    for (auto &call : calls) {
+        if (trace.size() == maxTraceEvents) {
+            traceTruncated = true;
+            break;
+        }
+        trace.push_back(TraceEvent{call.name, call.start, call.duration, thread});
+    }
+    calls.clear();
+    callsDropped = false;
+}
+
+
+void setProfileStacks(bool folded, bool trace) {
+    keepStacks = folded;
+    keepTrace  = trace;
+}
+
+
+void drainProfile() {
+    profileBuffer.drain();
+}
+
+
+void reportProfile(FILE *out) {
+    drainProfile();
+    double msPerTick = nsPerTick() / 1e6;
+
+    std::lock_guard<std::mutex> lock(totalsMutex);
+    std::vector<std::pair<std::string, Totals>> sorted(totals.begin(), totals.end());
+    std::stable_sort(sorted.begin(), sorted.end(), [](auto &a, auto &b) {
+        return a.second.exclusive > b.second.exclusive;
+    });
+
+    fprintf(out, "===-- profile --===\n");
+    fprintf(out, "%12s %14s %14s  %s\n", "calls", "inclusive ms", "exclusive ms", "function");
+    for (auto &[name, total] : sorted) {
+        fprintf(out, "%12llu %14.3f %14.3f  %s\n", (unsigned long long)total.calls,
+            total.inclusive * msPerTick, total.exclusive * msPerTick, name.c_str());
+    }
+}
+
+
+void writeFoldedStacks(FILE *out) {
+    drainProfile();
+    double ns = nsPerTick();
+
+    std::lock_guard<std::mutex> lock(totalsMutex);
+    for (auto &[stack, ticks] : stacks) {
+        fprintf(out, "%s %llu\n", stack.c_str(), (unsigned long long)(ticks * ns));
+    }
+}
+
+
+// function names are identifiers with suffixes like .pfor0 or " [memo]", escaping is only a precaution
+static void writeJsonString(FILE *out, const std::string &str) {
+    fputc('"', out);
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            fputc('\\', out);
+        }
+        fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+
+void writeTrace(FILE *out) {
+    drainProfile();
+    double usPerTick = nsPerTick() / 1e3;
+
+    std::lock_guard<std::mutex> lock(totalsMutex);
+    if (traceTruncated) {
+        fprintf(stderr, "warning: the trace only has the first %zu calls\n", maxTraceEvents);
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (size_t i = 0; i < trace.size(); i++) {
+        auto &event = trace[i];
+        fprintf(out, "{\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"name\":", event.thread);
+        writeJsonString(out, event.name);
+        fprintf(out, ",\"ts\":%.3f,\"dur\":%.3f}%s\n",
+            (event.start - startTicks) * usPerTick, event.duration * usPerTick,
+            i + 1 < trace.size() ? "," : "");
+    }
+    fprintf(out, "]}\n");
+}
+
+}
+
+
+using namespace runtime;
+
+extern "C" void __ppp_enter(const char *name) {
+    auto &buffer = profileBuffer;
+    if (buffer.size == ProfileBuffer::capacity) {
+        buffer.fold();
+    }
+    buffer.events[buffer.size++] = ProfileBuffer::Event{name, timestamp(), false};
+}
+
+
+extern "C" void __ppp_exit(const char *name) {
+    auto &buffer = profileBuffer;
+    if (buffer.size == ProfileBuffer::capacity) {
+        buffer.fold();
+    }
+    buffer.events[buffer.size++] = ProfileBuffer::Event{name, timestamp(), true};
+}
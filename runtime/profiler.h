@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdio>
+
+// Called on entry to and before each return from a function instrumented by the ppprofiler
+// pass. They append a timestamped event to this thread's buffer, no locks are taken.
+extern "C" void __ppp_enter(const char *name);
+extern "C" void __ppp_exit(const char *name);
+
+namespace runtime {
+
+// Keeps the exclusive time of each distinct call stack for writeFoldedStacks, and each call
+// for writeTrace. Set before jitted code runs.
+void setProfileStacks(bool folded, bool trace);
+
+// Adds this thread's events to the per-function totals. The names point into the jitted
+// modules, so the host drains after each program or cell has run, before its code can be
+// freed. Calls still open, abandoned by an exception or trap, end here.
+void drainProfile();
+
+// Writes the call count and inclusive and exclusive time of each function over all
+// threads, most exclusive time first.
+void reportProfile(FILE *out);
+
+// One line per call stack, "main;fib;fib 1200", with its exclusive time in nanoseconds.
+// The input of flamegraph.pl and speedscope.
+void writeFoldedStacks(FILE *out);
+
+// Chrome trace event JSON with a complete event per call, for about:tracing and Perfetto.
+// Only the first million calls are kept.
+void writeTrace(FILE *out);
+
+}
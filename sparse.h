@@ -76,6 +76,10 @@ public:
         return elements.size() - emptyIndices.size();
     }
 
+    // slots in use or waiting to be reused, and the slots allocated
+    size_t slots() { return elements.size(); }
+    size_t capacity() { return elements.capacity(); }
+
     void clear() {
          emptyIndices.clear();
          elements.clear();
@@ -0,0 +1,68 @@
+// Compiles each source of a script with Engine, the sources are separated by lines holding
+// only ";" like REPL cells. Prints the error a source is rejected with, or calls its run()
+// and prints the result or the exception it throws, in the format of jitCalc's output.
+
+#include <cstdint>
+#include <string>
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "engine.h"
+
+using namespace llvm;
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        errs() << "usage: jitCalc-engine-test <script>\n";
+        return 1;
+    }
+    auto buffer = MemoryBuffer::getFile(argv[1]);
+    if (!buffer) {
+        errs() << "Cannot read " << argv[1] << ": " << buffer.getError().message() << "\n";
+        return 1;
+    }
+
+    auto engine = Engine::create(EngineOptions());
+    if (!engine) {
+        errs() << toString(engine.takeError()) << "\n";
+        return 1;
+    }
+
+    SmallVector<std::string, 16> sources(1);
+    SmallVector<StringRef, 64> lines;
+    (*buffer)->getBuffer().split(lines, '\n');
+    for (auto line : lines) {
+        if (line == ";") {
+            sources.emplace_back();
+        } else {
+            sources.back() += line.str() + "\n";
+        }
+    }
+
+    for (auto &source : sources) {
+        if (StringRef(source).trim().empty()) {
+            continue;
+        }
+
+        auto script = (*engine)->compile(source);
+        if (!script) {
+            outs() << "error: " << toString(script.takeError()) << "\n";
+            continue;
+        }
+        auto run = script->get<int32_t()>("run");
+        if (!run) {
+            outs() << "error: " << toString(run.takeError()) << "\n";
+            continue;
+        }
+
+        try {
+            int32_t result = (*run)();
+            outs() << "result: " << result << "\n";
+        } catch (int payload) {
+            outs() << "caught exception: " << payload << "\n";
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,46 @@
+# Runs one regression script and compares what it printed with the expected output, see
+# jitcalc_test in CMakeLists.txt. The results and exceptions in stdout are kept without the
+# IR and prompts printed around them, followed by stderr and the exit status if it isn't 0.
+#
+#   JITCALC          the executable, jitCalc or jitCalc-engine-test
+#   MODE             file, batch, repl or engine
+#   SCRIPT           the .jc script, given on stdin in repl mode
+#   EXPECTED         the expected output
+#   FLAGS            extra flags, separated by spaces
+#   OUTPUT           optional, a file the run writes which must match OUTPUT_EXPECTED
+
+separate_arguments(flags UNIX_COMMAND "${FLAGS}")
+
+if(MODE STREQUAL "repl")
+    execute_process(COMMAND ${JITCALC} -i ${flags}
+        INPUT_FILE ${SCRIPT} OUTPUT_VARIABLE out ERROR_VARIABLE err RESULT_VARIABLE status)
+elseif(MODE STREQUAL "batch")
+    execute_process(COMMAND ${JITCALC} -batch ${flags} ${SCRIPT}
+        OUTPUT_VARIABLE out ERROR_VARIABLE err RESULT_VARIABLE status)
+else()
+    execute_process(COMMAND ${JITCALC} ${flags} ${SCRIPT}
+        OUTPUT_VARIABLE out ERROR_VARIABLE err RESULT_VARIABLE status)
+endif()
+
+string(REGEX MATCHALL "(result|caught exception|error): [^\n]*" records "${out}")
+string(REPLACE ";" "\n" actual "${records}")
+if(NOT actual STREQUAL "")
+    string(APPEND actual "\n")
+endif()
+string(APPEND actual "${err}")
+if(NOT status EQUAL 0)
+    string(APPEND actual "exit: ${status}\n")
+endif()
+
+file(READ ${EXPECTED} expected)
+if(NOT actual STREQUAL expected)
+    message(FATAL_ERROR "${SCRIPT} printed\n${actual}\ninstead of\n${expected}")
+endif()
+
+if(DEFINED OUTPUT)
+    file(READ ${OUTPUT} written)
+    file(READ ${OUTPUT_EXPECTED} writtenExpected)
+    if(NOT written STREQUAL writtenExpected)
+        message(FATAL_ERROR "${OUTPUT} is\n${written}\ninstead of\n${writtenExpected}")
+    endif()
+endif()